@@ -0,0 +1,210 @@
+/*
+ * Versioned binary checkpoints of model state.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace wmsketch {
+
+/**
+ * Record tag made of four characters, e.g. checkpoint_tag("CELL").
+ */
+constexpr uint32_t checkpoint_tag(const char (&s)[5]) {
+  return (uint32_t) (uint8_t) s[0]
+      | ((uint32_t) (uint8_t) s[1] << 8)
+      | ((uint32_t) (uint8_t) s[2] << 16)
+      | ((uint32_t) (uint8_t) s[3] << 24);
+}
+
+// a checkpoint file is a header followed by a sequence of records and an end record:
+//
+//   header: magic[8] | version (u32) | byte order mark (u32) | model name (char[48], NUL-padded)
+//   record: tag (u32) | flags (u32) | size (u64) | [zero padding to a page boundary] | data | [padding to 8 bytes]
+//
+// records are read back in the order they were written. Large blocks such as sketch tables are page-aligned, so
+// that a reader can use them in place from a memory mapping of the file.
+static const char CHECKPOINT_MAGIC[8] = {'W', 'M', 'S', 'K', 'C', 'K', 'P', 'T'};
+static const uint32_t CHECKPOINT_VERSION = 1;
+static const uint32_t CHECKPOINT_BYTE_ORDER = 0x01020304;
+static const uint32_t CHECKPOINT_MODEL_LEN = 48;
+static const uint64_t CHECKPOINT_PAGE = 4096;
+static const uint32_t CHECKPOINT_ALIGNED = 1;
+
+class CheckpointWriter {
+ private:
+  std::string path_;
+  std::string tmp_path_;
+  int fd_;
+  uint64_t offset_;
+
+ public:
+  /**
+   * Writes a checkpoint to a temporary file next to \p path, which replaces \p path atomically on commit(). Until
+   * then, an existing checkpoint at \p path is left intact, including for readers that have it mapped.
+   *
+   * @param path Path of the checkpoint.
+   * @param model Name of the model type, checked when the checkpoint is loaded.
+   */
+  CheckpointWriter(const std::string& path, const std::string& model);
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+  /**
+   * Discards the temporary file if the checkpoint was not committed.
+   */
+  ~CheckpointWriter();
+
+  /**
+   * Append a record.
+   *
+   * @param tag Record tag.
+   * @param data Record contents.
+   * @param size Size of \p data in bytes.
+   * @param page_aligned Start the contents on a page boundary, so that CheckpointReader::map() can use them in place.
+   */
+  void write(uint32_t tag, const void* data, uint64_t size, bool page_aligned = false);
+
+  /**
+   * Append a record whose contents are the concatenation of several buffers, without copying them together first.
+   *
+   * @param tag Record tag.
+   * @param parts (data, size) pairs in order.
+   */
+  void write_gather(uint32_t tag, const std::vector<std::pair<const void*, uint64_t> >& parts);
+
+  template <class T>
+  void write_value(uint32_t tag, const T& val) {
+    static_assert(std::is_trivially_copyable<T>::value, "Checkpoint values must be trivially copyable");
+    write(tag, &val, sizeof(T));
+  }
+
+  template <class T>
+  void write_vector(uint32_t tag, const std::vector<T>& vals) {
+    static_assert(std::is_trivially_copyable<T>::value, "Checkpoint values must be trivially copyable");
+    write(tag, vals.data(), vals.size() * sizeof(T));
+  }
+
+  void write_string(uint32_t tag, const std::string& s) {
+    write(tag, s.data(), s.size());
+  }
+
+  /**
+   * Append a list of strings as a single record: the string count and lengths followed by the characters.
+   */
+  void write_strings(uint32_t tag, const std::vector<std::string>& strs);
+
+  /**
+   * Write the end record, flush the file to disk and move it to its final path.
+   */
+  void commit();
+
+ private:
+  void write_all(const void* data, uint64_t size);
+  void pad(uint64_t align);
+};
+
+class CheckpointReader {
+ private:
+  std::shared_ptr<void> mapping_;
+  const char* base_;
+  uint64_t size_;
+  uint64_t offset_;
+  std::string model_;
+
+ public:
+  /**
+   * Reads a checkpoint through a private, copy-on-write memory mapping of the file. Blocks returned by map() can be
+   * modified in place without changing the file, and pages are only read from disk when first touched.
+   *
+   * @param path Path of the checkpoint.
+   */
+  explicit CheckpointReader(const std::string& path);
+
+  /**
+   * @return Name of the model type stored in the checkpoint.
+   */
+  const std::string& model() const {
+    return model_;
+  }
+
+  /**
+   * Throw an exception unless the checkpoint holds a model of type \p model.
+   */
+  void expect_model(const std::string& model) const;
+
+  /**
+   * Read the next record, which must have tag \p tag.
+   *
+   * @param tag Expected record tag.
+   * @param size Set to the size of the record in bytes.
+   * @return Pointer to the record contents in the mapping.
+   */
+  const void* read(uint32_t tag, uint64_t& size);
+
+  /**
+   * Copy the next record, which must have tag \p tag and size \p size, to \p out.
+   */
+  void read(uint32_t tag, void* out, uint64_t size);
+
+  template <class T>
+  void read_value(uint32_t tag, T& val) {
+    static_assert(std::is_trivially_copyable<T>::value, "Checkpoint values must be trivially copyable");
+    read(tag, &val, sizeof(T));
+  }
+
+  template <class T>
+  void read_vector(uint32_t tag, std::vector<T>& vals) {
+    static_assert(std::is_trivially_copyable<T>::value, "Checkpoint values must be trivially copyable");
+    uint64_t size;
+    const void* p = read(tag, size);
+    if (size % sizeof(T) != 0) throw std::runtime_error("Malformed checkpoint record");
+    vals.resize(size / sizeof(T));
+    if (size > 0) memcpy(vals.data(), p, size);
+  }
+
+  std::string read_string(uint32_t tag) {
+    uint64_t size;
+    const char* p = (const char*) read(tag, size);
+    return std::string(p, size);
+  }
+
+  void read_strings(uint32_t tag, std::vector<std::string>& out);
+
+  /**
+   * Use the next record in place. The record must be page-aligned and have tag \p tag and size \p size. The returned
+   * block stays valid while the mapping returned by mapping() is alive, and writes to it are private to this process.
+   *
+   * @return Pointer to the record contents in the mapping.
+   */
+  void* map(uint32_t tag, uint64_t size);
+
+  /**
+   * @return Owner of the memory mapping, which is unmapped when the last copy is released.
+   */
+  std::shared_ptr<void> mapping() const {
+    return mapping_;
+  }
+
+  /**
+   * Throw an exception unless the next record is the end record.
+   */
+  void finish();
+
+ private:
+  const char* next(uint32_t tag, uint64_t& size, bool& aligned);
+};
+
+} // namespace wmsketch
+
+#endif /* CHECKPOINT_H_ */
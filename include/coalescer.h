@@ -0,0 +1,139 @@
+/*
+ * Merging of duplicate feature keys within an example.
+ */
+
+#ifndef COALESCER_H_
+#define COALESCER_H_
+
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "stats.h"
+
+namespace wmsketch {
+
+class FeatureCoalescer {
+ private:
+  // open addressing table from key to index in features_; a slot is occupied only if its stamp is current
+  std::vector<uint32_t> keys_;
+  std::vector<uint32_t> slots_;
+  std::vector<uint32_t> stamps_;
+  uint32_t stamp_;
+  uint32_t shift_;
+
+  std::vector<std::pair<uint32_t, float> > features_;
+  std::vector<uint32_t> positions_;
+
+  uint64_t examples_;
+  uint64_t features_in_;
+  uint64_t duplicates_;
+
+ public:
+  /**
+   * Merges features with equal keys within an example by summing their values, so that each key is hashed and
+   * updated once. The table is reused across examples: bumping a generation stamp clears it in constant time.
+   */
+  FeatureCoalescer()
+   : stamp_{0},
+     shift_{64},
+     examples_{0},
+     features_in_{0},
+     duplicates_{0} { }
+
+  /**
+   * Merge the features of an example that share a key.
+   *
+   * @param x Features of the example.
+   * @return Whether \p x has duplicate keys. If so, the merged features are available from features() and
+   *   positions(); otherwise \p x can be used as is.
+   */
+  bool coalesce(const std::vector<std::pair<uint32_t, float> >& x) {
+    uint64_t n = x.size();
+    examples_++;
+    features_in_ += n;
+    if (n < 2) return false;
+
+    // keep the load factor at most 1/2
+    if (2 * n > keys_.size()) {
+      uint64_t cap = 16;
+      while (cap < 2 * n) cap *= 2;
+      keys_.assign(cap, 0);
+      slots_.assign(cap, 0);
+      stamps_.assign(cap, 0);
+      stamp_ = 0;
+      shift_ = 64 - __builtin_ctzll(cap);
+    }
+
+    if (++stamp_ == 0) {
+      std::fill(stamps_.begin(), stamps_.end(), 0);
+      stamp_ = 1;
+    }
+
+    features_.clear();
+    positions_.resize(n);
+    uint64_t mask = keys_.size() - 1;
+    for (uint64_t j = 0; j < n; j++) {
+      uint32_t key = x[j].first;
+      uint64_t i = ((uint64_t) key * 0x9E3779B97F4A7C15ull) >> shift_;
+      while (stamps_[i] == stamp_ && keys_[i] != key) {
+        i = (i + 1) & mask;
+      }
+
+      if (stamps_[i] == stamp_) {
+        features_[slots_[i]].second += x[j].second;
+      } else {
+        stamps_[i] = stamp_;
+        keys_[i] = key;
+        slots_[i] = features_.size();
+        features_.push_back(x[j]);
+      }
+      positions_[j] = slots_[i];
+    }
+
+    uint64_t merged = n - features_.size();
+    duplicates_ += merged;
+    WMSKETCH_COUNT(DUPLICATE_KEYS, merged);
+    return merged > 0;
+  }
+
+  /**
+   * @return Features of the last example passed to coalesce(), with unique keys in order of first occurrence.
+   */
+  const std::vector<std::pair<uint32_t, float> >& features() const {
+    return features_;
+  }
+
+  /**
+   * @return Index in features() of each feature of the last example passed to coalesce().
+   */
+  const std::vector<uint32_t>& positions() const {
+    return positions_;
+  }
+
+  /**
+   * @return Number of examples passed to coalesce().
+   */
+  uint64_t examples() const {
+    return examples_;
+  }
+
+  /**
+   * @return Number of features passed to coalesce().
+   */
+  uint64_t features_in() const {
+    return features_in_;
+  }
+
+  /**
+   * @return Number of features merged into an earlier feature with the same key.
+   */
+  uint64_t duplicates() const {
+    return duplicates_;
+  }
+};
+
+} // namespace wmsketch
+
+#endif /* COALESCER_H_ */
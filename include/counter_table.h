@@ -0,0 +1,279 @@
+/*
+ * Count tables with configurable counter widths.
+ */
+
+#ifndef COUNTER_TABLE_H_
+#define COUNTER_TABLE_H_
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <vector>
+#include "simd.h"
+#include "stats.h"
+
+namespace wmsketch {
+namespace counter {
+
+enum Kind { WIDE, SMALL };
+
+// 32-bit counters
+struct Uint32 {
+  typedef uint32_t storage;
+  static const Kind KIND = WIDE;
+  static const uint32_t ESCAPE = UINT32_MAX;
+  static const char* name() { return "uint32"; }
+};
+
+// 8-bit counters; counts of ESCAPE or more are moved to an overflow table
+struct Uint8 {
+  typedef uint8_t storage;
+  static const Kind KIND = SMALL;
+  static const uint32_t ESCAPE = UINT8_MAX;
+  static const char* name() { return "uint8"; }
+};
+
+} // namespace counter
+
+template <class Counter>
+class CounterTable {
+ public:
+  typedef typename Counter::storage storage;
+  static const uint64_t EMPTY_KEY = UINT64_MAX;
+
+ private:
+  const uint32_t depth_;
+  const uint64_t width_;
+  storage* cells_;
+
+  // open addressing table of full-width counts for escaped cells, keyed by cell offset
+  std::vector<uint64_t> overflow_keys_;
+  std::vector<uint32_t> overflow_vals_;
+  uint64_t overflow_size_;
+  uint32_t overflow_shift_;
+
+ public:
+  /**
+   * A depth x width table of counters. Small counters hold counts below Counter::ESCAPE inline; a cell that reaches
+   * the escape value is marked as such and its count is kept in an overflow table. In a wide sketch most cells stay
+   * small, so this packs several times the width into the same number of bytes.
+   *
+   * @param log2_width Base-2 logarithm of the table width.
+   * @param depth Table depth.
+   */
+  CounterTable(uint32_t log2_width, uint32_t depth)
+   : depth_{depth},
+     width_{1ull << log2_width},
+     overflow_size_{0},
+     overflow_shift_{64} {
+    cells_ = (storage*) calloc(depth_ * width_, sizeof(storage));
+    if (cells_ == nullptr) throw std::bad_alloc();
+  }
+
+  CounterTable(const CounterTable&) = delete;
+  CounterTable& operator=(const CounterTable&) = delete;
+
+  ~CounterTable() {
+    free(cells_);
+  }
+
+  uint32_t depth() const {
+    return depth_;
+  }
+
+  uint64_t width() const {
+    return width_;
+  }
+
+  inline uint32_t get(uint32_t row, uint64_t col) const {
+    return get_at(row * width_ + col);
+  }
+
+  inline void set(uint32_t row, uint64_t col, uint32_t val) {
+    set_at(row * width_ + col, val);
+  }
+
+  inline void increment(uint32_t row, uint64_t col) {
+    storage& c = cells_[row * width_ + col];
+    if (Counter::KIND == counter::WIDE || c < Counter::ESCAPE - 1) {
+      WMSKETCH_COUNT(CELLS, 1);
+      c++;
+    } else {
+      set(row, col, get(row, col) + 1);
+    }
+  }
+
+  /**
+   * @param idx Offset of a cell in the row-major table, i.e. row * width + col.
+   * @return Count held by the cell.
+   */
+  inline uint32_t get_at(uint64_t idx) const {
+    WMSKETCH_COUNT(CELLS, 1);
+    return value(cells_[idx], idx);
+  }
+
+  /**
+   * Read the adjacent cells at offsets 2 * idx and 2 * idx + 1 with a single load. Paired counts stored this way
+   * always share a cache line.
+   *
+   * @param idx Offset of the pair of cells.
+   * @param first Count held by the first cell.
+   * @param second Count held by the second cell.
+   */
+  inline void get_pair(uint64_t idx, uint32_t& first, uint32_t& second) const {
+    WMSKETCH_COUNT(CELLS, 2);
+    storage c[2];
+    memcpy(c, cells_ + 2 * idx, sizeof(c));
+    first = value(c[0], 2 * idx);
+    second = value(c[1], 2 * idx + 1);
+  }
+
+  /**
+   * @param idx Offset of a cell in the row-major table, i.e. row * width + col.
+   * @param val New count of the cell.
+   */
+  inline void set_at(uint64_t idx, uint32_t val) {
+    WMSKETCH_COUNT(CELLS, 1);
+    storage& c = cells_[idx];
+    if (Counter::KIND == counter::WIDE) {
+      c = val;
+    } else if (c == Counter::ESCAPE) {
+      overflow_vals_[find(idx)] = val;
+    } else if (val < Counter::ESCAPE) {
+      c = (storage) val;
+    } else {
+      c = (storage) Counter::ESCAPE;
+      insert(idx, val);
+    }
+  }
+
+  /**
+   * @return Whether every cell offset fits in 31 bits, as required by gather().
+   */
+  bool gatherable() const {
+    return depth_ * width_ <= (1ull << 31);
+  }
+
+  /**
+   * Read a block of cells.
+   *
+   * @param idx Block of simd::WIDTH cell offsets.
+   * @param out Target block of simd::WIDTH counts.
+   */
+  inline void gather(const uint32_t* idx, uint32_t* out) const {
+#ifdef __AVX2__
+    if (Counter::KIND == counter::WIDE) {
+      WMSKETCH_COUNT(CELLS, simd::WIDTH);
+      __m256i v = _mm256_loadu_si256((const __m256i*) idx);
+      _mm256_storeu_si256((__m256i*) out, _mm256_i32gather_epi32((const int*) cells_, v, 4));
+      return;
+    }
+#endif
+    for (uint32_t b = 0; b < simd::WIDTH; b++) {
+      out[b] = get_at(idx[b]);
+    }
+  }
+
+  /**
+   * Read a block of pairs of cells, as stored for get_pair().
+   *
+   * @param idx Block of simd::WIDTH pair offsets.
+   * @param first Target block of simd::WIDTH counts of the first cell of each pair.
+   * @param second Target block of simd::WIDTH counts of the second cell of each pair.
+   */
+  inline void gather_pairs(const uint32_t* idx, uint32_t* first, uint32_t* second) const {
+#ifdef __AVX2__
+    if (Counter::KIND == counter::WIDE) {
+      WMSKETCH_COUNT(CELLS, 2 * simd::WIDTH);
+      // each 64-bit lane holds one pair; sort the first and second counts into the low and high 128-bit halves
+      const long long* pairs = (const long long*) cells_;
+      __m256i perm = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+      __m256i lo = _mm256_i32gather_epi64(pairs, _mm_loadu_si128((const __m128i*) idx), 8);
+      __m256i hi = _mm256_i32gather_epi64(pairs, _mm_loadu_si128((const __m128i*) (idx + 4)), 8);
+      lo = _mm256_permutevar8x32_epi32(lo, perm);
+      hi = _mm256_permutevar8x32_epi32(hi, perm);
+      _mm256_storeu_si256((__m256i*) first, _mm256_permute2x128_si256(lo, hi, 0x20));
+      _mm256_storeu_si256((__m256i*) second, _mm256_permute2x128_si256(lo, hi, 0x31));
+      return;
+    }
+#endif
+    for (uint32_t b = 0; b < simd::WIDTH; b++) {
+      get_pair(idx[b], first[b], second[b]);
+    }
+  }
+
+  inline const storage* cell_ptr(uint32_t row, uint64_t col) const {
+    return cells_ + row * width_ + col;
+  }
+
+  /**
+   * @return Number of cells whose counts are held in the overflow table.
+   */
+  uint64_t overflow_count() const {
+    return overflow_size_;
+  }
+
+  uint64_t size_bytes() const {
+    return depth_ * width_ * sizeof(storage)
+        + overflow_keys_.size() * (sizeof(uint64_t) + sizeof(uint32_t));
+  }
+
+ private:
+  inline uint32_t value(storage c, uint64_t idx) const {
+    if (Counter::KIND == counter::WIDE || c != Counter::ESCAPE) return c;
+    return overflow_vals_[find(idx)];
+  }
+
+  inline uint64_t slot(uint64_t idx) const {
+    return (idx * 0x9E3779B97F4A7C15ull) >> overflow_shift_;
+  }
+
+  // returns the slot of an escaped cell; the cell must be present
+  inline uint64_t find(uint64_t idx) const {
+    uint64_t mask = overflow_keys_.size() - 1;
+    uint64_t i = slot(idx);
+    while (overflow_keys_[i] != idx) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  void insert(uint64_t idx, uint32_t val) {
+    // keep the load factor at most 1/2
+    if (2 * (overflow_size_ + 1) > overflow_keys_.size()) {
+      grow();
+    }
+    uint64_t mask = overflow_keys_.size() - 1;
+    uint64_t i = slot(idx);
+    while (overflow_keys_[i] != EMPTY_KEY) {
+      i = (i + 1) & mask;
+    }
+    overflow_keys_[i] = idx;
+    overflow_vals_[i] = val;
+    overflow_size_++;
+  }
+
+  void grow() {
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> vals;
+    keys.swap(overflow_keys_);
+    vals.swap(overflow_vals_);
+
+    uint64_t cap = keys.empty() ? 16 : 2 * keys.size();
+    overflow_shift_ = 64 - __builtin_ctzll(cap);
+    overflow_keys_.assign(cap, EMPTY_KEY);
+    overflow_vals_.assign(cap, 0);
+    overflow_size_ = 0;
+    for (uint64_t i = 0; i < keys.size(); i++) {
+      if (keys[i] != EMPTY_KEY) insert(keys[i], vals[i]);
+    }
+  }
+};
+
+template <class Counter>
+const uint64_t CounterTable<Counter>::EMPTY_KEY;
+
+} // namespace wmsketch
+
+#endif /* COUNTER_TABLE_H_ */
@@ -5,11 +5,13 @@
 #ifndef COUNTMIN_H_
 #define COUNTMIN_H_
 
+#include "counter_table.h"
 #include "hash.h"
 
 namespace wmsketch {
 
-class CountMinSketch {
+template <class Counter = counter::Uint32>
+class BasicCountMinSketch {
 
  public:
   static const uint32_t MAX_LOG2_WIDTH = 30;
@@ -18,9 +20,8 @@ class CountMinSketch {
   const uint32_t depth_;
   const bool consv_update_;
   uint32_t width_mask_;
-  uint32_t **counts_;
+  CounterTable<Counter> counts_;
   hash::PolynomialHash hash_fn_;
-  std::vector<uint32_t> hash_buf_;
 
  public:
   /**
@@ -31,13 +32,30 @@ class CountMinSketch {
    * @param seed Random seed.
    * @param consv_update Flag to enable conservative update heuristic.
    */
-  CountMinSketch(uint32_t log2_width, uint32_t depth, int32_t seed, bool consv_update = false);
-  ~CountMinSketch();
-  uint32_t get(uint32_t key);
+  BasicCountMinSketch(uint32_t log2_width, uint32_t depth, int32_t seed, bool consv_update = false);
+  ~BasicCountMinSketch();
+  uint32_t get(uint32_t key) const;
   uint32_t update(uint32_t key);
 
+  /**
+   * Update the sketch with a batch of keys. Equivalent to calling update() on each key in order. Blocks of
+   * simd::WIDTH keys whose cells are pairwise disjoint are updated together with a single gather per row; blocks
+   * in which two keys share a cell are updated one key at a time.
+   *
+   * @param keys Keys to update.
+   * @param n Number of keys.
+   * @param counts_out Target array of \p n counts, as returned by update().
+   */
+  void update_batch(const uint32_t* keys, uint64_t n, uint32_t* counts_out);
+
+  /**
+   * @return Number of bytes used by the counter table, including its overflow table.
+   */
+  uint64_t size_bytes() const;
 };
 
+typedef BasicCountMinSketch<counter::Uint32> CountMinSketch;
+
 } // namespace wmsketch
 
 #endif /* COUNTMIN_H_ */
@@ -1,32 +1,201 @@
 #ifndef SRC_COUNTSKETCH_H_
 #define SRC_COUNTSKETCH_H_
 
+#include <memory>
 #include <vector>
+#include "checkpoint.h"
+#include "frozen.h"
 #include "hash.h"
+#include "sketch_delta.h"
+#include "sketch_table.h"
 
 namespace wmsketch {
 
-class CountSketch {
+template <class Cell = cell::Float32>
+class BasicCountSketch {
 
  public:
   static const uint32_t MAX_LOG2_WIDTH = 31;
+  static const uint32_t MAX_HANDLE_DEPTH = 16;
+
+  /**
+   * Hashed cell positions of a key in each row of the sketch. Sketches deeper than MAX_HANDLE_DEPTH only keep the key
+   * and hash it again on each use.
+   */
+  struct Handle {
+    uint32_t key;
+    uint32_t hashes[MAX_HANDLE_DEPTH];
+  };
 
  private:
   const uint32_t depth_;
+  const uint32_t log2_width_;
+  const int32_t seed_;
   uint32_t width_mask_;
-  float** weights_;
+  SketchTable<Cell> weights_;
+  std::unique_ptr<SketchTable<Cell> > sync_base_;  // copy of the table at the last sync point
   hash::TabulationHash hash_fn_;
-  std::vector<uint32_t> hash_buf_;
-  std::vector<float> weight_buf_;
 
  public:
-  CountSketch(uint32_t log2_width, uint32_t depth, int32_t seed);
-  ~CountSketch();
-  float get(uint32_t key);
+  /**
+   * Count-Sketch with cells of type \p Cell.
+   *
+   * @param log2_width Base-2 logarithm of sketch width.
+   * @param depth Sketch depth.
+   * @param seed Random seed.
+   */
+  BasicCountSketch(uint32_t log2_width, uint32_t depth, int32_t seed);
+
+  /**
+   * Fork: a copy of \p other as of now, whose table shares pages with that of \p other copy-on-write.
+   *
+   * @param other Sketch to fork. Must not be used concurrently.
+   */
+  explicit BasicCountSketch(BasicCountSketch& other);
+  ~BasicCountSketch();
+  float get(uint32_t key) const;
+
+  /**
+   * Estimate the values of a batch of keys. Hashing runs ahead of the gather, and the cells of upcoming keys are
+   * prefetched.
+   *
+   * @param keys Keys to query.
+   * @param n Number of keys.
+   * @param out Target array of \p n estimates.
+   */
+  void get_batch(const uint32_t* keys, uint64_t n, float* out) const;
   void update(uint32_t key, float delta);
 
+  /**
+   * Hash a key once for repeated reads and updates through get(const Handle&) and add().
+   *
+   * @param key The key.
+   * @param out Handle for \p key. Valid for the lifetime of this sketch.
+   */
+  void locate(uint32_t key, Handle& out) const;
+  float get(const Handle& handle) const;
+  void add(const Handle& handle, float delta);
+
+  /**
+   * Add \p delta to the value of a key. Each row is visited once, reading the cell before and after the write.
+   *
+   * @param key The key.
+   * @param delta Update to the value.
+   * @return Estimates of the value before and after the update.
+   */
+  std::pair<float, float> add_and_get(uint32_t key, float delta);
+  std::pair<float, float> add_and_get(const Handle& handle, float delta);
+
+  /**
+   * Move the estimate of a key to \p target by adding the difference from its current estimate, as in
+   * update(key, target - get(key)), but hashing the key only once. Cells with limited precision can leave the new
+   * estimate slightly off target.
+   *
+   * @param key The key.
+   * @param target New value.
+   * @return Estimates of the value before and after the update.
+   */
+  std::pair<float, float> set_estimate(uint32_t key, float target);
+  std::pair<float, float> set_estimate(const Handle& handle, float target);
+
+  /**
+   * Move the estimate of each key in a batch to its target, in order, as if by calling update(key, target - get(key))
+   * on each: a key that shares cells with an earlier key sees the earlier correction. The cells of upcoming keys are
+   * prefetched.
+   *
+   * @param keys Keys to update.
+   * @param targets New value of each key.
+   * @param n Number of keys.
+   */
+  void set_estimate_batch(const uint32_t* keys, const float* targets, uint64_t n);
+  void set_estimate_batch(const Handle* handles, const float* targets, uint64_t n);
+
+  /**
+   * Export an immutable inference model backed by this sketch.
+   *
+   * @param exact (key, value) pairs that are stored exactly, e.g. an active set. Values are unscaled.
+   * @param scale Scale applied to sketch estimates and to \p exact values.
+   * @param bias Bias term.
+   * @param quantize Quantize the exported table to 8-bit cells with a per-row scale.
+   * @return The frozen model.
+   */
+  std::shared_ptr<const FrozenModel> freeze(
+      const std::vector<std::pair<uint32_t, float> >& exact,
+      float scale,
+      float bias,
+      bool quantize = false) const;
+
+  /**
+   * @return Number of bytes used by the sketch table.
+   */
+  uint64_t size_bytes() const;
+
+  /**
+   * Append the sketch to a checkpoint.
+   */
+  void save(CheckpointWriter& out) const;
+
+  /**
+   * Restore the sketch from a checkpoint written by save() for a sketch with the same width, depth, seed and cell
+   * type. The table is used in place from the checkpoint mapping.
+   */
+  void load(CheckpointReader& in);
+
+  /**
+   * Append the changes to the sketch since it was last saved, loaded or marked clean to a delta checkpoint.
+   */
+  void save_delta(CheckpointWriter& out) const;
+
+  /**
+   * Apply a delta written by save_delta() to the sketch as of the checkpoint that the delta follows.
+   */
+  void load_delta(CheckpointReader& in);
+
+  /**
+   * Start tracking changes from the current state, once it has been committed to a checkpoint.
+   */
+  void mark_clean();
+
+  /**
+   * Mark the current state as a sync point, e.g. one shared by all replicas of a sketch updated in parallel. The
+   * table is forked copy-on-write, so this takes time proportional to the pages written since the previous sync
+   * point.
+   */
+  void mark_synced();
+
+  /**
+   * Extract the change to the sketch since the last sync point, over the cells written since then.
+   *
+   * @param out Target delta. Overwrites any existing contents.
+   */
+  void extract_delta(SketchDelta& out) const;
+
+  /**
+   * Add a delta extracted from a replica with the same width and depth.
+   *
+   * @param delta Delta to apply.
+   * @param weight Factor applied to the changes.
+   */
+  void apply_delta(const SketchDelta& delta, float weight = 1.f);
+
+  /**
+   * Restore the state as of the last sync point, in time proportional to the blocks written since then.
+   */
+  void revert_to_sync();
+
+ private:
+  void save_config(CheckpointWriter& out) const;
+  void check_config(CheckpointReader& in) const;
+  float estimate(const uint32_t* hashes) const;
+  const uint32_t* handle_hashes(const Handle& handle, uint32_t* buf) const;
+  void scatter(const uint32_t* hashes, float delta);
+  std::pair<float, float> read_modify_write(const uint32_t* hashes, float val, bool absolute);
+  void prefetch(uint32_t* hashes, uint32_t key) const;
+  void prefetch(const Handle& handle) const;
 };
 
+typedef BasicCountSketch<cell::Float32> CountSketch;
+
 } // namespace wmsketch
 
 #endif /* SRC_COUNTSKETCH_H_ */
@@ -0,0 +1,62 @@
+/*
+ * Memory regions that can be forked copy-on-write.
+ */
+
+#ifndef COW_REGION_H_
+#define COW_REGION_H_
+
+#include <cstdlib>
+#include <cstdint>
+#include <memory>
+
+namespace wmsketch {
+
+class CowRegion {
+ private:
+  int fd_;
+  char* addr_;
+  uint64_t size_;
+  std::weak_ptr<void> frozen_;  // image of fd_ mapped by the latest fork, while any fork of it is alive
+
+ public:
+  /**
+   * Memory region backed by a shared memory file and mapped privately, so that a page is copied on its first write.
+   * fork() writes the copied pages back to the file, maps an image of the file for the fork, and remaps the region,
+   * after which the region and the image share every page until one of them writes to it.
+   *
+   * @param data Initial contents. Pages of zeros are not copied.
+   * @param size Size of the region in bytes.
+   */
+  CowRegion(const void* data, uint64_t size);
+  CowRegion(const CowRegion&) = delete;
+  CowRegion& operator=(const CowRegion&) = delete;
+  ~CowRegion();
+
+  void* data() {
+    return addr_;
+  }
+
+  uint64_t size() const {
+    return size_;
+  }
+
+  /**
+   * Map an image of the current contents. Takes time proportional to the number of pages written since the previous
+   * fork, or to the size of the region if an image from the previous fork is still alive. Must not be called
+   * concurrently with reads or writes of the region.
+   *
+   * @return Owner of the image, which is unmapped when the last copy is released. Writes to the image are private to
+   *   it.
+   */
+  std::shared_ptr<void> fork();
+
+ private:
+  static int create_file(uint64_t size);
+  void write_range(int fd, uint64_t offset, uint64_t size);
+  void write_back();
+  void map_region();
+};
+
+} // namespace wmsketch
+
+#endif /* COW_REGION_H_ */
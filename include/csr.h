@@ -0,0 +1,67 @@
+/*
+ * Batches of sparse examples in compressed sparse row (CSR) format.
+ */
+
+#ifndef CSR_H_
+#define CSR_H_
+
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+
+namespace wmsketch {
+
+/**
+ * A batch of sparse examples. The features of row i are (indices[j], values[j]) for j in [indptr[i], indptr[i+1]).
+ */
+struct CSR {
+  std::vector<uint64_t> indptr;
+  std::vector<uint32_t> indices;
+  std::vector<float> values;
+
+  CSR() : indptr(1, 0) { }
+
+  size_t rows() const {
+    return indptr.size() - 1;
+  }
+
+  size_t nnz() const {
+    return indices.size();
+  }
+
+  void clear() {
+    indptr.resize(1);
+    indices.clear();
+    values.clear();
+  }
+
+  /**
+   * Append an example to the batch.
+   *
+   * @param x Sparse feature vector of (index, value) pairs.
+   */
+  void push_back(const std::vector<std::pair<uint32_t, float> >& x) {
+    for (const auto& p : x) {
+      indices.push_back(p.first);
+      values.push_back(p.second);
+    }
+    indptr.push_back(indices.size());
+  }
+
+  /**
+   * Copy row \p i into a sparse feature vector of (index, value) pairs.
+   *
+   * @param i Row index.
+   * @param out Target feature vector. Overwrites any existing contents of the vector.
+   */
+  void row(size_t i, std::vector<std::pair<uint32_t, float> >& out) const {
+    out.clear();
+    for (uint64_t j = indptr[i]; j < indptr[i+1]; j++) {
+      out.emplace_back(indices[j], values[j]);
+    }
+  }
+};
+
+} // namespace wmsketch
+
+#endif /* CSR_H_ */
@@ -0,0 +1,155 @@
+/*
+ * Atomic publication of immutable objects from a single writer to concurrent readers, with epoch-based reclamation.
+ */
+
+#ifndef EPOCH_POINTER_H_
+#define EPOCH_POINTER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace wmsketch {
+
+template <class T>
+class EpochPointer {
+ private:
+  // one cache line per reader, so that pinning never writes to a line shared with another thread
+  struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> epoch;  // epoch observed by the reader while pinned, or 0 when not pinned
+  };
+
+  // slots are allocated with posix_memalign, since new[] does not honor over-alignment before C++17
+  struct SlotDeleter {
+    void operator()(ReaderSlot* p) const {
+      free(p);
+    }
+  };
+
+  std::atomic<const T*> current_;
+  std::atomic<uint64_t> epoch_;
+  std::unique_ptr<ReaderSlot[], SlotDeleter> slots_;
+  const uint32_t num_readers_;
+  std::vector<std::pair<uint64_t, const T*> > retired_;  // (epoch of retirement, object); accessed only by the writer
+
+ public:
+  /**
+   * RAII handle to a published object. The object is not freed while the guard is alive.
+   */
+  class Guard {
+   private:
+    ReaderSlot* slot_;
+    const T* ptr_;
+
+   public:
+    Guard(ReaderSlot* slot, const T* ptr) : slot_{slot}, ptr_{ptr} { }
+    Guard(Guard&& other) : slot_{other.slot_}, ptr_{other.ptr_} { other.slot_ = nullptr; }
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+
+    ~Guard() {
+      if (slot_ != nullptr) slot_->epoch.store(0);
+    }
+
+    const T& operator*() const {
+      return *ptr_;
+    }
+
+    const T* operator->() const {
+      return ptr_;
+    }
+
+    const T* get() const {
+      return ptr_;
+    }
+  };
+
+  /**
+   * Pointer to an immutable object that a writer replaces with a single atomic swap. Each of a fixed set of readers
+   * announces the global epoch in its own slot while it holds the object, so readers never block and never write to
+   * shared cache lines. A replaced object is retired with the epoch of the swap and freed by the writer once every
+   * pinned reader has announced a later epoch, since such readers can only have seen the new object.
+   *
+   * @param num_readers Number of reader threads, identified by 0 .. num_readers - 1.
+   */
+  explicit EpochPointer(uint32_t num_readers)
+   : current_{nullptr},
+     epoch_{1},
+     num_readers_{num_readers} {
+    void* mem = nullptr;
+    if (posix_memalign(&mem, alignof(ReaderSlot), (num_readers > 0 ? num_readers : 1) * sizeof(ReaderSlot)) != 0) {
+      throw std::bad_alloc();
+    }
+    slots_.reset((ReaderSlot*) mem);
+    for (uint32_t i = 0; i < num_readers; i++) {
+      new (&slots_[i]) ReaderSlot();
+      slots_[i].epoch.store(0);
+    }
+  }
+
+  EpochPointer(const EpochPointer&) = delete;
+  EpochPointer& operator=(const EpochPointer&) = delete;
+
+  ~EpochPointer() {
+    for (auto& r : retired_) {
+      delete r.second;
+    }
+    delete current_.load();
+  }
+
+  /**
+   * Pin the latest object. Wait-free. A reader must release its guard before pinning again.
+   *
+   * @param reader Index of the calling reader.
+   * @return Guard for the latest object, which is nullptr before the first publish().
+   */
+  Guard read(uint32_t reader) {
+    if (reader >= num_readers_) throw std::out_of_range("Invalid reader index");
+    ReaderSlot* slot = &slots_[reader];
+    slot->epoch.store(epoch_.load());
+    return Guard(slot, current_.load());
+  }
+
+  /**
+   * Replace the published object and free the objects retired earlier that no reader can still hold. Must only be
+   * called from the writer thread.
+   *
+   * @param obj New object. Ownership passes to this pointer.
+   */
+  void publish(std::unique_ptr<const T> obj) {
+    const T* old = current_.exchange(obj.release());
+    uint64_t e = epoch_.fetch_add(1);
+    if (old != nullptr) retired_.emplace_back(e, old);
+    reclaim();
+  }
+
+  /**
+   * Free the retired objects that no reader can still hold. Must only be called from the writer thread.
+   *
+   * @return Number of retired objects that are still held by readers.
+   */
+  size_t reclaim() {
+    uint64_t min_epoch = UINT64_MAX;
+    for (uint32_t i = 0; i < num_readers_; i++) {
+      uint64_t e = slots_[i].epoch.load();
+      if (e != 0 && e < min_epoch) min_epoch = e;
+    }
+
+    size_t kept = 0;
+    for (auto& r : retired_) {
+      if (r.first < min_epoch) delete r.second;
+      else retired_[kept++] = r;
+    }
+    retired_.resize(kept);
+    return kept;
+  }
+};
+
+} // namespace wmsketch
+
+#endif /* EPOCH_POINTER_H_ */
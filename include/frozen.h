@@ -0,0 +1,90 @@
+/*
+ * Read-only inference model exported from a trained sketch.
+ */
+
+#ifndef FROZEN_H_
+#define FROZEN_H_
+
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+#include "csr.h"
+#include "hash.h"
+
+namespace wmsketch {
+
+class FrozenModel {
+
+ private:
+  static const uint64_t EMPTY_KEY = UINT64_MAX;
+
+  hash::TabulationHash hash_fn_;
+  const uint32_t depth_;
+  const uint32_t width_mask_;
+  const bool median_;
+  bool quantized_;
+  const float bias_;
+  std::vector<float> weights_;      // depth x width table with the sketch scale folded in
+  std::vector<int8_t> qweights_;    // quantized table, used in place of weights_ when quantized_
+  std::vector<float> row_scales_;   // dequantization factor for each row of qweights_
+  std::vector<uint64_t> keys_;      // open-addressing table of precomputed weights
+  std::vector<float> vals_;
+  uint32_t key_shift_;
+
+ public:
+  /**
+   * Immutable linear model exported from a sketch. A weight is read from a flat hash table of precomputed weights
+   * when its key is present there, and is otherwise estimated from the sketch table. All methods are const and
+   * reentrant, so a single instance can be shared by concurrent readers without locks.
+   *
+   * @param hash_fn Hash family of the sketch.
+   * @param depth Sketch depth.
+   * @param log2_width Base-2 logarithm of the sketch width.
+   * @param weights Row-major depth x width sketch table.
+   * @param scale Global scale of the sketch table. This is folded into the exported weights.
+   * @param bias Bias term.
+   * @param median Estimate weights with the median of the row estimates (true) or with the mean (false).
+   * @param exact (key, weight) pairs that are stored exactly, e.g. an active set. Weights are unscaled.
+   * @param precompute Keys whose sketch estimates are precomputed into the flat hash table, e.g. a top-k set.
+   * @param quantize Quantize the sketch table to 8-bit cells with a per-row scale.
+   */
+  FrozenModel(
+      const hash::TabulationHash& hash_fn,
+      uint32_t depth,
+      uint32_t log2_width,
+      std::vector<float> weights,
+      float scale,
+      float bias,
+      bool median,
+      const std::vector<std::pair<uint32_t, float> >& exact,
+      const std::vector<uint32_t>& precompute,
+      bool quantize = false);
+  ~FrozenModel() = default;
+  float get(uint32_t key) const;
+  float dot(const std::vector<std::pair<uint32_t, float> >& x) const;
+  bool predict(const std::vector<std::pair<uint32_t, float> >& x) const;
+
+  /**
+   * Compute the margins of a batch of examples.
+   *
+   * @param x Batch of examples.
+   * @param margins_out Target array of x.rows() margins, including the bias term.
+   */
+  void predict_batch(const CSR& x, float* margins_out) const;
+  float bias() const;
+
+  /**
+   * @return Number of bytes used by the sketch table and the flat hash table.
+   */
+  uint64_t size_bytes() const;
+
+ private:
+  const float* find(uint32_t key) const;
+  void insert(uint32_t key, float val);
+  float estimate(const uint32_t* hashes) const;
+  void prefetch(uint32_t* hashes, uint32_t key) const;
+};
+
+} // namespace wmsketch
+
+#endif /* FROZEN_H_ */
@@ -8,41 +8,83 @@
 #include <cstdlib>
 #include <cstdint>
 #include <vector>
+#include "stats.h"
 
 namespace wmsketch {
 namespace hash {
 
+// 2-independent polynomial hash parameters
+static const uint32_t PHASH_MOD = 2147483647;  // 2^31 - 1
+static const uint32_t PHASH_HL = 31;
+
+// tabulation hashing
+static const size_t THASH_CHUNK_BITS = 8;
+static const size_t THASH_NUM_CHUNKS = 32 / THASH_CHUNK_BITS;
+static const size_t THASH_CHUNK_CARD = 1 << THASH_CHUNK_BITS;
+static_assert(THASH_NUM_CHUNKS == 4, "TabulationHash::hash_impl assumes four chunks per key");
+
+/**
+ * Base class for hash families that compute a fixed number of independent 32-bit hashes of a key.
+ *
+ * Dispatch is static (CRTP): sketches hold a concrete hash family, and the hash computation is defined inline in this
+ * header so that it can be inlined into the sketch query and update loops.
+ */
+template <class Derived>
 class HashFunction {
  public:
-  virtual ~HashFunction() = default;
-  virtual void hash(uint32_t* out, uint32_t x) = 0;
+  inline void hash(uint32_t* out, uint32_t x) const {
+    WMSKETCH_COUNT(HASHES, 1);
+    static_cast<const Derived*>(this)->hash_impl(out, x);
+  }
 };
 
-class PolynomialHash : public HashFunction {
+class PolynomialHash : public HashFunction<PolynomialHash> {
+  friend class HashFunction<PolynomialHash>;
+
  private:
   uint32_t** table_;
   uint32_t copies_;
 
  public:
   PolynomialHash(uint32_t copies, int32_t seed);
-  ~PolynomialHash() override;
-  void hash(uint32_t* out, uint32_t x) override;
+  PolynomialHash(const PolynomialHash& other);
+  PolynomialHash& operator=(const PolynomialHash&) = delete;
+  ~PolynomialHash();
+
+ private:
+  inline void hash_impl(uint32_t* out, uint32_t x) const {
+    const uint32_t* coeffs = table_[0];
+    for (uint32_t i = 0; i < copies_; i++) {
+      uint64_t res = ((uint64_t) coeffs[2*i] * x) + coeffs[2*i + 1];
+      res = ((res >> PHASH_HL) + res) & PHASH_MOD;
+      out[i] = (uint32_t) res;
+    }
+  }
 };
 
-// tabulation hashing
-static const size_t THASH_CHUNK_BITS = 8;
-static const size_t THASH_NUM_CHUNKS = 32 / THASH_CHUNK_BITS;
-static const size_t THASH_CHUNK_CARD = 1 << THASH_CHUNK_BITS;
+class TabulationHash : public HashFunction<TabulationHash> {
+  friend class HashFunction<TabulationHash>;
 
-class TabulationHash : public HashFunction {
  private:
   uint32_t** table_;
   uint32_t copies_;
 
  public:
   TabulationHash(uint32_t copies, int32_t seed);
-  ~TabulationHash() override;
-  void hash(uint32_t* out, uint32_t x) override;
+  TabulationHash(const TabulationHash& other);
+  TabulationHash& operator=(const TabulationHash&) = delete;
+  ~TabulationHash();
+
+ private:
+  inline void hash_impl(uint32_t* out, uint32_t x) const {
+    const uint32_t* h0 = table_[0] + (x & (THASH_CHUNK_CARD - 1)) * copies_;
+    const uint32_t* h1 = table_[1] + ((x >> THASH_CHUNK_BITS) & (THASH_CHUNK_CARD - 1)) * copies_;
+    const uint32_t* h2 = table_[2] + ((x >> (2 * THASH_CHUNK_BITS)) & (THASH_CHUNK_CARD - 1)) * copies_;
+    const uint32_t* h3 = table_[3] + ((x >> (3 * THASH_CHUNK_BITS)) & (THASH_CHUNK_CARD - 1)) * copies_;
+    for (uint32_t j = 0; j < copies_; j++) {
+      out[j] = h0[j] ^ h1[j] ^ h2[j] ^ h3[j];
+    }
+  }
 };
 
 // 32-bit MurmurHash3
@@ -17,32 +17,46 @@
 #include <random>
 #include <algorithm>
 #include <functional>
+#include "stats.h"
 
 namespace wmsketch {
 
-template <class T, class H = std::hash<T>>
+// placeholder for heaps that carry no auxiliary data with their items
+struct NoAux { };
+
+template <class T, class H = std::hash<T>, class A = NoAux>
 class TopKHeap {
  private:
   uint32_t capacity_;
   uint32_t n_;
+  uint64_t version_;  // incremented whenever the set of items or their values change
   std::vector<T> pq_;  // [1, capacity+1) -> idx
+  std::vector<A> aux_;  // [1, capacity+1) -> auxiliary data
   std::unordered_map<T, std::pair<uint32_t, float>, H> qp_;  // idx -> ([1, capacity+1), val)
+  A evicted_aux_;
 
  public:
   /**
    * Min-heap for tracking top-k items ordered by the magnitude of a floating point value associated with each item.
    * When an item is added to a heap that already contains k items, the item with the lowest-magnitude value is evicted.
+   * Each item carries a value of type \p A, e.g. data that is expensive to recompute when the item is evicted.
    *
    * @param capacity Heap capacity.
    */
   explicit TopKHeap(uint32_t capacity)
    : capacity_{capacity},
-     n_{0} {
+     n_{0},
+     version_{0} {
     pq_.resize(capacity + 1);
+    aux_.resize(capacity + 1);
     qp_.reserve(capacity + 1);
   }
 
   ~TopKHeap() = default;
+  uint32_t capacity() {
+    return capacity_;
+  }
+
   uint32_t size() {
     return n_;
   }
@@ -55,6 +69,13 @@ class TopKHeap {
     return n_ == capacity_;
   }
 
+  /**
+   * @return Counter that changes whenever an item is added or removed or its value changes.
+   */
+  uint64_t version() {
+    return version_;
+  }
+
   bool contains(const T& key) {
     return qp_.find(key) != qp_.end();
   }
@@ -63,6 +84,17 @@ class TopKHeap {
     return qp_.at(key).second;
   }
 
+  const A& aux(const T& key) {
+    return aux_[qp_.at(key).first];
+  }
+
+  /**
+   * @return Auxiliary data of the item most recently returned by insert() or del_min().
+   */
+  const A& evicted_aux() {
+    return evicted_aux_;
+  }
+
   void keys(std::vector<T>& out) {
     out.clear();
     for (int i = 1; i <= n_; i++) {
@@ -80,34 +112,85 @@ class TopKHeap {
   void change_val(const T& key, float val) {
     if (!contains(key)) throw std::invalid_argument("Key does not exist");
     qp_.at(key).second = val;
+    version_++;
     swim(qp_.at(key).first);
     sink(qp_.at(key).first);
   }
 
+  /**
+   * Change the values of a set of existing items. A few items are sifted into place one at a time, in O(n log size)
+   * time; when that would cost more than rebuilding the heap, order is restored with a single bottom-up heapify in
+   * O(size) time instead.
+   *
+   * @param keys Keys of items in the heap.
+   * @param vals New value for each key.
+   * @param n Number of keys.
+   */
+  void change_vals(const T* keys, const float* vals, size_t n) {
+    uint32_t log_size = 1;
+    while ((1u << log_size) <= n_) log_size++;
+    bool heapify = n * log_size > n_;
+
+    for (size_t i = 0; i < n; i++) {
+      auto it = qp_.find(keys[i]);
+      if (it == qp_.end()) throw std::invalid_argument("Key does not exist");
+      it->second.second = vals[i];
+      if (!heapify) {
+        uint32_t k = it->second.first;
+        swim(k);
+        sink(qp_.at(keys[i]).first);
+      }
+    }
+    version_++;
+    if (!heapify) return;
+    for (uint32_t k = n_ / 2; k >= 1; k--) {
+      sink(k);
+    }
+  }
+
+  /**
+   * Multiply every value by a positive factor. Heap order is unchanged.
+   *
+   * @param s Positive factor.
+   */
+  void scale_vals(float s) {
+    for (auto& it : qp_) {
+      it.second.second *= s;
+    }
+    version_++;
+  }
+
   /**
    * Attempt to insert an item with key \p key and value \p val. Throws an exception if an item with key \p key already
    * exists. If the heap is full, returns the evicted item (this can be the item that the caller just tried to insert).
    *
    * @param key The key.
    * @param val The value (e.g. a weight).
-   * @return The evicted item, if any.
+   * @param aux Auxiliary data of the item.
+   * @return The evicted item, if any. Its auxiliary data is available from evicted_aux().
    */
   std::experimental::optional<std::pair<T, float> >
-  insert(const T& key, float val) {
+  insert(const T& key, float val, const A& aux = A()) {
     if (contains(key)) throw std::invalid_argument("Key already exists");
     bool opt = false;
     std::pair<T, float> evicted;
     if (n_ == capacity_) {
       opt = true;
       if (fabs(min_val()) > fabs(val)) {
+        WMSKETCH_COUNT(HEAP_REJECTIONS, 1);
+        evicted_aux_ = aux;
         return std::make_pair(key, val);
       } else {
+        WMSKETCH_COUNT(HEAP_EVICTIONS, 1);
         evicted = del_min();
       }
     }
+    WMSKETCH_COUNT(HEAP_INSERTS, 1);
     n_++;
+    version_++;
     qp_[key] = std::make_pair(n_, val);
     pq_[n_] = key;
+    aux_[n_] = aux;
     swim(n_);
     if (opt) return evicted;
     else return {};
@@ -132,6 +215,15 @@ class TopKHeap {
     }
   }
 
+  /**
+   * Remove every item.
+   */
+  void clear() {
+    n_ = 0;
+    version_++;
+    qp_.clear();
+  }
+
   float min_val() {
     if (n_ == 0) throw std::runtime_error("Priority queue underflow");
     const T& idx = pq_[1];
@@ -147,7 +239,9 @@ class TopKHeap {
   std::pair<T, float> del_min() {
     if (n_ == 0) throw std::runtime_error("Priority queue underflow");
     auto pair = std::make_pair(pq_[1], qp_.at(pq_[1]).second);
+    evicted_aux_ = aux_[1];
     exch(1, n_--);
+    version_++;
     sink(1);
     qp_.erase(pair.first);
     return pair;
@@ -160,6 +254,7 @@ class TopKHeap {
 
   void exch(uint32_t i, uint32_t j) {
     std::iter_swap(pq_.begin() + i, pq_.begin() + j);
+    std::iter_swap(aux_.begin() + i, aux_.begin() + j);
     qp_.at(pq_[i]).first = i;
     qp_.at(pq_[j]).first = j;
   }
@@ -186,6 +281,7 @@ class TopKCountHeap {
  private:
   uint32_t capacity_;
   uint32_t n_;
+  uint64_t version_;  // incremented whenever the set of items or their values change
   std::vector<uint32_t> pq_;
   std::unordered_map<uint32_t, std::tuple<uint32_t, uint32_t, float> > qp_;  // idx -> ([1, capacity+1], count, val)
 
@@ -201,6 +297,12 @@ class TopKCountHeap {
   uint32_t size();
   bool is_empty();
   bool is_full();
+
+  /**
+   * @return Counter that changes whenever an item is added or removed or its value changes. Count increments that
+   *   leave values unchanged do not advance it.
+   */
+  uint64_t version();
   bool contains(uint32_t key);
   float get(uint32_t key);
   void keys(std::vector<uint32_t>& out);
@@ -262,6 +364,7 @@ class WeightedReservoir {
  private:
   uint32_t capacity_;
   uint32_t n_;
+  uint64_t version_;  // incremented whenever the set of items or their values change
   std::vector<uint32_t> pq_;
   std::unordered_map<uint32_t, std::tuple<uint32_t, float, float> > qp_;  // idx -> ([1, capacity+1], rand_key, val)
   std::mt19937 gen_;
@@ -288,6 +391,11 @@ class WeightedReservoir {
   uint32_t size();
   bool is_empty();
   bool is_full();
+
+  /**
+   * @return Counter that changes whenever an item is added or removed or its value changes.
+   */
+  uint64_t version();
   bool contains(uint32_t key);
   float get(uint32_t key);
   void keys(std::vector<uint32_t>& out);
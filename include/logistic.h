@@ -25,14 +25,14 @@ class LogisticRegression : public BinaryEstimator {
  public:
   explicit LogisticRegression(uint32_t dim, float lr_init = 0.1, float l2_reg = 1e-3, bool no_bias = false);
   ~LogisticRegression() override = default;
-  float get(uint32_t key) override;
+  float get(uint32_t key) const override;
   float dot(const std::vector<std::pair<uint32_t, float> >& x);
   bool predict(uint32_t key);
   bool predict(const std::vector<std::pair<uint32_t, float> >& x);
   bool update(uint32_t key, bool label) override;
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label) override;
   bool update(std::vector<float>& new_weights, const std::vector<std::pair<uint32_t, float> >& x, bool label) override;
-  float bias() override;
+  float bias() const override;
 };
 
 } // namespace wmsketch
@@ -5,55 +5,315 @@
 #ifndef LOGISTIC_SKETCH_H_
 #define LOGISTIC_SKETCH_H_
 
+#include <chrono>
+#include <memory>
 #include <vector>
 #include "binary_estimator.h"
+#include "checkpoint.h"
+#include "coalescer.h"
+#include "csr.h"
+#include "frozen.h"
 #include "hash.h"
+#include "sketch_delta.h"
+#include "sketch_table.h"
 
 namespace wmsketch {
 
-class LogisticSketch : public BinaryEstimator {
+// unit of time for exponential weight decay
+enum DecayClock { DECAY_EXAMPLES, DECAY_SECONDS };
+
+template <class Cell = cell::Float32>
+class BasicLogisticSketch : public BinaryEstimator {
 
  public:
   static const uint32_t MAX_LOG2_WIDTH = 31;
 
+  // scale below which the next update folds the scale into the sketch cells
+  static constexpr float MIN_SCALE = 1e-6f;
+
  private:
-  float** weights_;
+  SketchTable<Cell> weights_;
   float bias_;
   const float lr_init_;
   const float l2_reg_;
   float scale_;
   uint64_t t_;
   const uint32_t depth_;
+  const uint32_t log2_width_;
   uint32_t width_mask_;
   const bool median_update_;
+  const int32_t seed_;
   hash::TabulationHash hash_fn_;
+
+  // scratch space for updates; queries keep theirs on the stack, so that they can run concurrently
   std::vector<uint32_t> hash_buf_;
-  std::vector<float> weight_buf_, weight_medians_, weight_means_;
+  std::vector<float> weight_medians_, weight_means_;
+  std::vector<float> margin_buf_, coef_buf_;
+  std::vector<uint32_t> order_buf_;
+  FeatureCoalescer coalescer_;
+  bool dedup_;
+  std::vector<float> dedup_weights_;
+
+  // exponential decay, applied through the global scale
+  float half_life_;
+  DecayClock decay_clock_;
+  float example_decay_;
+  std::chrono::steady_clock::time_point last_tick_;
+  uint64_t renormalizations_;
+
+  // tumbling window: the table of the previous period still contributes to estimates
+  std::unique_ptr<SketchTable<Cell> > prev_;
+  uint64_t window_;
+  uint64_t window_t_;
+
+  // replica sync: a copy of the table at the last sync point, and the scalar state then
+  std::unique_ptr<SketchTable<Cell> > sync_base_;
+  float sync_scale_;
+  float sync_bias_;
+  uint64_t sync_t_;
+  float sync_renorm_;  // product of the factors folded into the cells by renormalizations since then
 
  public:
-  LogisticSketch(
+  /**
+   * Logistic regression with the Weight-Median Sketch, using sketch cells of type \p Cell.
+   *
+   * @param log2_width Base-2 logarithm of sketch width.
+   * @param depth Sketch depth.
+   * @param seed Random seed.
+   * @param lr_init Initial learning rate.
+   * @param l2_reg L2 regularization parameter.
+   * @param median_update Use median weight estimates during each update, instead of the mean of the row estimates.
+   */
+  BasicLogisticSketch(
       uint32_t log2_width,
       uint32_t depth,
       int32_t seed,
       float lr_init = 0.1,
       float l2_reg = 1e-3,
       bool median_update = false);
-  ~LogisticSketch() override;
-  float get(uint32_t key) override;
-  float dot(const std::vector<std::pair<uint32_t, float> >& x);
-  bool predict(uint32_t key);
-  bool predict(const std::vector<std::pair<uint32_t, float> >& x);
+
+  /**
+   * Fork: a copy of \p other as of now, e.g. for evaluation or checkpointing while \p other keeps training. The
+   * sketch tables share pages with those of \p other copy-on-write, so forking takes time independent of the sketch
+   * size, and afterwards each sketch pays for a page copy only on its first write to the page.
+   *
+   * @param other Sketch to fork. Must not be used concurrently.
+   */
+  explicit BasicLogisticSketch(BasicLogisticSketch& other);
+  ~BasicLogisticSketch() override;
+  float get(uint32_t key) const override;
+
+  /**
+   * Estimate the weights of a batch of keys, as returned by get(). Hashing runs ahead of the gather, and the cells
+   * of upcoming keys are prefetched.
+   *
+   * @param keys Keys to query.
+   * @param n Number of keys.
+   * @param out Target array of \p n estimates.
+   */
+  void get_batch(const uint32_t* keys, uint64_t n, float* out) const;
+  float dot(const std::vector<std::pair<uint32_t, float> >& x) const;
+  bool predict(uint32_t key) const;
+  bool predict(const std::vector<std::pair<uint32_t, float> >& x) const;
+
+  /**
+   * Compute the margins of a batch of examples. Hashing runs ahead of the gather, and the cells of upcoming features
+   * are prefetched. The probability of a positive label for row i is sigmoid(margins_out[i]).
+   *
+   * @param x Batch of examples.
+   * @param margins_out Target array of x.rows() margins, including the bias term.
+   */
+  void predict_batch(const CSR& x, float* margins_out) const;
   bool update(uint32_t key, bool label) override;
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label) override;
   bool update(std::vector<float>& new_weights, const std::vector<std::pair<uint32_t, float> >& x, bool label) override;
-  float bias() override;
-  float scale();
+
+  /**
+   * Mini-batch update. Margins for all examples in the batch are computed against the current model before any
+   * updates are applied. The per-example learning rates and regularization steps are the same as those of a sequence
+   * of single-example updates. The summed gradient is then scattered into the sketch once, with duplicate feature keys
+   * coalesced.
+   *
+   * @param yhat Target vector for the predicted label of each example. Overwrites any existing contents.
+   * @param x Batch of examples.
+   * @param labels Label of each example.
+   */
+  void update_batch(std::vector<bool>& yhat, const CSR& x, const std::vector<bool>& labels);
+
+  /**
+   * Mini-batch update that also outputs the updated weight estimate of each distinct feature key in the batch.
+   *
+   * @param yhat Target vector for the predicted label of each example. Overwrites any existing contents.
+   * @param new_weights Target vector of (key, new weight) pairs for each distinct feature key in the batch. Weights
+   *   are unscaled. Overwrites any existing contents.
+   * @param x Batch of examples.
+   * @param labels Label of each example.
+   */
+  void update_batch(
+      std::vector<bool>& yhat,
+      std::vector<std::pair<uint32_t, float> >& new_weights,
+      const CSR& x,
+      const std::vector<bool>& labels);
+  float bias() const override;
+  float scale() const;
+
+  /**
+   * Merge features with duplicate keys within each example before single-example updates, so that each key is
+   * hashed and updated once. Mini-batch updates always coalesce duplicate keys.
+   *
+   * @param dedup Whether to merge duplicate keys.
+   */
+  void set_dedup(bool dedup);
+
+  /**
+   * @return Coalescer used to merge duplicate keys, with counts of the features it has seen and merged.
+   */
+  const FeatureCoalescer& coalescer() const;
+
+  /**
+   * Forget old examples by decaying every weight exponentially with time. The decay is folded into the global scale,
+   * so it costs O(1) per update; the cells are only rewritten when the scale falls below MIN_SCALE.
+   *
+   * @param half_life Time over which a weight decays to half its value, in units of \p clock, or 0 to disable decay.
+   * @param clock Count time in examples or in wall-clock seconds.
+   */
+  void set_decay(float half_life, DecayClock clock = DECAY_EXAMPLES);
+
+  /**
+   * Keep estimates over a tumbling window. Updates go to the current table; after \p period examples, the current
+   * table replaces the previous one, whose contents are dropped. Estimates sum both tables, so they cover the last
+   * \p period to 2 * \p period examples. The second table doubles the memory of the sketch. Must be called before the
+   * first update, unless \p period equals the current period.
+   *
+   * @param period Number of examples per table, or 0 to disable the window.
+   */
+  void set_window(uint64_t period);
+
+  /**
+   * Fold the global scale into the sketch cells and reset it to 1. Unscaled weights previously returned by the
+   * sketch, e.g. by update(new_weights, ...), must be multiplied by the returned factor to stay valid.
+   *
+   * @return The scale before renormalization.
+   */
+  float renormalize();
+
+  /**
+   * @return Number of renormalizations so far, including those triggered by updates.
+   */
+  uint64_t renormalizations() const;
+
+  /**
+   * Export an immutable inference model. The current scale is folded into the exported table.
+   *
+   * @param quantize Quantize the exported table to 8-bit cells with a per-row scale.
+   * @return The frozen model.
+   */
+  std::shared_ptr<const FrozenModel> freeze(bool quantize = false) const;
+
+  /**
+   * Export an immutable inference model with the weight estimates of \p keys (e.g. a top-k set) precomputed into a
+   * flat hash table.
+   *
+   * @param keys Keys whose weights are precomputed.
+   * @param quantize Quantize the exported table to 8-bit cells with a per-row scale.
+   * @return The frozen model.
+   */
+  std::shared_ptr<const FrozenModel> freeze(const std::vector<uint32_t>& keys, bool quantize = false) const;
+
+  /**
+   * @return Number of bytes used by the sketch tables.
+   */
+  uint64_t size_bytes() const;
+
+  /**
+   * Append the training state to a checkpoint: the sketch tables, bias, scale, step count, and decay and window
+   * settings.
+   */
+  void save(CheckpointWriter& out) const;
+
+  /**
+   * Restore the training state from a checkpoint written by save() for a sketch with the same width, depth, seed,
+   * cell type and update parameters. The tables are used in place from the checkpoint mapping, so restoring takes
+   * time independent of the sketch size. If an exception is thrown, the sketch is left in an unspecified state.
+   */
+  void load(CheckpointReader& in);
+
+  /**
+   * Append the changes to the training state since it was last saved, loaded or marked clean to a delta checkpoint:
+   * the blocks of the sketch tables written since then, and the bias, scale, step count, and decay and window settings.
+   * Its size is proportional to the number of blocks updated rather than to the sketch size, except after a
+   * renormalization or window rotation, which changes every cell.
+   */
+  void save_delta(CheckpointWriter& out) const;
+
+  /**
+   * Apply a delta written by save_delta() to the training state as of the checkpoint that the delta follows. If an
+   * exception is thrown, the sketch is left in an unspecified state.
+   */
+  void load_delta(CheckpointReader& in);
+
+  /**
+   * Start tracking changes from the current state, once it has been committed to a checkpoint.
+   */
+  void mark_clean();
+
+  /**
+   * Mark the current state as a sync point, e.g. one shared by all replicas of a model trained in parallel. The
+   * table is forked copy-on-write, so this takes time proportional to the pages written since the previous sync
+   * point rather than to the sketch size. Not supported with a window.
+   */
+  void mark_synced();
+
+  /**
+   * Extract the change to the model since the last sync point: the cells written since then, the decay of every
+   * weight through the global scale, and the change to the bias and step count.
+   *
+   * @param out Target delta. Overwrites any existing contents.
+   */
+  void extract_delta(SketchDelta& out) const;
+
+  /**
+   * Apply a delta extracted from a replica with the same configuration: decay every weight, then add the changes.
+   * Deltas from several replicas that share a sync point can be applied one after another, e.g. each with weight
+   * 1/n to average the models of n replicas.
+   *
+   * @param delta Delta to apply.
+   * @param weight Factor applied to the changes and the step count. The decay is raised to this power.
+   */
+  void apply_delta(const SketchDelta& delta, float weight = 1.f);
+
+  /**
+   * Restore the state as of the last sync point, in time proportional to the blocks written since then.
+   */
+  void revert_to_sync();
 
  private:
-  float get_weight(uint32_t key, bool use_median);
+  void save_state(CheckpointWriter& out) const;
+  void load_state(CheckpointReader& in);
+  inline float cell(uint32_t row, uint64_t col) const {
+    float v = weights_.get(row, col);
+    return prev_ ? v + prev_->get(row, col) : v;
+  }
+
+  void begin_update(uint64_t n);
+  void decay(float factor);
+  void rotate();
+  float estimate(const uint32_t* hashes, bool use_median) const;
+  float get_weight(uint32_t key, bool use_median) const;
+  float gather_dot(const std::vector<std::pair<uint32_t, float> >& x);
   void get_weights(const std::vector<std::pair<uint32_t, float> >& x);
+  void get_weights(const uint32_t* keys, uint64_t n);
+  void gather_weight(uint64_t idx, uint32_t key);
+  void prefetch(uint32_t* hashes, uint32_t key) const;
+  void apply_batch(
+      std::vector<bool>& yhat,
+      std::vector<std::pair<uint32_t, float> >* new_weights,
+      const CSR& x,
+      const std::vector<bool>& labels);
 };
 
+typedef BasicLogisticSketch<cell::Float32> LogisticSketch;
+
 } // namespace wmsketch
 
 #endif /* LOGISTIC_SKETCH_H_ */
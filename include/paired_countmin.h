@@ -2,12 +2,14 @@
 #define SRC_PAIRED_COUNTMIN_H_
 
 #include <vector>
+#include "counter_table.h"
 #include "hash.h"
 #include "binary_estimator.h"
 
 namespace wmsketch {
 
-class PairedCountMin : public BinaryEstimator {
+template <class Counter = counter::Uint32>
+class BasicPairedCountMin : public BinaryEstimator {
 
  public:
   static const uint32_t MAX_LOG2_WIDTH = 30;
@@ -17,16 +19,16 @@ class PairedCountMin : public BinaryEstimator {
   const float smooth_;
   const bool consv_update_;
   uint32_t width_mask_;
-  uint32_t** counts_num_;
-  uint32_t** counts_den_;
+  CounterTable<Counter> counts_;  // numerator and denominator of column j are held in cells 2j and 2j + 1
   uint32_t pos_count_, neg_count_;
   hash::PolynomialHash hash_fn_;
-  std::vector<uint32_t> hash_buf_;
+  std::vector<float> weight_buf_;  // discarded ratios of update()
 
  public:
   /**
    * Estimator for the ratios p(x_i = 1 | y = +1) / p(x_i = 1 | y = -1) using a pair of
-   * Count-Min sketches.
+   * Count-Min sketches. The cells of the two sketches are interleaved, so that both counts for a row are read
+   * with a single load.
    *
    * @param log2_width Base-2 logarithm of the sketch width.
    * @param depth Sketch depth.
@@ -34,18 +36,26 @@ class PairedCountMin : public BinaryEstimator {
    * @param smooth Laplace smoothing of count estimates.
    * @param consv_update Flag to enable conservative update heuristic.
    */
-  PairedCountMin(uint32_t log2_width, uint32_t depth, int32_t seed, float smooth = 1., bool consv_update = false);
-  ~PairedCountMin();
-  float get(uint32_t key);
+  BasicPairedCountMin(uint32_t log2_width, uint32_t depth, int32_t seed, float smooth = 1., bool consv_update = false);
+  ~BasicPairedCountMin();
+  float get(uint32_t key) const;
   bool update(uint32_t key, bool label);
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label);
   bool update(std::vector<float>& new_weights, const std::vector<std::pair<uint32_t, float> >& x, bool label);
-  float bias();
+  float bias() const;
+
+  /**
+   * @return Number of bytes used by the counter table, including its overflow table.
+   */
+  uint64_t size_bytes() const;
 
  private:
   float update_feature(uint32_t key, bool label);
+  void update_features(float* ratios_out, const std::vector<std::pair<uint32_t, float> >& x, bool label);
 };
 
+typedef BasicPairedCountMin<counter::Uint32> PairedCountMin;
+
 } // namespace wmsketch
 
 #endif /* SRC_PAIRED_COUNTMIN_H_ */
@@ -16,6 +16,7 @@
 #include <random>
 #include <string>
 #include "util.h"
+#include "checkpoint.h"
 #include "heap.h"
 #include "countsketch.h"
 
@@ -95,6 +96,16 @@ class TokenReservoir {
     return tokens_[reservoir_[r]].token;
   }
 
+  /**
+   * Append the reservoir to a checkpoint.
+   */
+  void save(CheckpointWriter& out) const;
+
+  /**
+   * Restore the reservoir from a checkpoint written by save() for a reservoir of the same capacity.
+   */
+  void load(CheckpointReader& in);
+
  private:
   uint32_t add(const std::string& token) {
     auto it = token_idx_map_.find(token);
@@ -125,7 +136,7 @@ class StreamingSGNS {
   };
 
  private:
-  TopKHeap<StringPair, StringPairHash> heap_;
+  TopKHeap<StringPair, StringPairHash, CountSketch::Handle> heap_;  // with the sketch handle of each pair
   TokenReservoir reservoir_;
   CountSketch sk_;
   std::deque<std::string> window_;
@@ -188,6 +199,22 @@ class StreamingSGNS {
    */
   void flush();
 
+  /**
+   * Write the training state to a checkpoint file: the sketch, the heap of top pairs, the unigram reservoir, the
+   * current context window and the random state. The file is replaced atomically.
+   *
+   * @param path Path of the checkpoint.
+   */
+  void save(const std::string& path);
+
+  /**
+   * Restore the training state from a checkpoint file written by a model with the same configuration. The sketch
+   * table is mapped from the file rather than read. Must be called before the first update.
+   *
+   * @param path Path of the checkpoint.
+   */
+  void load(const std::string& path);
+
  private:
   void update(const std::string& a, const std::string& b);
   void update(const std::string& a, const std::string& b, bool real);
@@ -0,0 +1,67 @@
+/*
+ * Fixed-width vector kernels over blocks of 32-bit lanes, with scalar fallbacks when AVX2 is unavailable.
+ */
+
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <cstdint>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace wmsketch {
+namespace simd {
+
+// number of 32-bit lanes in a block
+static const uint32_t WIDTH = 8;
+
+/**
+ * Element-wise unsigned minimum of two blocks.
+ *
+ * @param acc Block of WIDTH values. Overwritten with the element-wise minimum.
+ * @param x Block of WIDTH values.
+ */
+inline void min_u32(uint32_t* acc, const uint32_t* x) {
+#ifdef __AVX2__
+  __m256i a = _mm256_loadu_si256((const __m256i*) acc);
+  __m256i b = _mm256_loadu_si256((const __m256i*) x);
+  _mm256_storeu_si256((__m256i*) acc, _mm256_min_epu32(a, b));
+#else
+  for (uint32_t i = 0; i < WIDTH; i++) {
+    acc[i] = (x[i] < acc[i]) ? x[i] : acc[i];
+  }
+#endif
+}
+
+/**
+ * @param x Block of WIDTH values.
+ * @return Whether any two lanes of the block hold the same value.
+ */
+inline bool has_conflict(const uint32_t* x) {
+#ifdef __AVX2__
+  // every pair of lanes is compared by one of the rotations by 1 to WIDTH / 2 lanes
+  __m256i v = _mm256_loadu_si256((const __m256i*) x);
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i mask = _mm256_set1_epi32(WIDTH - 1);
+  __m256i eq = _mm256_setzero_si256();
+  for (uint32_t r = 1; r <= WIDTH / 2; r++) {
+    __m256i perm = _mm256_and_si256(_mm256_add_epi32(lanes, _mm256_set1_epi32(r)), mask);
+    eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(v, _mm256_permutevar8x32_epi32(v, perm)));
+  }
+  return !_mm256_testz_si256(eq, eq);
+#else
+  for (uint32_t i = 0; i < WIDTH; i++) {
+    for (uint32_t j = i + 1; j < WIDTH; j++) {
+      if (x[i] == x[j]) return true;
+    }
+  }
+  return false;
+#endif
+}
+
+} // namespace simd
+} // namespace wmsketch
+
+#endif /* SIMD_H_ */
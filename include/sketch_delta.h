@@ -0,0 +1,72 @@
+/*
+ * Sparse deltas of sketch models, exchanged between replicas for distributed training.
+ */
+
+#ifndef SKETCH_DELTA_H_
+#define SKETCH_DELTA_H_
+
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace wmsketch {
+
+/**
+ * Change to a sketch model since a sync point. Updates to a sketch are linear, so the change made by a replica is
+ * the sum of its updates, and deltas from several replicas can be applied one after another. A delta to a model with
+ * a global scale also carries the factor by which every weight decayed, so that decay stays sparse.
+ */
+struct SketchDelta {
+  uint32_t depth;
+  uint32_t log2_width;
+  uint64_t steps;   // training steps taken
+  float decay;      // factor applied to every weight, before the changes below
+  float bias;       // change to the bias term
+  std::vector<uint32_t> indices;  // changed cells (row * width + column), in ascending order
+  std::vector<float> values;      // change to the weight of each cell in indices
+
+  SketchDelta()
+   : depth{0},
+     log2_width{0},
+     steps{0},
+     decay{1.f},
+     bias{0.f} { }
+
+  size_t nnz() const {
+    return indices.size();
+  }
+
+  void clear() {
+    steps = 0;
+    decay = 1.f;
+    bias = 0.f;
+    indices.clear();
+    values.clear();
+  }
+
+  /**
+   * Serialize the delta. Cell indices are stored as variable-length gaps, which take one or two bytes each when the
+   * changed cells are dense, and values are stored as floats or, if \p quantize is set, as 8-bit integers with a
+   * scale for each group of QUANT_GROUP values.
+   *
+   * @param out Target buffer. Overwrites any existing contents.
+   * @param quantize Quantize values to 8 bits.
+   */
+  void encode(std::string& out, bool quantize = false) const;
+
+  /**
+   * Deserialize a delta written by encode(). Throws an exception if the data is malformed.
+   *
+   * @param data Serialized delta.
+   * @param size Size of \p data in bytes.
+   */
+  void decode(const char* data, size_t size);
+
+  // number of values that share a scale when quantized
+  static const uint32_t QUANT_GROUP = 64;
+};
+
+} // namespace wmsketch
+
+#endif /* SKETCH_DELTA_H_ */
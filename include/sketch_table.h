@@ -0,0 +1,508 @@
+/*
+ * Sketch tables with configurable cell types.
+ */
+
+#ifndef SKETCH_TABLE_H_
+#define SKETCH_TABLE_H_
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "checkpoint.h"
+#include "cow_region.h"
+#include "stats.h"
+
+namespace wmsketch {
+namespace cell {
+
+enum Kind { FLOAT, BFLOAT, FIXED };
+
+// 32-bit floating point cells
+struct Float32 {
+  typedef float storage;
+  static const Kind KIND = FLOAT;
+  static const int32_t MAX = 0;
+  static constexpr float INIT_STEP = 1.f;
+  static const char* name() { return "float"; }
+};
+
+// 16-bit brain floating point cells: the upper half of a 32-bit float
+struct BFloat16 {
+  typedef uint16_t storage;
+  static const Kind KIND = BFLOAT;
+  static const int32_t MAX = 0;
+  static constexpr float INIT_STEP = 1.f;
+  static const char* name() { return "bfloat16"; }
+};
+
+// 16-bit fixed point cells with a shared step size per row
+struct Int16 {
+  typedef int16_t storage;
+  static const Kind KIND = FIXED;
+  static const int32_t MAX = INT16_MAX;
+  static constexpr float INIT_STEP = 1.f / 1024;
+  static const char* name() { return "int16"; }
+};
+
+// 8-bit fixed point cells with a shared step size per row
+struct Int8 {
+  typedef int8_t storage;
+  static const Kind KIND = FIXED;
+  static const int32_t MAX = INT8_MAX;
+  static constexpr float INIT_STEP = 1.f / 64;
+  static const char* name() { return "int8"; }
+};
+
+} // namespace cell
+
+template <class Cell>
+class SketchTable {
+ public:
+  typedef typename Cell::storage storage;
+
+ private:
+  const uint32_t depth_;
+  const uint64_t width_;
+  storage* cells_;
+  std::shared_ptr<void> mapping_;  // owner of cells_ when they live in a mapped checkpoint or fork image
+  std::unique_ptr<CowRegion> cow_;  // backing of cells_ once the table has been forked
+  std::vector<float> steps_;  // fixed point step size of each row
+  uint64_t rng_;
+
+  // change tracking: each write stamps its DIRTY_BLOCK-byte block with the current epoch, and checkpoints and syncs
+  // each start a new epoch, so a block has changed since the last checkpoint or sync if its stamp is at least the
+  // epoch that it started
+  std::vector<uint32_t> block_epochs_;
+  uint32_t epoch_;
+  uint32_t checkpoint_epoch_;
+  uint32_t sync_epoch_;
+
+  // changes since the last checkpoint that are not stamped: the table was zeroed, or every cell changed
+  bool cleared_;
+  bool all_dirty_;
+
+ public:
+  // granularity of change tracking for delta checkpoints and syncs, in bytes
+  static const uint64_t DIRTY_BLOCK = 4096;
+
+  /**
+   * A depth x width table of sketch cells. Cells narrower than 32 bits are updated with stochastic rounding, so that
+   * the expected value of a cell equals the sum of the updates applied to it. Fixed point cells share a step size per
+   * row; when an update would overflow a cell, the step size of its row is doubled.
+   *
+   * @param log2_width Base-2 logarithm of the table width.
+   * @param depth Table depth.
+   * @param seed Random seed for stochastic rounding.
+   */
+  SketchTable(uint32_t log2_width, uint32_t depth, uint64_t seed)
+   : depth_{depth},
+     width_{1ull << log2_width},
+     steps_(depth, float(Cell::INIT_STEP)),  // a copy, since INIT_STEP has no out-of-class definition
+     rng_{seed * 0x9E3779B97F4A7C15ull + 1},
+     block_epochs_(blocks(), 0),
+     epoch_{1},
+     checkpoint_epoch_{1},
+     sync_epoch_{1},
+     cleared_{true},
+     all_dirty_{false} {
+    cells_ = (storage*) calloc(depth_ * width_, sizeof(storage));
+    if (cells_ == nullptr) throw std::bad_alloc();
+  }
+
+  /**
+   * Fork: a copy of \p other as of now, made in time independent of the table size. The two tables share pages
+   * copy-on-write, so each pays for a page copy only on its first write to the page. The first fork of a table
+   * moves its cells into a shared memory file, which copies them once. Must not be called concurrently with other
+   * uses of \p other.
+   *
+   * @param other Table to fork.
+   */
+  explicit SketchTable(SketchTable& other)
+   : depth_{other.depth_},
+     width_{other.width_},
+     steps_(other.steps_),
+     rng_{other.rng_},
+     block_epochs_(other.block_epochs_),
+     epoch_{other.epoch_},
+     checkpoint_epoch_{other.checkpoint_epoch_},
+     sync_epoch_{other.sync_epoch_},
+     cleared_{other.cleared_},
+     all_dirty_{other.all_dirty_} {
+    if (!other.cow_) {
+      std::unique_ptr<CowRegion> cow(new CowRegion(other.cells_, other.size_bytes()));
+      other.release();
+      other.cow_ = std::move(cow);
+      other.cells_ = (storage*) other.cow_->data();
+    }
+    mapping_ = other.cow_->fork();
+    cells_ = (storage*) mapping_.get();
+  }
+
+  SketchTable(const SketchTable&) = delete;
+  SketchTable& operator=(const SketchTable&) = delete;
+
+  ~SketchTable() {
+    release();
+  }
+
+  uint32_t depth() const {
+    return depth_;
+  }
+
+  uint64_t width() const {
+    return width_;
+  }
+
+  inline float get(uint32_t row, uint64_t col) const {
+    WMSKETCH_COUNT(CELLS, 1);
+    return decode(cells_[row * width_ + col], row);
+  }
+
+  inline void add(uint32_t row, uint64_t col, float delta) {
+    WMSKETCH_COUNT(CELLS, 1);
+    storage& c = cells_[row * width_ + col];
+    if (Cell::KIND == cell::FLOAT) {
+      c += delta;
+    } else if (Cell::KIND == cell::BFLOAT) {
+      c = encode_bfloat(decode(c, row) + delta);
+    } else {
+      float x = floorf(c + delta / steps_[row] + uniform());
+      // widening could never bring a NaN or infinite delta, e.g. from a step that underflowed to 0, into range
+      if (!std::isfinite(x)) throw std::invalid_argument("Non-finite update to a fixed point sketch cell");
+      while (fabsf(x) > Cell::MAX) {
+        widen(row);
+        x = floorf(c + delta / steps_[row] + uniform());
+      }
+      c = (storage) x;
+    }
+    mark(row * width_ + col);
+  }
+
+  inline const storage* cell_ptr(uint32_t row, uint64_t col) const {
+    return cells_ + row * width_ + col;
+  }
+
+  /**
+   * Multiply every cell by \p s. Fixed point rows only change their step size.
+   *
+   * @param s Positive factor.
+   */
+  void scale(float s) {
+    if (Cell::KIND == cell::FIXED) {
+      for (uint32_t i = 0; i < depth_; i++) {
+        steps_[i] *= s;
+      }
+      return;
+    }
+
+    for (uint64_t j = 0; j < depth_ * width_; j++) {
+      if (Cell::KIND == cell::FLOAT) cells_[j] *= s;
+      else cells_[j] = encode_bfloat(decode(cells_[j], 0) * s);
+    }
+    all_dirty_ = true;
+  }
+
+  /**
+   * Reset every cell to zero.
+   */
+  void clear() {
+    memset(cells_, 0, depth_ * width_ * sizeof(storage));
+    steps_.assign(depth_, float(Cell::INIT_STEP));
+    mark_clean();
+    cleared_ = true;
+  }
+
+  /**
+   * Exchange contents with a table of the same dimensions. Every cell of both tables counts as changed for the next
+   * delta checkpoint.
+   */
+  void swap(SketchTable& other) {
+    if (other.depth_ != depth_ || other.width_ != width_) {
+      throw std::invalid_argument("Sketch table dimensions do not match");
+    }
+    std::swap(cells_, other.cells_);
+    std::swap(mapping_, other.mapping_);
+    std::swap(cow_, other.cow_);
+    std::swap(steps_, other.steps_);
+    std::swap(rng_, other.rng_);
+    all_dirty_ = true;
+    other.all_dirty_ = true;
+  }
+
+  /**
+   * Decode the table into row-major 32-bit floats.
+   *
+   * @param out Target vector of depth x width values. Overwrites any existing contents.
+   */
+  void decode(std::vector<float>& out) const {
+    out.resize(depth_ * width_);
+    for (uint32_t i = 0; i < depth_; i++) {
+      for (uint64_t j = 0; j < width_; j++) {
+        out[i * width_ + j] = get(i, j);
+      }
+    }
+  }
+
+  uint64_t size_bytes() const {
+    return depth_ * width_ * sizeof(storage);
+  }
+
+  /**
+   * Append the table to a checkpoint. The cells are written as one page-aligned block.
+   */
+  void save(CheckpointWriter& out) const {
+    uint32_t dims[4] = {depth_, (uint32_t) __builtin_ctzll(width_), Cell::KIND, sizeof(storage)};
+    out.write(checkpoint_tag("TDIM"), dims, sizeof(dims));
+    out.write(checkpoint_tag("CELL"), cells_, size_bytes(), true);
+    out.write_vector(checkpoint_tag("STEP"), steps_);
+    out.write_value(checkpoint_tag("TRNG"), rng_);
+  }
+
+  /**
+   * Restore the table from a checkpoint written by save() for a table of the same dimensions and cell type. The
+   * cells are used in place from the checkpoint mapping rather than copied; pages are copied on first write.
+   */
+  void load(CheckpointReader& in) {
+    uint32_t dims[4];
+    in.read(checkpoint_tag("TDIM"), dims, sizeof(dims));
+    if (dims[0] != depth_ || (1ull << dims[1]) != width_ || dims[2] != Cell::KIND || dims[3] != sizeof(storage)) {
+      throw std::runtime_error("Checkpoint sketch table does not match the model configuration");
+    }
+
+    storage* cells = (storage*) in.map(checkpoint_tag("CELL"), size_bytes());
+    std::vector<float> steps;
+    in.read_vector(checkpoint_tag("STEP"), steps);
+    if (steps.size() != depth_) throw std::runtime_error("Malformed checkpoint record");
+    uint64_t rng;
+    in.read_value(checkpoint_tag("TRNG"), rng);
+
+    release();
+    cells_ = cells;
+    mapping_ = in.mapping();
+    steps_ = std::move(steps);
+    rng_ = rng;
+    mark_clean();
+  }
+
+  /**
+   * Append the changes since the last checkpoint to a delta checkpoint: the blocks of cells written since then, or
+   * only a flag if the table was zeroed and not written since. Call mark_clean() once the checkpoint is committed.
+   */
+  void save_delta(CheckpointWriter& out) const {
+    uint32_t dims[4] = {depth_, (uint32_t) __builtin_ctzll(width_), Cell::KIND, sizeof(storage)};
+    uint32_t flags[2] = {cleared_, all_dirty_};
+    std::vector<uint32_t> ids;
+    std::vector<std::pair<const void*, uint64_t> > parts;
+    uint64_t n = blocks();
+    const char* base = (const char*) cells_;
+    for (uint64_t b = 0; b < n; b++) {
+      if (!all_dirty_ && block_epochs_[b] < checkpoint_epoch_) continue;
+      uint64_t len = block_bytes(b);
+      ids.push_back(b);
+      if (!parts.empty() && (const char*) parts.back().first + parts.back().second == base + b * DIRTY_BLOCK) {
+        parts.back().second += len;
+      } else {
+        parts.emplace_back(base + b * DIRTY_BLOCK, len);
+      }
+    }
+
+    out.write(checkpoint_tag("TDIM"), dims, sizeof(dims));
+    out.write(checkpoint_tag("DFLG"), flags, sizeof(flags));
+    out.write_vector(checkpoint_tag("DBLK"), ids);
+    out.write_gather(checkpoint_tag("DCEL"), parts);
+    out.write_vector(checkpoint_tag("STEP"), steps_);
+    out.write_value(checkpoint_tag("TRNG"), rng_);
+  }
+
+  /**
+   * Apply a delta written by save_delta() to the table as of the checkpoint that the delta follows.
+   */
+  void load_delta(CheckpointReader& in) {
+    uint32_t dims[4], flags[2];
+    in.read(checkpoint_tag("TDIM"), dims, sizeof(dims));
+    if (dims[0] != depth_ || (1ull << dims[1]) != width_ || dims[2] != Cell::KIND || dims[3] != sizeof(storage)) {
+      throw std::runtime_error("Checkpoint sketch table does not match the model configuration");
+    }
+    in.read(checkpoint_tag("DFLG"), flags, sizeof(flags));
+
+    std::vector<uint32_t> ids;
+    in.read_vector(checkpoint_tag("DBLK"), ids);
+    uint64_t n = blocks();
+    uint64_t total = 0;
+    for (uint32_t b : ids) {
+      if (b >= n) throw std::runtime_error("Malformed checkpoint record");
+      total += block_bytes(b);
+    }
+    uint64_t size;
+    const char* data = (const char*) in.read(checkpoint_tag("DCEL"), size);
+    if (size != total) throw std::runtime_error("Malformed checkpoint record");
+    std::vector<float> steps;
+    in.read_vector(checkpoint_tag("STEP"), steps);
+    if (steps.size() != depth_) throw std::runtime_error("Malformed checkpoint record");
+    uint64_t rng;
+    in.read_value(checkpoint_tag("TRNG"), rng);
+
+    if (flags[0]) {
+      // a fresh zeroed allocation, rather than writing zeros over mapped or shared pages
+      storage* cells = (storage*) calloc(depth_ * width_, sizeof(storage));
+      if (cells == nullptr) throw std::bad_alloc();
+      release();
+      cells_ = cells;
+    }
+    char* base = (char*) cells_;
+    for (uint32_t b : ids) {
+      uint64_t len = block_bytes(b);
+      memcpy(base + b * DIRTY_BLOCK, data, len);
+      data += len;
+    }
+    steps_ = std::move(steps);
+    rng_ = rng;
+    mark_clean();
+  }
+
+  /**
+   * Reset change tracking, e.g. after the table has been written to a checkpoint.
+   */
+  void mark_clean() {
+    checkpoint_epoch_ = ++epoch_;
+    cleared_ = false;
+    all_dirty_ = false;
+  }
+
+  /**
+   * Start tracking changes for diff() and revert() from the current state, of which \p base is a copy.
+   */
+  void mark_synced() {
+    sync_epoch_ = ++epoch_;
+  }
+
+  /**
+   * Sparse difference between this table and \p base, a copy of it made at the last mark_synced(), over the blocks
+   * written since then. Blocks that have not been written are assumed to equal \p ratio times their value in \p base,
+   * e.g. when the cells have been rescaled since.
+   *
+   * @param base Table as of the last mark_synced().
+   * @param ratio Factor applied to the cells of \p base.
+   * @param scale Factor applied to each difference.
+   * @param indices Target vector of cell indices (row * width + column), in ascending order.
+   * @param values Target vector of the nonzero values scale * (cell - ratio * base cell) at \p indices.
+   */
+  void diff(
+      const SketchTable& base,
+      float ratio,
+      float scale,
+      std::vector<uint32_t>& indices,
+      std::vector<float>& values) const {
+    if (depth_ * width_ > (1ull << 32)) throw std::runtime_error("Table too large for sparse deltas");
+    indices.clear();
+    values.clear();
+    const uint64_t per_block = DIRTY_BLOCK / sizeof(storage);
+    const uint64_t n = depth_ * width_;
+    for (uint64_t b = 0; b < block_epochs_.size(); b++) {
+      if (block_epochs_[b] < sync_epoch_) continue;
+      uint64_t end = (b + 1) * per_block < n ? (b + 1) * per_block : n;
+      for (uint64_t j = b * per_block; j < end; j++) {
+        uint32_t row = j / width_;
+        float v = scale * (decode(cells_[j], row) - ratio * base.decode(base.cells_[j], row));
+        if (v == 0.f) continue;
+        indices.push_back(j);
+        values.push_back(v);
+      }
+    }
+  }
+
+  /**
+   * Restore the state as of the last mark_synced() from \p base, a copy made then.
+   *
+   * @param base Table as of the last mark_synced().
+   * @param all Copy every cell, rather than the blocks written since then, e.g. when the cells have been rescaled.
+   */
+  void revert(const SketchTable& base, bool all) {
+    if (all) {
+      memcpy(cells_, base.cells_, size_bytes());
+      all_dirty_ = true;
+    } else {
+      char* dst = (char*) cells_;
+      const char* src = (const char*) base.cells_;
+      for (uint64_t b = 0; b < block_epochs_.size(); b++) {
+        if (block_epochs_[b] < sync_epoch_) continue;
+        memcpy(dst + b * DIRTY_BLOCK, src + b * DIRTY_BLOCK, block_bytes(b));
+        block_epochs_[b] = epoch_;  // still changed since the last checkpoint
+      }
+    }
+    steps_ = base.steps_;
+    rng_ = base.rng_;
+  }
+
+ private:
+  uint64_t blocks() const {
+    return (size_bytes() + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+  }
+
+  uint64_t block_bytes(uint64_t b) const {
+    uint64_t end = (b + 1) * DIRTY_BLOCK;
+    return (end < size_bytes() ? end : size_bytes()) - b * DIRTY_BLOCK;
+  }
+
+  inline void mark(uint64_t idx) {
+    block_epochs_[idx * sizeof(storage) / DIRTY_BLOCK] = epoch_;
+  }
+
+  void release() {
+    if (cow_) cow_.reset();
+    else if (!mapping_) free(cells_);
+    mapping_.reset();
+    cells_ = nullptr;
+  }
+
+  inline float decode(storage c, uint32_t row) const {
+    if (Cell::KIND == cell::FLOAT) return c;
+    if (Cell::KIND == cell::BFLOAT) {
+      uint32_t bits = ((uint32_t) c) << 16;
+      float v;
+      memcpy(&v, &bits, sizeof(v));
+      return v;
+    }
+    return c * steps_[row];
+  }
+
+  // bfloat16 with stochastic rounding of the discarded mantissa bits
+  inline storage encode_bfloat(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bits += (uint32_t) (next() & 0xFFFF);
+    return (storage) (bits >> 16);
+  }
+
+  inline uint64_t next() {
+    // xorshift64*
+    rng_ ^= rng_ >> 12;
+    rng_ ^= rng_ << 25;
+    rng_ ^= rng_ >> 27;
+    return rng_ * 0x2545F4914F6CDD1Dull;
+  }
+
+  inline float uniform() {
+    return (next() >> 40) * (1.f / (1 << 24));
+  }
+
+  void widen(uint32_t row) {
+    storage* cells = cells_ + row * width_;
+    for (uint64_t j = 0; j < width_; j++) {
+      cells[j] = (storage) lrintf(cells[j] / 2.f);
+    }
+    for (uint64_t j = 0; j < width_; j += DIRTY_BLOCK / sizeof(storage)) {
+      mark(row * width_ + j);
+    }
+    steps_[row] *= 2;
+  }
+};
+
+} // namespace wmsketch
+
+#endif /* SKETCH_TABLE_H_ */
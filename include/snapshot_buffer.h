@@ -0,0 +1,126 @@
+/*
+ * Lock-free publication of immutable snapshots from a single writer to concurrent readers.
+ */
+
+#ifndef SNAPSHOT_BUFFER_H_
+#define SNAPSHOT_BUFFER_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace wmsketch {
+
+template <class T, uint32_t N = 4>
+class SnapshotBuffer {
+  static_assert(N >= 2, "SnapshotBuffer needs at least two slots");
+
+ private:
+  struct Slot {
+    T value;
+    uint64_t version;
+    std::atomic<uint32_t> readers;
+  };
+
+  Slot slots_[N];
+  std::atomic<uint32_t> current_;
+  uint64_t version_;  // accessed only by the writer
+
+ public:
+  /**
+   * RAII handle to a published snapshot. The snapshot is not reused by the writer while the guard is alive.
+   */
+  class Guard {
+   private:
+    Slot* slot_;
+
+   public:
+    explicit Guard(Slot* slot) : slot_{slot} { }
+    Guard(Guard&& other) : slot_{other.slot_} { other.slot_ = nullptr; }
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+
+    ~Guard() {
+      if (slot_ != nullptr) slot_->readers.fetch_sub(1);
+    }
+
+    const T& operator*() const {
+      return slot_->value;
+    }
+
+    const T* operator->() const {
+      return &slot_->value;
+    }
+
+    /**
+     * @return Number of snapshots published up to and including this one, or 0 for the initial empty snapshot.
+     */
+    uint64_t version() const {
+      return slot_->version;
+    }
+  };
+
+  /**
+   * A set of N slots holding immutable snapshots. Readers pin the most recently published slot with a reference count
+   * and never block. The writer fills a slot that is neither current nor pinned and then publishes it with a single
+   * atomic store, so it never waits for readers either. With at most N - 2 concurrent readers a free slot always
+   * exists.
+   */
+  SnapshotBuffer()
+   : current_{0},
+     version_{0} {
+    for (uint32_t i = 0; i < N; i++) {
+      slots_[i].version = 0;
+      slots_[i].readers.store(0);
+    }
+  }
+
+  SnapshotBuffer(const SnapshotBuffer&) = delete;
+  SnapshotBuffer& operator=(const SnapshotBuffer&) = delete;
+
+  /**
+   * Pin the latest snapshot. Safe to call from any thread.
+   *
+   * @return Guard for the latest snapshot.
+   */
+  Guard read() {
+    while (true) {
+      uint32_t i = current_.load();
+      slots_[i].readers.fetch_add(1);
+      // the writer only fills slots that are not current, so a slot that is still current after pinning is complete
+      if (current_.load() == i) return Guard(&slots_[i]);
+      slots_[i].readers.fetch_sub(1);
+    }
+  }
+
+  /**
+   * Fill a free slot and publish it as the latest snapshot. Must only be called from the writer thread.
+   *
+   * @param fill Callable that overwrites the contents of a T& with the new snapshot. Slots are reused, so existing
+   *   capacity can be recycled.
+   * @return Whether the snapshot was published. Publication is skipped if every other slot is pinned by a reader.
+   */
+  template <class F>
+  bool publish(F fill) {
+    uint32_t cur = current_.load();
+    for (uint32_t j = 1; j < N; j++) {
+      uint32_t i = (cur + j) % N;
+      if (slots_[i].readers.load() != 0) continue;
+      fill(slots_[i].value);
+      slots_[i].version = ++version_;
+      current_.store(i);
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * @return Number of snapshots published. Must only be called from the writer thread.
+   */
+  uint64_t version() const {
+    return version_;
+  }
+};
+
+} // namespace wmsketch
+
+#endif /* SNAPSHOT_BUFFER_H_ */
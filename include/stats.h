@@ -0,0 +1,84 @@
+/*
+ * Counters of hot-path events, compiled in when WMSKETCH_STATS is defined (cmake -DWMSKETCH_STATS=ON).
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace wmsketch {
+namespace stats {
+
+#ifdef WMSKETCH_STATS
+static const bool ENABLED = true;
+#else
+static const bool ENABLED = false;
+#endif
+
+enum Counter {
+  HASHES,           // keys hashed by a hash family
+  CELLS,            // sketch cells read or written
+  HEAP_INSERTS,     // items added by TopKHeap::insert()
+  HEAP_EVICTIONS,   // items evicted by TopKHeap::insert() to make room
+  HEAP_REJECTIONS,  // items that TopKHeap::insert() turned away because the heap was full
+  WRITEBACKS,       // weights evicted from an active set and written back to its sketch
+  MEDIANS,          // medians of sketch estimates
+  DUPLICATE_KEYS,   // features merged into an earlier feature with the same key
+  NUM_COUNTERS
+};
+
+/**
+ * Counters of one thread. Only the owning thread writes them, so that counting needs no read-modify-write; other
+ * threads may read them at any time.
+ */
+struct Counters {
+  std::atomic<uint64_t> counts[NUM_COUNTERS];
+
+  Counters() {
+    for (auto& c : counts) {
+      c.store(0);
+    }
+  }
+};
+
+// counters of the calling thread, or nullptr before it first counts an event
+extern thread_local Counters* local;
+
+/**
+ * Allocate and register the counters of the calling thread. They outlive the thread, so that its events stay in the
+ * totals.
+ */
+Counters* register_thread();
+
+inline void add(Counter c, uint64_t n) {
+  Counters* s = local;
+  if (s == nullptr) s = register_thread();
+  std::atomic<uint64_t>& count = s->counts[c];
+  count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * @return Name of counter \p c, e.g. "heap_inserts".
+ */
+const char* name(Counter c);
+
+/**
+ * @return Sum of each counter over all threads, by name. Empty unless compiled with WMSKETCH_STATS.
+ */
+std::map<std::string, uint64_t> totals();
+
+} // namespace stats
+} // namespace wmsketch
+
+// count n events of kind c; expands to nothing, without evaluating n, unless compiled with WMSKETCH_STATS
+#ifdef WMSKETCH_STATS
+#define WMSKETCH_COUNT(c, n) ::wmsketch::stats::add(::wmsketch::stats::c, (n))
+#else
+#define WMSKETCH_COUNT(c, n) ((void) 0)
+#endif
+
+#endif /* STATS_H_ */
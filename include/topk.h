@@ -8,36 +8,356 @@
 #include <vector>
 #include <tuple>
 #include <random>
+#include <memory>
+#include <string>
+#include "checkpoint.h"
+#include "coalescer.h"
 #include "countmin.h"
+#include "csr.h"
 #include "countsketch.h"
+#include "frozen.h"
 #include "paired_countmin.h"
 #include "logistic.h"
 #include "logistic_sketch.h"
 #include "heap.h"
+#include "snapshot_buffer.h"
 
 namespace wmsketch {
 
 class TopKFeatures {
+ public:
+  typedef std::vector<std::pair<uint32_t, float> > Snapshot;
+  typedef SnapshotBuffer<Snapshot>::Guard SnapshotGuard;
+
  protected:
   uint32_t k_;
   TopKHeap<uint32_t> heap_;
   WeightedReservoir res_;  // weighted reservoir sampler for probabilistic truncation baseline
+  std::vector<std::pair<uint32_t, float> > row_buf_;
+
+  // round-robin refresh of heap values from a sketch: each pass walks a snapshot of the heap keys taken when it starts
+  uint32_t refresh_budget_;
+  uint64_t refresh_pos_;
+  uint64_t refresh_t_;
+  std::vector<uint32_t> refresh_pass_;
+  std::vector<uint32_t> refresh_keys_;
+  std::vector<float> refresh_vals_;
+
+  // latest published top-k, readable from other threads
+  SnapshotBuffer<Snapshot> snapshots_;
+
+  // ordered output of the last call to topk(), valid while the source container and scale are unchanged
+  std::vector<std::pair<uint32_t, float> > topk_cache_;
+  uint64_t topk_cache_version_;
+  float topk_cache_scale_;
+  uint32_t topk_cache_n_;
+  bool topk_cache_valid_;
+
+  // optional merging of duplicate feature keys within an example
+  FeatureCoalescer coalescer_;
+  bool dedup_;
+
+  explicit TopKFeatures(uint32_t k)
+   : k_{k}, heap_(k), res_(k), refresh_budget_{0}, refresh_pos_{0}, refresh_t_{0}, topk_cache_valid_{false},
+     dedup_{false} { }
+  TopKFeatures(uint32_t k, int32_t seed, float pow = 1.f)
+   : k_{k}, heap_(k), res_(k, seed, pow), refresh_budget_{0}, refresh_pos_{0}, refresh_t_{0}, topk_cache_valid_{false},
+     dedup_{false} { }
+
+  /**
+   * Select the heap keys to re-estimate in the next step of a round-robin refresh pass over the heap. A pass walks the
+   * heap keys as of its start, skipping keys evicted since, so every key that stays in the heap is re-estimated once
+   * per pass whatever the heap order does in between. A new pass is started only if the model has been updated since
+   * the start of the previous pass. The caller writes the new estimate of each key in refresh_keys_ to refresh_vals_
+   * and then calls finish_refresh().
+   *
+   * @param t Number of updates applied to the model so far.
+   * @return Whether there are keys to re-estimate.
+   */
+  bool start_refresh(uint64_t t) {
+    if (refresh_pos_ == 0) {
+      if (t == refresh_t_) return false;
+      refresh_t_ = t;
+      heap_.keys(refresh_pass_);
+    }
+
+    uint64_t n = refresh_pass_.size();
+    uint64_t m = (refresh_budget_ > 0) ? refresh_budget_ : n;
+    refresh_keys_.clear();
+    for (; refresh_pos_ < n && refresh_keys_.size() < m; refresh_pos_++) {
+      uint32_t key = refresh_pass_[refresh_pos_];
+      if (heap_.contains(key)) refresh_keys_.push_back(key);
+    }
+    if (refresh_pos_ == n) refresh_pos_ = 0;
+    refresh_vals_.resize(refresh_keys_.size());
+    return !refresh_keys_.empty();
+  }
+
+  void finish_refresh() {
+    heap_.change_vals(refresh_keys_.data(), refresh_vals_.data(), refresh_keys_.size());
+  }
+
+  /**
+   * Order items by decreasing magnitude and keep the first \p n. Only the kept items are sorted.
+   *
+   * @param items Items to order. Overwritten with the ordered top items.
+   * @param n Number of items to keep, or 0 to keep every item.
+   */
+  static void select_topk(std::vector<std::pair<uint32_t, float> >& items, uint32_t n) {
+    auto cmp = [](const std::pair<uint32_t, float>& a, const std::pair<uint32_t, float>& b) {
+      return fabs(a.second) > fabs(b.second);
+    };
+    if (n > 0 && n < items.size()) {
+      std::nth_element(items.begin(), items.begin() + n, items.end(), cmp);
+      items.resize(n);
+    }
+    std::sort(items.begin(), items.end(), cmp);
+  }
+
+  /**
+   * Serve a topk() call from the ordering cache.
+   *
+   * @param version Version of the container that topk() reads items from.
+   * @param scale Scale that topk() applies to item values.
+   * @param out Target vector. Overwritten with the cached items on a hit.
+   * @param n Number of items requested, or 0 for every item.
+   * @return Whether the cache held the requested items.
+   */
+  bool cached_topk(uint64_t version, float scale, std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
+    if (!topk_cache_valid_ || version != topk_cache_version_ || scale != topk_cache_scale_) return false;
+    if (topk_cache_n_ != 0 && (n == 0 || n > topk_cache_n_)) return false;
+    size_t m = (n == 0 || n > topk_cache_.size()) ? topk_cache_.size() : n;
+    out.assign(topk_cache_.begin(), topk_cache_.begin() + m);
+    return true;
+  }
 
-  explicit TopKFeatures(uint32_t k): k_{k}, heap_(k), res_(k) { }
-  TopKFeatures(uint32_t k, int32_t seed, float pow = 1.f): k_{k}, heap_(k), res_(k, seed, pow) { }
+  void cache_topk(uint64_t version, float scale, const std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
+    topk_cache_ = out;
+    topk_cache_version_ = version;
+    topk_cache_scale_ = scale;
+    topk_cache_n_ = n;
+    topk_cache_valid_ = true;
+  }
 
  public:
   virtual ~TopKFeatures() = default;
-  virtual void topk(std::vector<std::pair<uint32_t, float> >& out) {
+
+  /**
+   * Limit the number of heap keys that estimators backed by a sketch re-estimate on each call to topk(). Successive
+   * calls then refresh the heap in round-robin order, which bounds the time each call takes.
+   *
+   * @param budget Maximum number of keys to re-estimate per call, or 0 to re-estimate every key.
+   */
+  void set_refresh_budget(uint32_t budget) {
+    refresh_budget_ = budget;
+    refresh_pos_ = 0;
+  }
+
+  /**
+   * Merge features with duplicate keys within each example before it reaches the sketch, so that each key is hashed
+   * and updated once. Used by the sketch-based estimators on single-example updates; mini-batch updates already
+   * coalesce duplicate keys.
+   *
+   * @param dedup Whether to merge duplicate keys.
+   */
+  void set_dedup(bool dedup) {
+    dedup_ = dedup;
+  }
+
+  /**
+   * @return Coalescer used to merge duplicate keys, with counts of the features it has seen and merged.
+   */
+  const FeatureCoalescer& coalescer() const {
+    return coalescer_;
+  }
+
+  /**
+   * Publish the current top-k, as returned by topk(), as an immutable snapshot for readers on other threads. Must be
+   * called from the thread that updates the estimator.
+   *
+   * @return Whether the snapshot was published. Publication is skipped rather than waiting if all snapshot slots are
+   *   held by readers.
+   */
+  bool publish_snapshot() {
+    return snapshots_.publish([this](Snapshot& out) { topk(out); });
+  }
+
+  /**
+   * Pin the most recently published top-k snapshot. Lock-free and safe to call from any thread concurrently with
+   * updates; the snapshot stays valid while the returned guard is alive.
+   *
+   * @return Guard for the latest snapshot. Before the first publish_snapshot(), the snapshot is empty.
+   */
+  SnapshotGuard snapshot() {
+    return snapshots_.read();
+  }
+
+  /**
+   * @return Number of snapshots published. Must be called from the thread that updates the estimator.
+   */
+  uint64_t snapshot_version() const {
+    return snapshots_.version();
+  }
+
+  void topk(std::vector<std::pair<uint32_t, float> >& out) {
+    topk(out, 0);
+  }
+
+  /**
+   * Return the highest-magnitude weights in order of decreasing magnitude. Only the returned items are sorted, and
+   * repeated calls are served from a cache while the estimator is unchanged.
+   *
+   * @param out Target vector of (feature, weight) pairs. Overwrites any existing contents.
+   * @param n Number of weights to return, or 0 for every tracked weight.
+   */
+  virtual void topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
+    if (cached_topk(heap_.version(), 1.f, out, n)) return;
     heap_.items(out);
-    std::sort(out.begin(), out.end(),
-        [](auto& a, auto& b) { return fabs(a.second) > fabs(b.second); });
+    select_topk(out, n);
+    cache_topk(heap_.version(), 1.f, out, n);
   }
   virtual bool predict(const std::vector<std::pair<uint32_t, float> >& x) = 0;
+
+  /**
+   * Score a batch of examples. Estimators that compute margins write the margin (including the bias term) of each
+   * example; the default implementation writes +1 or -1 according to the single-example prediction.
+   *
+   * @param x Batch of examples.
+   * @param margins_out Target array of x.rows() scores. A score >= 0 corresponds to a positive prediction.
+   */
+  virtual void predict_batch(const CSR& x, float* margins_out) {
+    for (size_t i = 0; i < x.rows(); i++) {
+      x.row(i, row_buf_);
+      margins_out[i] = predict(row_buf_) ? +1.f : -1.f;
+    }
+  }
+
   virtual bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label) = 0;
+
+  /**
+   * Update the model with a mini-batch of examples. The default implementation applies a single-example update for
+   * each row of the batch in order.
+   *
+   * @param yhat Target vector for the predicted label of each example. Overwrites any existing contents.
+   * @param x Batch of examples.
+   * @param labels Label of each example.
+   */
+  virtual void update_batch(std::vector<bool>& yhat, const CSR& x, const std::vector<bool>& labels) {
+    yhat.resize(x.rows());
+    for (size_t i = 0; i < x.rows(); i++) {
+      x.row(i, row_buf_);
+      yhat[i] = update(row_buf_, labels[i]);
+    }
+  }
+
+  /**
+   * @return Whether update_batch() applies a mini-batch as a single update, rather than falling back to the
+   *   single-example updates of the default implementation.
+   */
+  virtual bool batched_updates() {
+    return false;
+  }
+
   virtual float bias() {
     return 0.f;
   }
+
+  /**
+   * Forget old examples by decaying every weight exponentially with time, if the estimator supports it.
+   *
+   * @param half_life Time over which a weight decays to half its value, in units of \p clock, or 0 to disable decay.
+   * @param clock Count time in examples or in wall-clock seconds.
+   * @return Whether the estimator supports decay.
+   */
+  virtual bool set_decay(float /*half_life*/, DecayClock /*clock*/) {
+    return false;
+  }
+
+  /**
+   * Estimate weights over a tumbling window of examples, if the estimator supports it. Must be called before the
+   * first update.
+   *
+   * @param period Number of examples per window period, or 0 to disable the window.
+   * @return Whether the estimator supports windows.
+   */
+  virtual bool set_window(uint64_t /*period*/) {
+    return false;
+  }
+
+  /**
+   * Export an immutable, thread-safe inference model, if the estimator supports it.
+   *
+   * @param quantize Quantize the exported sketch table to 8-bit cells with a per-row scale.
+   * @return The frozen model, or nullptr if the estimator cannot be frozen.
+   */
+  virtual std::shared_ptr<const FrozenModel> freeze(bool /*quantize*/) {
+    return nullptr;
+  }
+
+  /**
+   * @return Number of bytes used by the estimator's sketch, or 0 if it does not use one.
+   */
+  virtual uint64_t sketch_bytes() {
+    return 0;
+  }
+
+  /**
+   * Write the training state to a checkpoint file, if the estimator supports it. The file is replaced atomically.
+   *
+   * @param path Path of the checkpoint.
+   * @return Whether the estimator supports checkpoints.
+   */
+  virtual bool save(const std::string& /*path*/) {
+    return false;
+  }
+
+  /**
+   * Restore the training state from a checkpoint file written by an estimator of the same type and configuration,
+   * if the estimator supports it. Sketch tables are mapped from the file rather than read, so restoring a large model
+   * is fast. Must be called before the first update.
+   *
+   * @param path Path of the checkpoint.
+   * @return Whether the estimator supports checkpoints.
+   */
+  virtual bool load(const std::string& /*path*/) {
+    return false;
+  }
+
+  /**
+   * Write the changes to the training state since the latest checkpoint saved or loaded, or since construction, to a
+   * delta checkpoint file, if the estimator supports it. Only the blocks of the sketch tables written since then are
+   * stored, so the file size scales with the number of updates rather than the model size. The file is replaced
+   * atomically.
+   *
+   * @param path Path of the delta checkpoint.
+   * @return Whether the estimator supports delta checkpoints.
+   */
+  virtual bool save_delta(const std::string& /*path*/) {
+    return false;
+  }
+
+  /**
+   * Apply a delta checkpoint file written by save_delta() on an estimator of the same type and configuration. The
+   * estimator must be in the state of the checkpoint that the delta follows: the base checkpoint restored by load()
+   * followed by the deltas before this one, in order, or a new estimator for a delta written since construction.
+   *
+   * @param path Path of the delta checkpoint.
+   * @return Whether the estimator supports delta checkpoints.
+   */
+  virtual bool load_delta(const std::string& /*path*/) {
+    return false;
+  }
+
+  /**
+   * Fork the estimator, if it supports it: return a copy as of now that can be evaluated, checkpointed or trained
+   * on another thread while this estimator keeps training. Sketch tables are shared copy-on-write, so forking takes
+   * time independent of the sketch size. Must be called from the thread that updates the estimator.
+   *
+   * @return The copy, or nullptr if the estimator cannot be forked.
+   */
+  virtual std::unique_ptr<TopKFeatures> fork() {
+    return nullptr;
+  }
 };
 
 class LogisticTopK : public TopKFeatures {
@@ -67,7 +387,8 @@ class TruncatedLogisticTopK : public TopKFeatures {
       float lr_init,
       float l2_reg);
   ~TruncatedLogisticTopK() override;
-  void topk(std::vector<std::pair<uint32_t, float> >& out) override;
+  using TopKFeatures::topk;
+  void topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) override;
   float dot(const std::vector<std::pair<uint32_t, float> >& x);
   bool predict(const std::vector<std::pair<uint32_t, float> >& x) override;
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label) override;
@@ -95,7 +416,8 @@ class ProbTruncatedLogisticTopK : public TopKFeatures {
       float l2_reg,
       float pow = 1.0);
   ~ProbTruncatedLogisticTopK();
-  void topk(std::vector<std::pair<uint32_t, float> >& out);
+  using TopKFeatures::topk;
+  void topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) override;
   float dot(const std::vector<std::pair<uint32_t, float> >& x);
   bool predict(const std::vector<std::pair<uint32_t, float> >& x);
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label);
@@ -124,7 +446,8 @@ class SpaceSavingLogisticTopK : public TopKFeatures {
       float l2_reg = 1e-3
   );
   ~SpaceSavingLogisticTopK() override = default;
-  void topk(std::vector<std::pair<uint32_t, float> >& out) override;
+  using TopKFeatures::topk;
+  void topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) override;
   float dot(const std::vector<std::pair<uint32_t, float> >& x);
   bool predict(const std::vector<std::pair<uint32_t, float> >& x) override;
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label) override;
@@ -134,18 +457,21 @@ class SpaceSavingLogisticTopK : public TopKFeatures {
   float get_weight(uint32_t key);
 };
 
-class CountMinLogisticTopK : public TopKFeatures {
+template <class Counter = counter::Uint32>
+class BasicCountMinLogisticTopK : public TopKFeatures {
  private:
   TopKCountHeap cheap_;
-  CountMinSketch sk_;
+  BasicCountMinSketch<Counter> sk_;
   float bias_;
   float lr_init_;
   float l2_reg_;
   float scale_;
   uint64_t t_;
+  std::vector<uint32_t> key_buf_;
+  std::vector<uint32_t> count_buf_;  // count of each key of an example right after its own update
 
  public:
-  CountMinLogisticTopK(
+  BasicCountMinLogisticTopK(
       uint32_t k,
       uint32_t log2_width,
       uint32_t depth,
@@ -154,51 +480,62 @@ class CountMinLogisticTopK : public TopKFeatures {
       float l2_reg = 1e-3,
       bool consv_update = true
   );
-  ~CountMinLogisticTopK() override = default;
-  void topk(std::vector<std::pair<uint32_t, float> >& out) override;
+  ~BasicCountMinLogisticTopK() override = default;
+  using TopKFeatures::topk;
+  void topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) override;
   float dot(const std::vector<std::pair<uint32_t, float> >& x);
   bool predict(const std::vector<std::pair<uint32_t, float> >& x) override;
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label) override;
   float bias() override;
+  uint64_t sketch_bytes() override;
 
  private:
   float get_weight(uint32_t key);
 };
 
-class PairedCountMinTopK : public TopKFeatures {
+typedef BasicCountMinLogisticTopK<counter::Uint32> CountMinLogisticTopK;
+
+template <class Counter = counter::Uint32>
+class BasicPairedCountMinTopK : public TopKFeatures {
  private:
-  PairedCountMin sk_;
+  BasicPairedCountMin<Counter> sk_;
   std::vector<float> new_weights_;
-  std::vector<uint32_t> idxs_;
   uint64_t t_;
 
  public:
-  PairedCountMinTopK(
+  BasicPairedCountMinTopK(
       uint32_t k,
       uint32_t log2_width,
       uint32_t depth,
       int32_t seed,
       float smooth = 1.f,
       bool consv_update = false);
-  ~PairedCountMinTopK();
-  void topk(std::vector<std::pair<uint32_t, float> >& out) override;
+  ~BasicPairedCountMinTopK();
+  using TopKFeatures::topk;
+  void topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) override;
   bool predict(const std::vector<std::pair<uint32_t, float> >& x) override;
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label) override;
   float bias() override;
+  uint64_t sketch_bytes() override;
 
  private:
   void refresh_heap();
 };
 
-class LogisticSketchTopK : public TopKFeatures {
+typedef BasicPairedCountMinTopK<counter::Uint32> PairedCountMinTopK;
+
+template <class Cell = cell::Float32>
+class BasicLogisticSketchTopK : public TopKFeatures {
  private:
-  LogisticSketch sk_;
+  BasicLogisticSketch<Cell> sk_;
   std::vector<float> new_weights_;
+  std::vector<std::pair<uint32_t, float> > batch_weights_;
   std::vector<uint32_t> idxs_;
   uint64_t t_;
+  uint64_t checkpoint_t_;  // step count of the latest checkpoint, which delta checkpoints follow
 
  public:
-  LogisticSketchTopK(
+  BasicLogisticSketchTopK(
       uint32_t k,
       uint32_t log2_width,
       uint32_t depth,
@@ -206,43 +543,81 @@ class LogisticSketchTopK : public TopKFeatures {
       float lr_init = 0.1,
       float l2_reg = 1e-3,
       bool median_update = false);
-  ~LogisticSketchTopK();
-  void topk(std::vector<std::pair<uint32_t, float> >& out);
+  explicit BasicLogisticSketchTopK(BasicLogisticSketchTopK& other);
+  ~BasicLogisticSketchTopK();
+  using TopKFeatures::topk;
+  void topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) override;
   bool predict(const std::vector<std::pair<uint32_t, float> >& x);
+  void predict_batch(const CSR& x, float* margins_out) override;
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label);
+  void update_batch(std::vector<bool>& yhat, const CSR& x, const std::vector<bool>& labels) override;
+  bool batched_updates() override;
+  bool set_decay(float half_life, DecayClock clock) override;
+  bool set_window(uint64_t period) override;
   float bias();
+  std::shared_ptr<const FrozenModel> freeze(bool quantize) override;
+  uint64_t sketch_bytes() override;
+  bool save(const std::string& path) override;
+  bool load(const std::string& path) override;
+  bool save_delta(const std::string& path) override;
+  bool load_delta(const std::string& path) override;
+  std::unique_ptr<TopKFeatures> fork() override;
 
  private:
+  void renormalize();
   void refresh_heap();
 };
 
-class ActiveSetLogisticTopK : public TopKFeatures {
+typedef BasicLogisticSketchTopK<cell::Float32> LogisticSketchTopK;
+
+template <class Cell = cell::Float32>
+class BasicActiveSetLogisticTopK : public TopKFeatures {
  private:
-  CountSketch sk_;
+  typedef typename BasicCountSketch<Cell>::Handle Handle;
+
+  BasicCountSketch<Cell> sk_;
+  TopKHeap<uint32_t, std::hash<uint32_t>, Handle> active_;  // active set, with the sketch handle of each feature
   float bias_;
   float lr_init_;
   float l2_reg_;
   float scale_;
   uint64_t t_;
+  uint64_t checkpoint_t_;  // step count of the latest checkpoint, which delta checkpoints follow
   std::vector<float> weight_buf_;
-  std::vector<std::tuple<uint32_t, float, float> > heap_feats_, sk_feats_;
+  std::vector<std::tuple<uint32_t, float, float> > heap_feats_;
+  std::vector<std::tuple<uint32_t, float, float, uint32_t> > sk_feats_;  // (idx, val, w, handle slot)
+  std::vector<Handle> sk_handles_, evict_handles_;
+  std::vector<uint32_t> sk_keys_, sk_pos_;
+  std::vector<float> sk_weights_, evict_weights_;
 
  public:
-  ActiveSetLogisticTopK(
+  BasicActiveSetLogisticTopK(
       uint32_t k,
       uint32_t log2_width,
       uint32_t depth,
       int32_t seed,
       float lr_init = 0.1,
       float l2_reg = 1e-3);
-  ~ActiveSetLogisticTopK();
-  void topk(std::vector<std::pair<uint32_t, float> >& out);
+  explicit BasicActiveSetLogisticTopK(BasicActiveSetLogisticTopK& other);
+  ~BasicActiveSetLogisticTopK();
+  using TopKFeatures::topk;
+  void topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) override;
   float dot(const std::vector<std::pair<uint32_t, float> >& x);
   bool predict(const std::vector<std::pair<uint32_t, float> >& x);
+  void predict_batch(const CSR& x, float* margins_out) override;
   bool update(const std::vector<std::pair<uint32_t, float> >& x, bool label);
   float bias();
+  std::shared_ptr<const FrozenModel> freeze(bool quantize) override;
+  uint64_t sketch_bytes() override;
+  bool save(const std::string& path) override;
+  bool load(const std::string& path) override;
+  bool save_delta(const std::string& path) override;
+  bool load_delta(const std::string& path) override;
+  std::unique_ptr<TopKFeatures> fork() override;
 };
 
+typedef BasicActiveSetLogisticTopK<cell::Float32> ActiveSetLogisticTopK;
+
 } // namespace wmsketch
 
 #endif /* SRC_TOPK_H_ */
@@ -16,11 +16,50 @@
 
 namespace wmsketch {
 
+// number of keys to hash and prefetch ahead of the gather in batched sketch queries
+static const uint32_t PREFETCH_DISTANCE = 8;
+
+// sketch depth up to which per-query scratch space is allocated on the stack
+static const uint32_t STACK_DEPTH = 16;
+
 void tic(uint64_t& s);
 uint64_t toc(uint64_t s);
 
 float mean(const std::vector<float>& buf);
+float mean(const float* buf, size_t n);
 float median(std::vector<float>& buf);
+float median(float* buf, size_t n);
+
+/**
+ * Scratch array that lives on the stack when it holds at most N elements and on the heap otherwise.
+ */
+template <class T, size_t N>
+class ScratchBuffer {
+ private:
+  T local_[N];
+  std::vector<T> heap_;
+  T* data_;
+
+ public:
+  explicit ScratchBuffer(size_t n)
+   : data_{local_} {
+    if (n > N) {
+      heap_.resize(n);
+      data_ = heap_.data();
+    }
+  }
+
+  ScratchBuffer(const ScratchBuffer&) = delete;
+  ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+
+  T* data() {
+    return data_;
+  }
+
+  T& operator[](size_t i) {
+    return data_[i];
+  }
+};
 
 float sigmoid(float x);
 float logistic_loss(float x);
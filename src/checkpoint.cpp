@@ -0,0 +1,251 @@
+#include "checkpoint.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace wmsketch {
+
+namespace {
+
+static const uint32_t END_TAG = checkpoint_tag("END ");
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  char model[CHECKPOINT_MODEL_LEN];
+};
+
+struct RecordHeader {
+  uint32_t tag;
+  uint32_t flags;
+  uint64_t size;
+};
+
+static_assert(sizeof(Header) == 64, "Unexpected checkpoint header layout");
+static_assert(sizeof(RecordHeader) == 16, "Unexpected checkpoint record layout");
+
+std::runtime_error io_error(const std::string& what, const std::string& path) {
+  return std::runtime_error(what + " " + path + ": " + strerror(errno));
+}
+
+uint64_t align_up(uint64_t x, uint64_t align) {
+  return (x + align - 1) / align * align;
+}
+
+} // namespace
+
+CheckpointWriter::CheckpointWriter(const std::string& path, const std::string& model)
+ : path_(path),
+   tmp_path_(path + ".tmp"),
+   offset_{0} {
+
+  if (model.size() >= CHECKPOINT_MODEL_LEN) {
+    throw std::invalid_argument("Checkpoint model name too long");
+  }
+
+  fd_ = open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) throw io_error("Failed to create checkpoint", tmp_path_);
+
+  Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+  h.version = CHECKPOINT_VERSION;
+  h.byte_order = CHECKPOINT_BYTE_ORDER;
+  memcpy(h.model, model.data(), model.size());
+  write_all(&h, sizeof(h));
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  if (fd_ >= 0) {
+    close(fd_);
+    unlink(tmp_path_.c_str());
+  }
+}
+
+void CheckpointWriter::write(uint32_t tag, const void* data, uint64_t size, bool page_aligned) {
+  if (fd_ < 0) throw std::runtime_error("Checkpoint already committed");
+  RecordHeader r = {tag, page_aligned ? CHECKPOINT_ALIGNED : 0, size};
+  write_all(&r, sizeof(r));
+  if (page_aligned) pad(CHECKPOINT_PAGE);
+  write_all(data, size);
+  pad(8);
+}
+
+void CheckpointWriter::write_gather(uint32_t tag, const std::vector<std::pair<const void*, uint64_t> >& parts) {
+  if (fd_ < 0) throw std::runtime_error("Checkpoint already committed");
+  uint64_t size = 0;
+  for (const auto& p : parts) {
+    size += p.second;
+  }
+  RecordHeader r = {tag, 0, size};
+  write_all(&r, sizeof(r));
+  for (const auto& p : parts) {
+    write_all(p.first, p.second);
+  }
+  pad(8);
+}
+
+void CheckpointWriter::write_strings(uint32_t tag, const std::vector<std::string>& strs) {
+  std::vector<char> buf(sizeof(uint64_t) * (strs.size() + 1));
+  uint64_t* lens = (uint64_t*) buf.data();
+  lens[0] = strs.size();
+  for (size_t i = 0; i < strs.size(); i++) {
+    lens[i + 1] = strs[i].size();
+  }
+  for (const auto& s : strs) {
+    buf.insert(buf.end(), s.begin(), s.end());
+  }
+  write(tag, buf.data(), buf.size());
+}
+
+void CheckpointWriter::commit() {
+  write(END_TAG, nullptr, 0);
+  if (fsync(fd_) != 0) throw io_error("Failed to flush checkpoint", tmp_path_);
+  if (close(fd_) != 0) {
+    fd_ = -1;
+    unlink(tmp_path_.c_str());
+    throw io_error("Failed to close checkpoint", tmp_path_);
+  }
+  fd_ = -1;
+  if (rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+    unlink(tmp_path_.c_str());
+    throw io_error("Failed to move checkpoint to", path_);
+  }
+}
+
+void CheckpointWriter::write_all(const void* data, uint64_t size) {
+  // a sketch table is written with a single call, except when the kernel returns a short write
+  const char* p = (const char*) data;
+  while (size > 0) {
+    ssize_t n = ::write(fd_, p, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw io_error("Failed to write checkpoint", tmp_path_);
+    }
+    p += n;
+    size -= n;
+    offset_ += n;
+  }
+}
+
+void CheckpointWriter::pad(uint64_t align) {
+  static const char zeros[CHECKPOINT_PAGE] = {0};
+  write_all(zeros, align_up(offset_, align) - offset_);
+}
+
+CheckpointReader::CheckpointReader(const std::string& path)
+ : offset_{0} {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw io_error("Failed to open checkpoint", path);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw io_error("Failed to stat checkpoint", path);
+  }
+  size_ = st.st_size;
+  if (size_ < sizeof(Header)) {
+    close(fd);
+    throw std::runtime_error("Not a checkpoint: " + path);
+  }
+
+  void* addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) throw io_error("Failed to map checkpoint", path);
+  uint64_t len = size_;
+  mapping_ = std::shared_ptr<void>(addr, [len](void* p) { munmap(p, len); });
+  base_ = (const char*) addr;
+
+  Header h;
+  memcpy(&h, base_, sizeof(h));
+  if (memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0) {
+    throw std::runtime_error("Not a checkpoint: " + path);
+  }
+  if (h.version != CHECKPOINT_VERSION) {
+    throw std::runtime_error("Unsupported checkpoint version " + std::to_string(h.version));
+  }
+  if (h.byte_order != CHECKPOINT_BYTE_ORDER) {
+    throw std::runtime_error("Checkpoint was written on a machine with a different byte order");
+  }
+  model_ = std::string(h.model, strnlen(h.model, CHECKPOINT_MODEL_LEN));
+  offset_ = sizeof(h);
+}
+
+void CheckpointReader::expect_model(const std::string& model) const {
+  if (model_ != model) {
+    throw std::runtime_error("Checkpoint holds a " + model_ + " model, expected " + model);
+  }
+}
+
+const void* CheckpointReader::read(uint32_t tag, uint64_t& size) {
+  bool aligned;
+  return next(tag, size, aligned);
+}
+
+void CheckpointReader::read(uint32_t tag, void* out, uint64_t size) {
+  uint64_t n;
+  const void* p = read(tag, n);
+  if (n != size) throw std::runtime_error("Checkpoint record has unexpected size");
+  if (size > 0) memcpy(out, p, size);
+}
+
+void CheckpointReader::read_strings(uint32_t tag, std::vector<std::string>& out) {
+  uint64_t size;
+  const char* p = (const char*) read(tag, size);
+  uint64_t count;
+  if (size < sizeof(count)) throw std::runtime_error("Malformed checkpoint record");
+  memcpy(&count, p, sizeof(count));
+  if (count > size / sizeof(count) - 1) throw std::runtime_error("Malformed checkpoint record");
+
+  const char* lens = p + sizeof(count);
+  const char* chars = lens + count * sizeof(count);
+  const char* end = p + size;
+  out.clear();
+  out.reserve(count);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t len;
+    memcpy(&len, lens + i * sizeof(len), sizeof(len));
+    if (len > (uint64_t) (end - chars)) throw std::runtime_error("Malformed checkpoint record");
+    out.emplace_back(chars, len);
+    chars += len;
+  }
+}
+
+void* CheckpointReader::map(uint32_t tag, uint64_t size) {
+  uint64_t n;
+  bool aligned;
+  const char* p = next(tag, n, aligned);
+  if (n != size) throw std::runtime_error("Checkpoint record has unexpected size");
+  if (!aligned) throw std::runtime_error("Checkpoint record is not page-aligned");
+  return (void*) p;
+}
+
+void CheckpointReader::finish() {
+  uint64_t size;
+  read(END_TAG, size);
+}
+
+const char* CheckpointReader::next(uint32_t tag, uint64_t& size, bool& aligned) {
+  RecordHeader r;
+  if (offset_ > size_ || size_ - offset_ < sizeof(r)) throw std::runtime_error("Truncated checkpoint");
+  memcpy(&r, base_ + offset_, sizeof(r));
+  if (r.tag != tag) {
+    throw std::runtime_error(
+        "Unexpected checkpoint record " + std::string((const char*) &r.tag, 4) +
+        ", expected " + std::string((const char*) &tag, 4));
+  }
+
+  uint64_t start = offset_ + sizeof(r);
+  aligned = (r.flags & CHECKPOINT_ALIGNED) != 0;
+  if (aligned) start = align_up(start, CHECKPOINT_PAGE);
+  if (start > size_ || r.size > size_ - start) throw std::runtime_error("Truncated checkpoint");
+
+  size = r.size;
+  offset_ = align_up(start + r.size, 8);
+  return base_ + start;
+}
+
+} // namespace wmsketch
@@ -1,17 +1,19 @@
 #include "util.h"
+#include <cstring>
 #include <random>
 #include "countmin.h"
 
 
 namespace wmsketch {
 
-CountMinSketch::CountMinSketch(uint32_t log2_width, uint32_t depth, int32_t seed, bool consv_update)
+template <class Counter>
+BasicCountMinSketch<Counter>::BasicCountMinSketch(uint32_t log2_width, uint32_t depth, int32_t seed, bool consv_update)
  : depth_{depth},
    consv_update_{consv_update},
-   hash_fn_(depth, seed),
-   hash_buf_(depth, 0) {
+   counts_(log2_width <= MAX_LOG2_WIDTH ? log2_width : 0, depth),  // width is validated below
+   hash_fn_(depth, seed) {
 
-  if (log2_width > CountMinSketch::MAX_LOG2_WIDTH) {
+  if (log2_width > BasicCountMinSketch::MAX_LOG2_WIDTH) {
     throw std::invalid_argument("Invalid sketch width");
   }
 
@@ -21,56 +23,119 @@ CountMinSketch::CountMinSketch(uint32_t log2_width, uint32_t depth, int32_t seed
 
   uint32_t width = 1 << log2_width;
   width_mask_ = width - 1;
-
-  counts_ = (uint32_t**) calloc(depth, sizeof(uint32_t*));
-  counts_[0] = (uint32_t*) calloc(depth * width, sizeof(uint32_t));
-
-  for (int i = 0; i < depth; i++) {
-    counts_[i] = counts_[0] + (i * width);
-  }
 }
 
-CountMinSketch::~CountMinSketch() {
-  free(counts_[0]);
-  free(counts_);
-}
+template <class Counter>
+BasicCountMinSketch<Counter>::~BasicCountMinSketch() = default;
 
-uint32_t CountMinSketch::get(uint32_t key) {
-  hash_fn_.hash(hash_buf_.data(), key);
-  uint32_t min = counts_[0][hash_buf_[0] & width_mask_];
+template <class Counter>
+uint32_t BasicCountMinSketch<Counter>::get(uint32_t key) const {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
+  uint32_t min = counts_.get(0, hashes[0] & width_mask_);
   for (int i = 1; i < depth_; i++) {
-    min = MIN(min, counts_[i][hash_buf_[i] & width_mask_]);
+    min = MIN(min, counts_.get(i, hashes[i] & width_mask_));
   }
   return min;
 }
 
-uint32_t CountMinSketch::update(uint32_t key) {
-  hash_fn_.hash(hash_buf_.data(), key);
+template <class Counter>
+uint32_t BasicCountMinSketch<Counter>::update(uint32_t key) {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
   for (int i = 0; i < depth_; i++) {
-    hash_buf_[i] &= width_mask_;
+    hashes[i] &= width_mask_;
   }
 
   uint32_t c;
   if (consv_update_) {
-    c = counts_[0][hash_buf_[0]];
+    c = counts_.get(0, hashes[0]);
     for (int i = 1; i < depth_; i++) {
-      c = MIN(c, counts_[i][hash_buf_[i]]);
+      c = MIN(c, counts_.get(i, hashes[i]));
     }
 
     for (int i = 0; i < depth_; i++) {
-      uint32_t j = hash_buf_[i];
-      counts_[i][j] = MAX(c + 1, counts_[i][j]);
+      uint32_t j = hashes[i];
+      uint32_t v = counts_.get(i, j);
+      if (c + 1 > v) counts_.set(i, j, c + 1);
     }
   } else {
     c = UINT_MAX;
     for (int i = 0; i < depth_; i++) {
-      uint32_t j = hash_buf_[i];
-      c = MIN(c, counts_[i][j]);
-      counts_[i][j]++;
+      uint32_t j = hashes[i];
+      c = MIN(c, counts_.get(i, j));
+      counts_.increment(i, j);
     }
   }
 
   return c + 1;
 }
 
+template <class Counter>
+void BasicCountMinSketch<Counter>::update_batch(const uint32_t* keys, uint64_t n, uint32_t* counts_out) {
+  const uint32_t w = simd::WIDTH;
+  uint64_t s = 0;
+  if (counts_.gatherable()) {
+    // the cell of key s + b in row i is at offset offsets[i * w + b] of the table
+    ScratchBuffer<uint32_t, STACK_DEPTH * simd::WIDTH> offsets(depth_ * w);
+    ScratchBuffer<uint32_t, STACK_DEPTH * simd::WIDTH> vals(depth_ * w);
+    ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+    uint32_t mins[simd::WIDTH];
+    uint32_t width = width_mask_ + 1;
+    for (; s + w <= n; s += w) {
+      for (uint32_t b = 0; b < w; b++) {
+        hash_fn_.hash(hashes.data(), keys[s + b]);
+        for (int i = 0; i < depth_; i++) {
+          offsets[i * w + b] = i * width + (hashes[i] & width_mask_);
+        }
+      }
+
+      bool conflict = false;
+      for (int i = 0; i < depth_ && !conflict; i++) {
+        conflict = simd::has_conflict(offsets.data() + i * w);
+      }
+
+      if (conflict) {
+        // keys that share a cell must observe each other's updates
+        for (uint32_t b = 0; b < w; b++) {
+          counts_out[s + b] = update(keys[s + b]);
+        }
+        continue;
+      }
+
+      for (int i = 0; i < depth_; i++) {
+        counts_.gather(offsets.data() + i * w, vals.data() + i * w);
+      }
+      memcpy(mins, vals.data(), sizeof(mins));
+      for (int i = 1; i < depth_; i++) {
+        simd::min_u32(mins, vals.data() + i * w);
+      }
+
+      for (int i = 0; i < depth_; i++) {
+        for (uint32_t b = 0; b < w; b++) {
+          uint32_t v = vals[i * w + b];
+          if (!consv_update_) counts_.set_at(offsets[i * w + b], v + 1);
+          else if (mins[b] + 1 > v) counts_.set_at(offsets[i * w + b], mins[b] + 1);
+        }
+      }
+
+      for (uint32_t b = 0; b < w; b++) {
+        counts_out[s + b] = mins[b] + 1;
+      }
+    }
+  }
+
+  for (; s < n; s++) {
+    counts_out[s] = update(keys[s]);
+  }
+}
+
+template <class Counter>
+uint64_t BasicCountMinSketch<Counter>::size_bytes() const {
+  return counts_.size_bytes();
+}
+
+template class BasicCountMinSketch<counter::Uint32>;
+template class BasicCountMinSketch<counter::Uint8>;
+
 } // namespace wmsketch
@@ -3,54 +3,318 @@
 
 namespace wmsketch {
 
-CountSketch::CountSketch(
+template <class Cell>
+BasicCountSketch<Cell>::BasicCountSketch(
     uint32_t log2_width,
     uint32_t depth,
     int32_t seed)
  : depth_{depth},
-   hash_fn_(depth, seed),
-   hash_buf_(depth, 0),
-   weight_buf_(depth, 0) {
+   log2_width_{log2_width},
+   seed_{seed},
+   weights_(log2_width <= MAX_LOG2_WIDTH ? log2_width : 0, depth, seed),  // width is validated below
+   hash_fn_(depth, seed) {
 
-  if (log2_width > CountSketch::MAX_LOG2_WIDTH) {
+  if (log2_width > BasicCountSketch::MAX_LOG2_WIDTH) {
     throw std::invalid_argument("Invalid sketch width");
   }
 
   uint32_t width = 1 << log2_width;
   width_mask_ = width - 1;
+}
+
+template <class Cell>
+BasicCountSketch<Cell>::BasicCountSketch(BasicCountSketch& other)
+ : depth_{other.depth_},
+   log2_width_{other.log2_width_},
+   seed_{other.seed_},
+   width_mask_{other.width_mask_},
+   weights_(other.weights_),
+   hash_fn_(other.hash_fn_) { }
+
+template <class Cell>
+BasicCountSketch<Cell>::~BasicCountSketch() = default;
+
+template <class Cell>
+float BasicCountSketch<Cell>::get(uint32_t key) const {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
+  return estimate(hashes.data());
+}
 
-  weights_ = (float**) calloc(depth, sizeof(float*));
-  weights_[0] = (float*) calloc(width * depth, sizeof(float));
-  for (int i = 0; i < depth; i++) {
-    weights_[i] = weights_[0] + i * width;
+template <class Cell>
+void BasicCountSketch<Cell>::get_batch(const uint32_t* keys, uint64_t n, float* out) const {
+  // hashes for key j are kept in slot j % (PREFETCH_DISTANCE + 1) of the hash buffer
+  uint32_t slots = PREFETCH_DISTANCE + 1;
+  ScratchBuffer<uint32_t, STACK_DEPTH * (PREFETCH_DISTANCE + 1)> hashes(depth_ * slots);
+  for (uint64_t j = 0; j < n && j < PREFETCH_DISTANCE; j++) {
+    prefetch(hashes.data() + (j % slots) * depth_, keys[j]);
   }
+
+  for (uint64_t j = 0; j < n; j++) {
+    if (j + PREFETCH_DISTANCE < n) {
+      uint64_t a = j + PREFETCH_DISTANCE;
+      prefetch(hashes.data() + (a % slots) * depth_, keys[a]);
+    }
+
+    out[j] = estimate(hashes.data() + (j % slots) * depth_);
+  }
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::update(uint32_t key, float delta) {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
+  scatter(hashes.data(), delta);
 }
 
-CountSketch::~CountSketch() {
-  free(weights_[0]);
-  free(weights_);
+template <class Cell>
+void BasicCountSketch<Cell>::locate(uint32_t key, Handle& out) const {
+  out.key = key;
+  if (depth_ <= MAX_HANDLE_DEPTH) hash_fn_.hash(out.hashes, key);
 }
 
-float CountSketch::get(uint32_t key) {
-  hash_fn_.hash(hash_buf_.data(), key);
+template <class Cell>
+const uint32_t* BasicCountSketch<Cell>::handle_hashes(const Handle& handle, uint32_t* buf) const {
+  if (depth_ <= MAX_HANDLE_DEPTH) return handle.hashes;
+  hash_fn_.hash(buf, handle.key);
+  return buf;
+}
+
+template <class Cell>
+float BasicCountSketch<Cell>::get(const Handle& handle) const {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_ <= MAX_HANDLE_DEPTH ? 0 : depth_);
+  return estimate(handle_hashes(handle, hashes.data()));
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::add(const Handle& handle, float delta) {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_ <= MAX_HANDLE_DEPTH ? 0 : depth_);
+  scatter(handle_hashes(handle, hashes.data()), delta);
+}
 
+template <class Cell>
+std::pair<float, float> BasicCountSketch<Cell>::add_and_get(uint32_t key, float delta) {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
+  return read_modify_write(hashes.data(), delta, false);
+}
+
+template <class Cell>
+std::pair<float, float> BasicCountSketch<Cell>::add_and_get(const Handle& handle, float delta) {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_ <= MAX_HANDLE_DEPTH ? 0 : depth_);
+  return read_modify_write(handle_hashes(handle, hashes.data()), delta, false);
+}
+
+template <class Cell>
+std::pair<float, float> BasicCountSketch<Cell>::set_estimate(uint32_t key, float target) {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
+  return read_modify_write(hashes.data(), target, true);
+}
+
+template <class Cell>
+std::pair<float, float> BasicCountSketch<Cell>::set_estimate(const Handle& handle, float target) {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_ <= MAX_HANDLE_DEPTH ? 0 : depth_);
+  return read_modify_write(handle_hashes(handle, hashes.data()), target, true);
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::set_estimate_batch(const uint32_t* keys, const float* targets, uint64_t n) {
+  // hashes for key j are kept in slot j % (PREFETCH_DISTANCE + 1) of the hash buffer
+  uint32_t slots = PREFETCH_DISTANCE + 1;
+  ScratchBuffer<uint32_t, STACK_DEPTH * (PREFETCH_DISTANCE + 1)> hashes(depth_ * slots);
+  for (uint64_t j = 0; j < n && j < PREFETCH_DISTANCE; j++) {
+    prefetch(hashes.data() + (j % slots) * depth_, keys[j]);
+  }
+
+  for (uint64_t j = 0; j < n; j++) {
+    if (j + PREFETCH_DISTANCE < n) {
+      uint64_t a = j + PREFETCH_DISTANCE;
+      prefetch(hashes.data() + (a % slots) * depth_, keys[a]);
+    }
+
+    const uint32_t* ph = hashes.data() + (j % slots) * depth_;
+    scatter(ph, targets[j] - estimate(ph));
+  }
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::set_estimate_batch(const Handle* handles, const float* targets, uint64_t n) {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_ <= MAX_HANDLE_DEPTH ? 0 : depth_);
+  for (uint64_t j = 0; j < n && j < PREFETCH_DISTANCE; j++) {
+    prefetch(handles[j]);
+  }
+
+  for (uint64_t j = 0; j < n; j++) {
+    if (j + PREFETCH_DISTANCE < n) prefetch(handles[j + PREFETCH_DISTANCE]);
+    const uint32_t* ph = handle_hashes(handles[j], hashes.data());
+    scatter(ph, targets[j] - estimate(ph));
+  }
+}
+
+template <class Cell>
+std::shared_ptr<const FrozenModel> BasicCountSketch<Cell>::freeze(
+    const std::vector<std::pair<uint32_t, float> >& exact,
+    float scale,
+    float bias,
+    bool quantize) const {
+  std::vector<float> table;
+  weights_.decode(table);
+  return std::make_shared<const FrozenModel>(
+      hash_fn_, depth_, log2_width_, std::move(table), scale, bias, true, exact, std::vector<uint32_t>(), quantize);
+}
+
+template <class Cell>
+uint64_t BasicCountSketch<Cell>::size_bytes() const {
+  return weights_.size_bytes();
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::save(CheckpointWriter& out) const {
+  save_config(out);
+  weights_.save(out);
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::load(CheckpointReader& in) {
+  check_config(in);
+  weights_.load(in);
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::save_delta(CheckpointWriter& out) const {
+  save_config(out);
+  weights_.save_delta(out);
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::load_delta(CheckpointReader& in) {
+  check_config(in);
+  weights_.load_delta(in);
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::mark_clean() {
+  weights_.mark_clean();
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::mark_synced() {
+  sync_base_.reset();
+  sync_base_.reset(new SketchTable<Cell>(weights_));
+  weights_.mark_synced();
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::extract_delta(SketchDelta& out) const {
+  if (!sync_base_) throw std::runtime_error("No sync point");
+  out.clear();
+  out.depth = depth_;
+  out.log2_width = log2_width_;
+  weights_.diff(*sync_base_, 1.f, 1.f, out.indices, out.values);
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::apply_delta(const SketchDelta& delta, float weight) {
+  if (delta.depth != depth_ || delta.log2_width != log2_width_) {
+    throw std::runtime_error("Delta does not match the sketch dimensions");
+  }
+  if (delta.indices.size() != delta.values.size()) throw std::runtime_error("Malformed sketch delta");
+  uint64_t n = (uint64_t) depth_ << log2_width_;
+  for (size_t i = 0; i < delta.indices.size(); i++) {
+    uint32_t idx = delta.indices[i];
+    if (idx >= n) throw std::runtime_error("Malformed sketch delta");
+    weights_.add(idx >> log2_width_, idx & width_mask_, weight * delta.values[i]);
+  }
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::revert_to_sync() {
+  if (!sync_base_) throw std::runtime_error("No sync point");
+  weights_.revert(*sync_base_, false);
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::save_config(CheckpointWriter& out) const {
+  int32_t conf[3] = {(int32_t) log2_width_, (int32_t) depth_, seed_};
+  out.write(checkpoint_tag("CSKC"), conf, sizeof(conf));
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::check_config(CheckpointReader& in) const {
+  int32_t conf[3];
+  in.read(checkpoint_tag("CSKC"), conf, sizeof(conf));
+  if (conf[0] != (int32_t) log2_width_ || conf[1] != (int32_t) depth_ || conf[2] != seed_) {
+    throw std::runtime_error("Checkpoint sketch does not match the model configuration");
+  }
+}
+
+template <class Cell>
+float BasicCountSketch<Cell>::estimate(const uint32_t* hashes) const {
+  ScratchBuffer<float, STACK_DEPTH> buf(depth_);
   for (int i = 0; i < depth_; i++) {
-    uint32_t h = hash_buf_[i];
+    uint32_t h = hashes[i];
     int sgn = (h >> 31) ? +1 : -1;
-    weight_buf_[i] = sgn * weights_[i][h & width_mask_];
+    buf[i] = sgn * weights_.get(i, h & width_mask_);
   }
+  return median(buf.data(), depth_);
+}
 
-  return median(weight_buf_);
+template <class Cell>
+void BasicCountSketch<Cell>::scatter(const uint32_t* hashes, float delta) {
+  for (int i = 0; i < depth_; i++) {
+    uint32_t h = hashes[i];
+    int sgn = (h >> 31) ? +1 : -1;
+    weights_.add(i, h & width_mask_, sgn * delta);
+  }
 }
 
-void CountSketch::update(uint32_t key, float delta) {
-  hash_fn_.hash(hash_buf_.data(), key);
+template <class Cell>
+std::pair<float, float> BasicCountSketch<Cell>::read_modify_write(const uint32_t* hashes, float val, bool absolute) {
+  ScratchBuffer<float, STACK_DEPTH> before(depth_);
+  ScratchBuffer<float, STACK_DEPTH> after(depth_);
+  if (!absolute) {
+    for (int i = 0; i < depth_; i++) {
+      uint32_t h = hashes[i];
+      int sgn = (h >> 31) ? +1 : -1;
+      before[i] = sgn * weights_.get(i, h & width_mask_);
+      weights_.add(i, h & width_mask_, sgn * val);
+      after[i] = sgn * weights_.get(i, h & width_mask_);
+    }
+    return std::make_pair(median(before.data(), depth_), median(after.data(), depth_));
+  }
 
+  // the update depends on the current estimate, so the cells are read before any is written
+  float old = estimate(hashes);
+  float delta = val - old;
   for (int i = 0; i < depth_; i++) {
-    uint32_t h = hash_buf_[i];
+    uint32_t h = hashes[i];
     int sgn = (h >> 31) ? +1 : -1;
-    weights_[i][h & width_mask_] += sgn * delta;
+    weights_.add(i, h & width_mask_, sgn * delta);
+    after[i] = sgn * weights_.get(i, h & width_mask_);
   }
+  return std::make_pair(old, median(after.data(), depth_));
 }
 
+template <class Cell>
+void BasicCountSketch<Cell>::prefetch(uint32_t* hashes, uint32_t key) const {
+  hash_fn_.hash(hashes, key);
+  for (int i = 0; i < depth_; i++) {
+    __builtin_prefetch(weights_.cell_ptr(i, hashes[i] & width_mask_));
+  }
+}
+
+template <class Cell>
+void BasicCountSketch<Cell>::prefetch(const Handle& handle) const {
+  if (depth_ > MAX_HANDLE_DEPTH) return;  // the key would have to be hashed again
+  for (int i = 0; i < depth_; i++) {
+    __builtin_prefetch(weights_.cell_ptr(i, handle.hashes[i] & width_mask_));
+  }
+}
+
+template class BasicCountSketch<cell::Float32>;
+template class BasicCountSketch<cell::BFloat16>;
+template class BasicCountSketch<cell::Int16>;
+template class BasicCountSketch<cell::Int8>;
+
 } // namespace wmsketch
@@ -0,0 +1,155 @@
+#include "cow_region.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace wmsketch {
+
+namespace {
+
+static const uint64_t PAGE = 4096;
+
+// /proc/self/pagemap entry flags
+static const uint64_t PM_PRESENT = 1ull << 63;
+static const uint64_t PM_SWAPPED = 1ull << 62;
+static const uint64_t PM_FILE = 1ull << 61;
+
+std::runtime_error os_error(const std::string& what) {
+  return std::runtime_error(what + ": " + strerror(errno));
+}
+
+bool is_zero(const char* p, uint64_t n) {
+  static const char zeros[PAGE] = {0};
+  return memcmp(p, zeros, n) == 0;
+}
+
+} // namespace
+
+CowRegion::CowRegion(const void* data, uint64_t size)
+ : fd_{-1},
+   addr_{nullptr},
+   size_{size} {
+  fd_ = create_file(size_);
+  addr_ = (char*) mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (addr_ == MAP_FAILED) {
+    close(fd_);
+    throw os_error("Failed to map shared memory");
+  }
+
+  // copy the initial contents through a shared mapping; holes in the file already read as zeros
+  const char* src = (const char*) data;
+  for (uint64_t off = 0; off < size_; off += PAGE) {
+    uint64_t n = (size_ - off < PAGE) ? size_ - off : PAGE;
+    if (!is_zero(src + off, n)) memcpy(addr_ + off, src + off, n);
+  }
+
+  try {
+    map_region();
+  } catch (...) {
+    munmap(addr_, size_);
+    close(fd_);
+    throw;
+  }
+}
+
+CowRegion::~CowRegion() {
+  munmap(addr_, size_);
+  close(fd_);
+}
+
+std::shared_ptr<void> CowRegion::fork() {
+  if (!frozen_.expired()) {
+    // the file holds the image of a live fork, so the current contents move to a new file
+    int fd = create_file(size_);
+    try {
+      write_range(fd, 0, size_);
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd_);
+    fd_ = fd;
+  } else {
+    write_back();
+  }
+  map_region();
+
+  void* image = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd_, 0);
+  if (image == MAP_FAILED) throw os_error("Failed to map shared memory");
+  uint64_t size = size_;
+  std::shared_ptr<void> owner(image, [size](void* p) { munmap(p, size); });
+  frozen_ = owner;
+  return owner;
+}
+
+int CowRegion::create_file(uint64_t size) {
+  int fd = memfd_create("wmsketch", MFD_CLOEXEC);
+  if (fd < 0) throw os_error("Failed to create shared memory");
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    throw os_error("Failed to size shared memory");
+  }
+  return fd;
+}
+
+void CowRegion::write_range(int fd, uint64_t offset, uint64_t size) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, addr_ + offset, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw os_error("Failed to write shared memory");
+    }
+    offset += n;
+    size -= n;
+  }
+}
+
+void CowRegion::write_back() {
+  // pages that the region has written since it was mapped are anonymous copies; all other pages still map the file
+  int pm = open("/proc/self/pagemap", O_RDONLY);
+  if (pm < 0) {
+    write_range(fd_, 0, size_);
+    return;
+  }
+
+  uint64_t pages = (size_ + PAGE - 1) / PAGE;
+  std::vector<uint64_t> entries(pages);
+  uint64_t first = (uint64_t) addr_ / PAGE;
+  uint64_t bytes = pages * sizeof(uint64_t);
+  ssize_t n = pread(pm, entries.data(), bytes, first * sizeof(uint64_t));
+  close(pm);
+  if (n != (ssize_t) bytes) {
+    write_range(fd_, 0, size_);
+    return;
+  }
+
+  uint64_t i = 0;
+  while (i < pages) {
+    auto dirty = [&entries](uint64_t j) {
+      uint64_t e = entries[j];
+      return ((e & PM_PRESENT) && !(e & PM_FILE)) || (e & PM_SWAPPED);
+    };
+    if (!dirty(i)) {
+      i++;
+      continue;
+    }
+    uint64_t j = i;
+    while (j < pages && dirty(j)) j++;
+    uint64_t end = (j * PAGE < size_) ? j * PAGE : size_;
+    write_range(fd_, i * PAGE, end - i * PAGE);
+    i = j;
+  }
+}
+
+void CowRegion::map_region() {
+  // replacing the mapping in place keeps addr_ valid and drops any private copies of pages
+  void* p = mmap(addr_, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd_, 0);
+  if (p == MAP_FAILED) throw os_error("Failed to map shared memory");
+}
+
+} // namespace wmsketch
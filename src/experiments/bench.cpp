@@ -0,0 +1,529 @@
+/*
+ * Microbenchmarks of the core data structures.
+ *
+ * Each benchmark times a loop of operations on one structure, e.g. a single LogisticSketch update, growing the number
+ * of iterations until the loop runs for at least --min_time seconds, as Google Benchmark does. Setup and warm-up
+ * (e.g. filling a heap or reservoir to capacity) are not timed.
+ *
+ * Outputs one result per benchmark in JSON format, with the time per operation (ns_per_op), the bytes and number of
+ * heap allocations made through operator new per operation (bytes_per_op, allocs_per_op), and for benchmarks that
+ * consume input, the input bytes per operation and the input throughput (input_bytes_per_op, mb_per_sec).
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "cxxopts.hpp"
+#include "json.hpp"
+#include "util.h"
+#include "hash.h"
+#include "heap.h"
+#include "countsketch.h"
+#include "logistic_sketch.h"
+#include "sgns.h"
+#include "dataset.h"
+
+using namespace wmsketch;
+using json = nlohmann::json;
+
+namespace {
+
+// heap allocations made through operator new; the benchmarks are single-threaded
+uint64_t alloc_count = 0;
+uint64_t alloc_bytes = 0;
+
+} // namespace
+
+namespace {
+
+// every replaced operator new allocates through here, and every operator delete releases with free()
+void* counted_alloc(size_t n, size_t align) {
+  alloc_count++;
+  alloc_bytes += n;
+  if (n == 0) n = 1;
+  void* p = nullptr;
+  if (align <= alignof(std::max_align_t)) {
+    p = malloc(n);
+  } else if (posix_memalign(&p, align, n) != 0) {
+    p = nullptr;
+  }
+  return p;
+}
+
+void* counted_alloc_or_throw(size_t n, size_t align) {
+  void* p = counted_alloc(n, align);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+} // namespace
+
+void* operator new(size_t n) {
+  return counted_alloc_or_throw(n, 0);
+}
+
+void* operator new[](size_t n) {
+  return counted_alloc_or_throw(n, 0);
+}
+
+void* operator new(size_t n, const std::nothrow_t&) noexcept {
+  return counted_alloc(n, 0);
+}
+
+void* operator new[](size_t n, const std::nothrow_t&) noexcept {
+  return counted_alloc(n, 0);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  free(p);
+}
+
+#ifdef __cpp_aligned_new
+void* operator new(size_t n, std::align_val_t align) {
+  return counted_alloc_or_throw(n, (size_t) align);
+}
+
+void* operator new[](size_t n, std::align_val_t align) {
+  return counted_alloc_or_throw(n, (size_t) align);
+}
+
+void* operator new(size_t n, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return counted_alloc(n, (size_t) align);
+}
+
+void* operator new[](size_t n, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return counted_alloc(n, (size_t) align);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+  free(p);
+}
+#endif
+
+namespace {
+
+// number of pregenerated keys, values and examples; inputs are reused cyclically
+static const uint32_t POOL_SIZE = 1 << 16;
+static const uint32_t POOL_MASK = POOL_SIZE - 1;
+
+// features per example in the update benchmarks
+static const uint32_t EXAMPLE_NNZ = 32;
+static const uint32_t NUM_EXAMPLES = 1024;
+
+/**
+ * Keep the compiler from discarding a value that is computed but not used.
+ */
+template <class T>
+inline void keep(const T& val) {
+  asm volatile("" : : "m"(val) : "memory");
+}
+
+/**
+ * Timing of one run of a benchmark loop, controlled by the benchmark: setup happens before start() and cleanup after
+ * stop().
+ */
+class State {
+ private:
+  const uint64_t iters_;
+  std::chrono::steady_clock::time_point start_;
+  double secs_;
+  uint64_t allocs_;
+  uint64_t bytes_;
+  uint64_t input_bytes_;
+
+ public:
+  explicit State(uint64_t iters)
+   : iters_{iters},
+     secs_{0.},
+     allocs_{0},
+     bytes_{0},
+     input_bytes_{0} { }
+
+  uint64_t iterations() const {
+    return iters_;
+  }
+
+  void start() {
+    allocs_ = alloc_count;
+    bytes_ = alloc_bytes;
+    start_ = std::chrono::steady_clock::now();
+  }
+
+  void stop() {
+    secs_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    allocs_ = alloc_count - allocs_;
+    bytes_ = alloc_bytes - bytes_;
+  }
+
+  /**
+   * @param n Bytes of input consumed by each operation.
+   */
+  void set_input_bytes(uint64_t n) {
+    input_bytes_ = n;
+  }
+
+  double seconds() const {
+    return secs_;
+  }
+
+  json result(const std::string& name) const {
+    double ops = (double) iters_;
+    json r = {
+        {"name", name},
+        {"iterations", iters_},
+        {"ns_per_op", secs_ * 1e9 / ops},
+        {"bytes_per_op", bytes_ / ops},
+        {"allocs_per_op", allocs_ / ops}
+    };
+    if (input_bytes_ > 0) {
+      r["input_bytes_per_op"] = input_bytes_;
+      r["mb_per_sec"] = input_bytes_ * ops / secs_ / 1e6;
+    }
+    return r;
+  }
+};
+
+struct Benchmark {
+  std::string name;
+  std::function<void(State&)> fn;
+};
+
+/**
+ * Run a benchmark with a growing number of iterations until it takes at least \p min_time seconds.
+ */
+json run(const Benchmark& b, double min_time) {
+  static const uint64_t MAX_ITERS = 1000000000;
+  uint64_t iters = 1;
+  while (true) {
+    State st(iters);
+    b.fn(st);
+    if (st.seconds() >= min_time || iters >= MAX_ITERS) return st.result(b.name);
+
+    // aim past the target so that the next run is likely the last, but grow by at most 10x at a time
+    double mult = min_time * 1.4 / MAX(st.seconds(), 1e-9);
+    uint64_t next = (uint64_t) (iters * MIN(mult, 10.));
+    iters = MIN(MAX(next, iters + 1), MAX_ITERS);
+  }
+}
+
+/**
+ * Inputs shared by the benchmarks, generated once from the seed.
+ */
+struct Inputs {
+  std::vector<uint32_t> keys;
+  std::vector<float> vals;
+  std::vector<std::vector<std::pair<uint32_t, float> > > examples;
+  std::vector<bool> labels;
+  std::vector<std::string> tokens;
+
+  explicit Inputs(int32_t seed) {
+    std::mt19937 prng(seed);
+    std::normal_distribution<float> normal;
+    keys.resize(POOL_SIZE);
+    vals.resize(POOL_SIZE);
+    for (uint32_t i = 0; i < POOL_SIZE; i++) {
+      keys[i] = prng();
+      vals[i] = normal(prng);
+    }
+
+    // examples draw features from a vocabulary of 2^20 keys, roughly as in text classification datasets
+    examples.resize(NUM_EXAMPLES);
+    labels.resize(NUM_EXAMPLES);
+    for (uint32_t i = 0; i < NUM_EXAMPLES; i++) {
+      for (uint32_t j = 0; j < EXAMPLE_NNZ; j++) {
+        examples[i].emplace_back(prng() & ((1 << 20) - 1), 1.f / EXAMPLE_NNZ);
+      }
+      labels[i] = prng() & 1;
+    }
+
+    tokens.resize(1 << 14);
+    for (size_t i = 0; i < tokens.size(); i++) {
+      tokens[i] = "token" + std::to_string(i);
+    }
+  }
+};
+
+/**
+ * Write a synthetic LIBSVM dataset with the given number of examples.
+ *
+ * @return Size of the file in bytes.
+ */
+uint64_t write_libsvm(const std::string& path, const Inputs& in, uint32_t num_examples) {
+  std::ofstream out(path);
+  if (!out.is_open()) throw std::runtime_error("Failed to write " + path);
+  for (uint32_t i = 0; i < num_examples; i++) {
+    const auto& x = in.examples[i % NUM_EXAMPLES];
+    out << (in.labels[i % NUM_EXAMPLES] ? "+1" : "-1");
+    for (const auto& p : x) {
+      out << ' ' << p.first << ':' << p.second;
+    }
+    out << '\n';
+  }
+  return out.tellp();
+}
+
+template <class Hash>
+void add_hash_benchmarks(std::vector<Benchmark>& out, const std::string& name, const Inputs& in, int32_t seed) {
+  for (uint32_t depth : {1, 3, 8}) {
+    out.push_back({name + "/d:" + std::to_string(depth), [&in, depth, seed](State& st) {
+      Hash h(depth, seed);
+      uint32_t hashes[8];
+      st.set_input_bytes(sizeof(uint32_t));
+      st.start();
+      for (uint64_t i = 0; i < st.iterations(); i++) {
+        h.hash(hashes, in.keys[i & POOL_MASK]);
+        keep(hashes);
+      }
+      st.stop();
+    }});
+  }
+}
+
+std::vector<Benchmark> benchmarks(const Inputs& in, int32_t seed, const std::string& libsvm_path) {
+  std::vector<Benchmark> out;
+
+  add_hash_benchmarks<hash::TabulationHash>(out, "tabulation_hash", in, seed);
+  add_hash_benchmarks<hash::PolynomialHash>(out, "polynomial_hash", in, seed);
+  for (uint32_t len : {4, 32}) {
+    out.push_back({"murmurhash3_32/len:" + std::to_string(len), [&in, len, seed](State& st) {
+      // keys are read at varying offsets of the key pool
+      const char* data = (const char*) in.keys.data();
+      uint64_t span = POOL_SIZE * sizeof(uint32_t) - len;
+      st.set_input_bytes(len);
+      st.start();
+      for (uint64_t i = 0; i < st.iterations(); i++) {
+        uint32_t h = hash::murmurhash3_32(data + (i * 4) % span, len, seed);
+        keep(h);
+      }
+      st.stop();
+    }});
+  }
+
+  for (uint32_t log2_width : {12, 20}) {
+    std::string dims = "/w:" + std::to_string(log2_width) + "/d:3";
+    out.push_back({"countsketch/get" + dims, [&in, log2_width, seed](State& st) {
+      CountSketch sk(log2_width, 3, seed);
+      for (uint32_t i = 0; i < POOL_SIZE; i++) {
+        sk.update(in.keys[i], in.vals[i]);
+      }
+      st.start();
+      for (uint64_t i = 0; i < st.iterations(); i++) {
+        float v = sk.get(in.keys[i & POOL_MASK]);
+        keep(v);
+      }
+      st.stop();
+    }});
+    out.push_back({"countsketch/update" + dims, [&in, log2_width, seed](State& st) {
+      CountSketch sk(log2_width, 3, seed);
+      st.start();
+      for (uint64_t i = 0; i < st.iterations(); i++) {
+        sk.update(in.keys[i & POOL_MASK], in.vals[i & POOL_MASK]);
+      }
+      st.stop();
+    }});
+  }
+
+  for (uint32_t log2_width : {12, 16, 20}) {
+    for (uint32_t depth : {1, 3, 5}) {
+      std::string name = "logistic_sketch/update/w:" + std::to_string(log2_width) + "/d:" + std::to_string(depth);
+      out.push_back({name, [&in, log2_width, depth, seed](State& st) {
+        LogisticSketch sk(log2_width, depth, seed, 0.1, 1e-6);
+        st.start();
+        for (uint64_t i = 0; i < st.iterations(); i++) {
+          bool yhat = sk.update(in.examples[i % NUM_EXAMPLES], in.labels[i % NUM_EXAMPLES]);
+          keep(yhat);
+        }
+        st.stop();
+      }});
+    }
+  }
+
+  // keys are drawn from a universe of 4096, so the heap sees a mix of changes, insertions, evictions and rejections
+  for (uint32_t k : {16, 128, 1024}) {
+    out.push_back({"topk_heap/insert_or_change/k:" + std::to_string(k), [&in, k](State& st) {
+      TopKHeap<uint32_t> heap(k);
+      for (uint32_t i = 0; !heap.is_full(); i++) {
+        heap.insert_or_change(in.keys[i & POOL_MASK] & 4095, in.vals[i & POOL_MASK]);
+      }
+      st.start();
+      for (uint64_t i = 0; i < st.iterations(); i++) {
+        auto evicted = heap.insert_or_change(in.keys[i & POOL_MASK] & 4095, in.vals[i & POOL_MASK]);
+        keep(evicted);
+      }
+      st.stop();
+    }});
+  }
+
+  for (uint32_t k : {128, 1024}) {
+    out.push_back({"weighted_reservoir/insert/k:" + std::to_string(k), [&in, k, seed](State& st) {
+      WeightedReservoir reservoir(k, seed);
+      uint32_t key = 0;
+      for (; !reservoir.is_full(); key++) {
+        reservoir.insert(key, in.vals[key & POOL_MASK]);
+      }
+      st.start();
+      for (uint64_t i = 0; i < st.iterations(); i++, key++) {
+        auto evicted = reservoir.insert(key, in.vals[key & POOL_MASK]);
+        keep(evicted);
+      }
+      st.stop();
+    }});
+  }
+
+  for (uint32_t capacity : {1000, 4000, 100000}) {
+    out.push_back({"token_reservoir/update/k:" + std::to_string(capacity), [&in, capacity, seed](State& st) {
+      TokenReservoir reservoir(capacity, seed);
+      uint64_t mask = in.tokens.size() - 1;
+      for (uint32_t i = 0; i < capacity; i++) {
+        reservoir.update(in.tokens[in.keys[i & POOL_MASK] & mask]);
+      }
+      st.start();
+      for (uint64_t i = 0; i < st.iterations(); i++) {
+        reservoir.update(in.tokens[in.keys[i & POOL_MASK] & mask]);
+      }
+      st.stop();
+    }});
+  }
+
+  if (!libsvm_path.empty()) {
+    out.push_back({"read_libsvm", [libsvm_path](State& st) {
+      std::string path(libsvm_path);
+      std::ifstream f(path, std::ios::binary | std::ios::ate);
+      st.set_input_bytes(f.tellg());
+      st.start();
+      for (uint64_t i = 0; i < st.iterations(); i++) {
+        data::SparseDataset dataset = data::read_libsvm(path);
+        keep(dataset.feature_dim);
+      }
+      st.stop();
+    }});
+  }
+
+  return out;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  cxxopts::Options options("wmsketch_bench");
+  options.add_options()
+      ("filter", "Only run benchmarks whose names contain this string", cxxopts::value<std::string>()->default_value(""))
+      ("min_time", "Minimum time in seconds to run each benchmark for", cxxopts::value<double>()->default_value("0.5"))
+      ("libsvm", "LIBSVM dataset to time read_libsvm on (default: a synthetic dataset of 10000 examples)", cxxopts::value<std::string>()->default_value(""))
+      ("s,seed", "Random seed", cxxopts::value<int32_t>()->default_value("1"))
+      ("h,help", "Print help");
+
+  try {
+    options.parse(argc, argv);
+  } catch (cxxopts::OptionException& e) {
+    std::cerr << "Error parsing options: " << e.what() << std::endl;
+    std::cerr << options.help() << std::endl;
+    exit(1);
+  }
+
+  if (options.count("help")) {
+    std::cout << options.help() << std::endl;
+    exit(0);
+  }
+
+  std::string filter(options["filter"].as<std::string>());
+  double min_time = options["min_time"].as<double>();
+  std::string libsvm_path(options["libsvm"].as<std::string>());
+  int32_t seed = options["seed"].as<int32_t>();
+
+  json params = {
+      {"filter", filter},
+      {"min_time", min_time},
+      {"libsvm", libsvm_path},
+      {"seed", seed}
+  };
+
+  std::cerr << params.dump(2) << std::endl;
+
+  Inputs in(seed);
+  std::string tmp_path;
+  if (libsvm_path.empty()) {
+    char tmpl[] = "/tmp/wmsketch_bench_XXXXXX";
+    int fd = mkstemp(tmpl);
+    if (fd < 0) {
+      std::cerr << "Error: failed to create a temporary dataset" << std::endl;
+      exit(1);
+    }
+    close(fd);
+    tmp_path = tmpl;
+    write_libsvm(tmp_path, in, 10000);
+  }
+
+  json results = json::array();
+  for (const auto& b : benchmarks(in, seed, libsvm_path.empty() ? tmp_path : libsvm_path)) {
+    if (b.name.find(filter) == std::string::npos) continue;
+    json r;
+    try {
+      r = run(b, min_time);
+    } catch (std::exception& e) {
+      std::cerr << "Error: " << b.name << ": " << e.what() << std::endl;
+      if (!tmp_path.empty()) remove(tmp_path.c_str());
+      exit(1);
+    }
+    std::cerr << b.name << ": " << r["ns_per_op"].get<double>() << " ns/op" << std::endl;
+    results.push_back(r);
+  }
+
+  if (!tmp_path.empty()) remove(tmp_path.c_str());
+
+  json output;
+  output["params"] = params;
+  output["results"] = results;
+  std::cout << output.dump(2) << std::endl;
+  return 0;
+}
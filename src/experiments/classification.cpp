@@ -5,15 +5,28 @@
  * learned classifier.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
 #include <chrono>
+#include <functional>
 #include <iostream>
+#include <numeric>
 #include <fstream>
 #include <random>
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "cxxopts.hpp"
 #include "json.hpp"
 #include "util.h"
 #include "dataset.h"
+#include "logistic_sketch.h"
 #include "topk.h"
+#include "stats.h"
 
 using namespace wmsketch;
 using json = nlohmann::json;
@@ -25,7 +38,11 @@ train(
     uint32_t iters = 0,
     uint32_t epochs = 1,
     int32_t seed = 1,
-    bool sample = false) {
+    bool sample = false,
+    uint32_t batch_size = 1,
+    uint32_t snapshot_interval = 0,
+    uint32_t eval_interval = 0,
+    const std::function<void(uint32_t)>& evaluate = nullptr) {
   uint64_t msecs, runtime_ms;
 
   tic(msecs);
@@ -35,50 +52,378 @@ train(
     iters = dataset.num_examples();
   }
 
+  uint32_t next_snapshot = snapshot_interval;
+  uint32_t next_eval = eval_interval;
+  auto publish = [&]() {
+    if (eval_interval > 0 && count >= next_eval) {
+      evaluate(count);
+      next_eval = count - count % eval_interval + eval_interval;
+    }
+    if (snapshot_interval == 0 || count < next_snapshot) return;
+    topk.publish_snapshot();
+    next_snapshot = count - count % snapshot_interval + snapshot_interval;
+  };
+
+  CSR batch;
+  std::vector<bool> labels, yhats;
+  auto flush = [&]() {
+    if (labels.empty()) return;
+    topk.update_batch(yhats, batch, labels);
+    for (size_t i = 0; i < labels.size(); i++) {
+      if (yhats[i] != labels[i]) err_count++;
+      count++;
+    }
+    batch.clear();
+    labels.clear();
+    publish();
+  };
+
+  auto step = [&](const data::SparseExample& ex) {
+    if (batch_size <= 1) {
+      bool yhat = topk.update(ex.features, ex.label == 1);
+      if (yhat != (ex.label == 1)) err_count++;
+      count++;
+      publish();
+      return;
+    }
+
+    batch.push_back(ex.features);
+    labels.push_back(ex.label == 1);
+    if (labels.size() == batch_size) flush();
+  };
+
   if (iters == 0) {
     for (int i = 0; i < epochs; i++) {
       for (auto &ex : dataset) {
-        bool yhat = topk.update(ex.features, ex.label == 1);
-        if (yhat != ex.label) err_count++;
-        count++;
+        step(ex);
       }
     }
   } else {
     dataset.seed(seed);
     for (int t = 0; t < iters; t++) {
-      const data::SparseExample &ex = dataset.sample();
-      bool yhat = topk.update(ex.features, ex.label == 1);
-      if (yhat != ex.label) err_count++;
-      count++;
+      step(dataset.sample());
     }
   }
+  flush();
 
   runtime_ms = toc(msecs);
   return std::make_tuple(runtime_ms, err_count, count);
 }
 
+template <class Model>
 std::tuple<uint64_t, float, float>
 test(
-    TopKFeatures& topk,
-    data::SparseDataset& dataset) {
+    Model& topk,
+    data::SparseDataset& dataset,
+    uint32_t batch_size = 1024) {
   uint64_t msecs, runtime_ms;
   tic(msecs);
   uint32_t tp = 0;
   uint32_t fp = 0;
   uint32_t fn = 0;
+  CSR batch;
+  std::vector<bool> labels;
+  std::vector<float> margins;
+  auto flush = [&]() {
+    margins.resize(labels.size());
+    topk.predict_batch(batch, margins.data());
+    for (size_t i = 0; i < labels.size(); i++) {
+      bool y = labels[i];
+      bool yhat = margins[i] >= 0;
+      if (y && yhat) tp++;
+      if (!y && yhat) fp++;
+      if (y && !yhat) fn++;
+    }
+    batch.clear();
+    labels.clear();
+  };
+
   for (auto& ex : dataset) {
-    auto y = (ex.label == 1);
-    bool yhat = topk.predict(ex.features);
-    if (y && yhat) tp++;
-    if (!y && yhat) fp++;
-    if (y && !yhat) fn++;
+    batch.push_back(ex.features);
+    labels.push_back(ex.label == 1);
+    if (labels.size() == batch_size) flush();
   }
+  flush();
   runtime_ms = toc(msecs);
   float precision = (tp + fp == 0) ? 1.f : ((float) tp) / (tp + fp);
   float recall = (tp + fn == 0) ? 1.f : ((float) tp) / (tp + fn);
   return std::make_tuple(runtime_ms, precision, recall);
 }
 
+void monitor(TopKFeatures& topk, uint32_t interval_ms, const std::atomic<bool>& done) {
+  while (!done.load()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    auto snapshot = topk.snapshot();
+    if (snapshot.version() == 0) continue;
+    std::cerr << "Snapshot " << snapshot.version() << ": " << snapshot->size() << " features";
+    if (!snapshot->empty()) {
+      std::cerr << ", top feature " << snapshot->front().first << " (" << snapshot->front().second << ")";
+    }
+    std::cerr << std::endl;
+  }
+}
+
+void write_message(int fd, const std::string& msg) {
+  uint64_t size = msg.size();
+  std::string buf((const char*) &size, sizeof(size));
+  buf += msg;
+  const char* p = buf.data();
+  size_t n = buf.size();
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) throw std::runtime_error(std::string("Failed to write to peer: ") + strerror(errno));
+    p += w;
+    n -= w;
+  }
+}
+
+void read_exact(int fd, char* p, size_t n) {
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) throw std::runtime_error(std::string("Failed to read from peer: ") + strerror(errno));
+    if (r == 0) throw std::runtime_error("Peer closed the connection");
+    p += r;
+    n -= r;
+  }
+}
+
+void read_message(int fd, std::string& msg) {
+  uint64_t size;
+  read_exact(fd, (char*) &size, sizeof(size));
+  msg.resize(size);
+  read_exact(fd, &msg[0], size);
+}
+
+/**
+ * Train a logistic_sketch model with worker processes that each update a replica on a shard of the training data
+ * and exchange sparse sketch deltas with a coordinator over Unix sockets. Every sync_interval examples, each worker
+ * sends the change to its replica since the last sync; the coordinator averages the changes into its model and
+ * sends back the combined change, which every replica, including the coordinator's, applies on top of the sync point.
+ * The replicas then stay identical at every sync point.
+ */
+template <class Cell>
+json
+train_distributed(
+    data::SparseDataset& train_dataset,
+    data::SparseDataset& test_dataset,
+    uint32_t workers,
+    uint32_t sync_interval,
+    bool quantize_deltas,
+    uint32_t epochs,
+    uint32_t k,
+    uint32_t log2_width,
+    uint32_t depth,
+    int32_t seed,
+    float lr_init,
+    float l2_reg,
+    bool median_update,
+    bool dedup,
+    float half_life,
+    DecayClock decay_clock) {
+  auto make_model = [&]() {
+    std::unique_ptr<BasicLogisticSketch<Cell> > model(
+        new BasicLogisticSketch<Cell>(log2_width, depth, seed, lr_init, l2_reg, median_update));
+    model->set_dedup(dedup);
+    if (half_life > 0) model->set_decay(half_life, decay_clock);
+    model->mark_synced();
+    return model;
+  };
+
+  const std::vector<data::SparseExample>& examples = train_dataset.examples;
+  uint64_t shard_size = (examples.size() + workers - 1) / workers;
+  uint64_t rounds = (shard_size * epochs + sync_interval - 1) / sync_interval;
+
+  uint64_t msecs;
+  tic(msecs);
+  std::vector<int> fds;
+  std::vector<pid_t> pids;
+  for (uint32_t w = 0; w < workers; w++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+      std::cerr << "Error: failed to create socket pair: " << strerror(errno) << std::endl;
+      exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      std::cerr << "Error: failed to start worker: " << strerror(errno) << std::endl;
+      exit(1);
+    }
+    if (pid == 0) {
+      close(sv[0]);
+      for (int fd : fds) close(fd);
+      int status = 0;
+      try {
+        auto model = make_model();
+        std::vector<uint64_t> stats(2, 0);  // examples, errors
+        SketchDelta delta;
+        std::string msg;
+        std::vector<uint64_t> shard;
+        for (uint64_t i = w; i < examples.size(); i += workers) {
+          shard.push_back(i);
+        }
+        uint64_t pos = 0;
+        for (uint64_t r = 0; r < rounds; r++) {
+          for (uint32_t j = 0; j < sync_interval && pos < shard.size() * epochs; j++, pos++) {
+            const data::SparseExample& ex = examples[shard[pos % shard.size()]];
+            bool yhat = model->update(ex.features, ex.label == 1);
+            if (yhat != (ex.label == 1)) stats[1]++;
+            stats[0]++;
+          }
+          model->extract_delta(delta);
+          delta.encode(msg, quantize_deltas);
+          write_message(sv[1], msg);
+          read_message(sv[1], msg);
+          delta.decode(msg.data(), msg.size());
+          model->revert_to_sync();
+          model->apply_delta(delta);
+          model->mark_synced();
+        }
+        write_message(sv[1], std::string((const char*) stats.data(), stats.size() * sizeof(uint64_t)));
+      } catch (std::exception& e) {
+        std::cerr << "Error: worker " << w << ": " << e.what() << std::endl;
+        status = 1;
+      }
+      close(sv[1]);
+      _exit(status);
+    }
+    close(sv[1]);
+    fds.push_back(sv[0]);
+    pids.push_back(pid);
+  }
+
+  auto model = make_model();
+  uint64_t bytes_up = 0, bytes_down = 0, nnz_up = 0, nnz_down = 0, sync_us = 0;
+  uint64_t train_count = 0, err_count = 0;
+  try {
+    SketchDelta delta;
+    std::string msg;
+    for (uint64_t r = 0; r < rounds; r++) {
+      for (uint32_t w = 0; w < workers; w++) {
+        read_message(fds[w], msg);
+        auto start = std::chrono::steady_clock::now();
+        delta.decode(msg.data(), msg.size());
+        model->apply_delta(delta, 1.f / workers);
+        sync_us += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        bytes_up += msg.size();
+        nnz_up += delta.nnz();
+      }
+
+      // the coordinator applies the combined change as sent, so that its replica matches those of the workers
+      auto start = std::chrono::steady_clock::now();
+      model->extract_delta(delta);
+      delta.encode(msg, quantize_deltas);
+      delta.decode(msg.data(), msg.size());
+      model->revert_to_sync();
+      model->apply_delta(delta);
+      model->mark_synced();
+      sync_us += std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start).count();
+      for (uint32_t w = 0; w < workers; w++) {
+        write_message(fds[w], msg);
+      }
+      bytes_down += msg.size() * workers;
+      nnz_down += delta.nnz() * workers;
+    }
+    for (uint32_t w = 0; w < workers; w++) {
+      read_message(fds[w], msg);
+      if (msg.size() != 2 * sizeof(uint64_t)) throw std::runtime_error("Malformed worker statistics");
+      uint64_t stats[2];
+      memcpy(stats, msg.data(), sizeof(stats));
+      train_count += stats[0];
+      err_count += stats[1];
+    }
+  } catch (std::exception& e) {
+    std::cerr << "Error: coordinator: " << e.what() << std::endl;
+    exit(1);
+  }
+  for (uint32_t w = 0; w < workers; w++) {
+    int status;
+    close(fds[w]);
+    if (waitpid(pids[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      std::cerr << "Error: worker " << w << " failed" << std::endl;
+      exit(1);
+    }
+  }
+  uint64_t train_ms = toc(msecs);
+
+  json results;
+  results["train_ms"] = train_ms;
+  results["train_err_count"] = err_count;
+  results["train_count"] = train_count;
+  results["train_err_rate"] = double(err_count) / train_count;
+  results["bias"] = model->bias();
+  results["sketch_bytes"] = model->size_bytes();
+  results["workers"] = workers;
+  results["sync_rounds"] = rounds;
+  results["sync_ms"] = sync_us / 1000;
+  results["delta_bytes_up"] = bytes_up;
+  results["delta_bytes_down"] = bytes_down;
+  results["delta_nnz_up"] = nnz_up;
+  results["delta_nnz_down"] = nnz_down;
+
+  uint64_t test_ms;
+  float precision, recall;
+  std::tie(test_ms, precision, recall) = test(*model, test_dataset);
+  results["test_ms"] = test_ms;
+  results["test_precision"] = precision;
+  results["test_recall"] = recall;
+  results["test_f1"] = 2. * precision * recall / (precision + recall);
+
+  // the coordinator sees no examples, so the top-k is taken over the estimates of every feature
+  std::vector<uint32_t> keys(train_dataset.feature_dim);
+  std::vector<float> weights(keys.size());
+  std::iota(keys.begin(), keys.end(), 0);
+  model->get_batch(keys.data(), keys.size(), weights.data());
+  std::vector<uint32_t> order(keys);
+  uint32_t n = MIN(k, (uint32_t) order.size());
+  std::partial_sort(order.begin(), order.begin() + n, order.end(), [&weights](uint32_t a, uint32_t b) {
+    return fabsf(weights[a]) > fabsf(weights[b]);
+  });
+  std::vector<uint32_t> indices(order.begin(), order.begin() + n);
+  std::vector<float> values;
+  for (uint32_t i : indices) {
+    values.push_back(weights[i]);
+  }
+  results["top_indices"] = indices;
+  results["top_weights"] = values;
+  return results;
+}
+
+template <class Cell>
+std::unique_ptr<TopKFeatures>
+sketch_topk(
+    const std::string& method,
+    uint32_t k,
+    uint32_t log2_width,
+    uint32_t depth,
+    int32_t seed,
+    float lr_init,
+    float l2_reg,
+    bool median_update) {
+  if (method == "logistic_sketch") {
+    return std::unique_ptr<TopKFeatures>(
+        new BasicLogisticSketchTopK<Cell>(
+            k,
+            log2_width,
+            depth,
+            seed,
+            lr_init,
+            l2_reg,
+            median_update));
+  }
+  return std::unique_ptr<TopKFeatures>(
+      new BasicActiveSetLogisticTopK<Cell>(
+          k,
+          log2_width,
+          depth,
+          seed,
+          lr_init,
+          l2_reg));
+}
+
 int main(int argc, char **argv) {
   cxxopts::Options options("wmsketch_classification");
   options.add_options()
@@ -99,6 +444,24 @@ int main(int argc, char **argv) {
       ("no_bias", "Train without bias term")
       ("pow", "Exponent for probabilistic truncation method (higher power => less likely to accept low-weight features)", cxxopts::value<float>()->default_value("1.0"))
       ("sample", "Enable sampling of training data instead of making a linear pass")
+      ("frozen", "Evaluate on the test set with a frozen inference model exported after training")
+      ("quantize", "Quantize the sketch table of the frozen model to 8-bit cells")
+      ("cell_type", "Sketch cell type for logistic_sketch and activeset_logistic: float, bfloat16, int16 or int8", cxxopts::value<std::string>()->default_value("float"))
+      ("counter_type", "Count-Min counter type for countmin_logistic: uint32, or uint8 with an overflow table", cxxopts::value<std::string>()->default_value("uint32"))
+      ("snapshot_interval", "Publish a top-k snapshot for concurrent readers every this many training examples (0 => never)", cxxopts::value<uint32_t>()->default_value("0"))
+      ("half_life", "Decay weights exponentially with this half-life for logistic_sketch (0 => no decay)", cxxopts::value<float>()->default_value("0"))
+      ("decay_clock", "Unit of the decay half-life: examples or seconds", cxxopts::value<std::string>()->default_value("examples"))
+      ("window", "Estimate logistic_sketch weights over a tumbling window with this many examples per period (0 => no window)", cxxopts::value<uint64_t>()->default_value("0"))
+      ("dedup", "Merge duplicate feature keys within each example before updating (logistic_sketch, activeset_logistic and countmin_logistic)")
+      ("eval_interval", "Evaluate a fork of the model on the test set in the background every this many training examples (0 => never)", cxxopts::value<uint32_t>()->default_value("0"))
+      ("load", "Restore the model from this checkpoint before training, followed by a comma-separated list of delta checkpoints to apply in order (logistic_sketch and activeset_logistic)", cxxopts::value<std::string>()->default_value(""))
+      ("save", "Write a checkpoint of the model to this path after training (logistic_sketch and activeset_logistic)", cxxopts::value<std::string>()->default_value(""))
+      ("save_delta", "Write a delta checkpoint of the changes since the last loaded checkpoint to this path after training (logistic_sketch and activeset_logistic)", cxxopts::value<std::string>()->default_value(""))
+      ("workers", "Train logistic_sketch with this many worker processes that exchange sketch deltas with a coordinator (0 => train in this process)", cxxopts::value<uint32_t>()->default_value("0"))
+      ("sync_interval", "Number of examples each worker trains on between syncs", cxxopts::value<uint32_t>()->default_value("1000"))
+      ("quantize_deltas", "Quantize the sketch deltas exchanged by workers to 8 bits")
+      ("monitor_ms", "Report the latest top-k snapshot from a monitor thread at this interval in milliseconds (0 => no monitor)", cxxopts::value<uint32_t>()->default_value("0"))
+      ("b,batch_size", "Number of examples in each mini-batch update (logistic_sketch only)", cxxopts::value<uint32_t>()->default_value("1"))
       ("h,help", "Print help");
 
   try {
@@ -139,6 +502,71 @@ int main(int argc, char **argv) {
   bool consv_update = (options.count("consv_update") != 0);
   bool no_bias = (options.count("no_bias") != 0);
   bool sample = (options.count("sample") != 0);
+  uint32_t batch_size = options["batch_size"].as<uint32_t>();
+  bool frozen = (options.count("frozen") != 0);
+  bool quantize = (options.count("quantize") != 0);
+  std::string cell_type(options["cell_type"].as<std::string>());
+  std::string counter_type(options["counter_type"].as<std::string>());
+  uint32_t snapshot_interval = options["snapshot_interval"].as<uint32_t>();
+  uint32_t monitor_ms = options["monitor_ms"].as<uint32_t>();
+  bool dedup = (options.count("dedup") != 0);
+  float half_life = options["half_life"].as<float>();
+  std::string decay_clock(options["decay_clock"].as<std::string>());
+  uint64_t window = options["window"].as<uint64_t>();
+  std::string load_path(options["load"].as<std::string>());
+  std::string save_path(options["save"].as<std::string>());
+  std::string save_delta_path(options["save_delta"].as<std::string>());
+  uint32_t eval_interval = options["eval_interval"].as<uint32_t>();
+  uint32_t workers = options["workers"].as<uint32_t>();
+  uint32_t sync_interval = options["sync_interval"].as<uint32_t>();
+  bool quantize_deltas = (options.count("quantize_deltas") != 0);
+
+  if (decay_clock != "examples" && decay_clock != "seconds") {
+    std::cerr << "Error: invalid decay clock " << decay_clock << std::endl;
+    exit(1);
+  }
+
+  if (monitor_ms > 0 && snapshot_interval == 0) {
+    std::cerr << "Error: monitor requires a nonzero snapshot interval" << std::endl;
+    exit(1);
+  }
+
+  if (eval_interval > 0 && test_path.empty()) {
+    std::cerr << "Error: background evaluation requires a test file" << std::endl;
+    exit(1);
+  }
+
+  if (cell_type != "float" && method != "logistic_sketch" && method != "activeset_logistic") {
+    std::cerr << "Error: cell type " << cell_type << " is not supported by method " << method << std::endl;
+    exit(1);
+  }
+
+  if (counter_type != "uint32" && method != "countmin_logistic") {
+    std::cerr << "Error: counter type " << counter_type << " is not supported by method " << method << std::endl;
+    exit(1);
+  }
+
+  if (dedup && method != "logistic_sketch" && method != "activeset_logistic" && method != "countmin_logistic") {
+    std::cerr << "Error: feature dedup is not supported by method " << method << std::endl;
+    exit(1);
+  }
+
+  if (workers > 0) {
+    if (method != "logistic_sketch") {
+      std::cerr << "Error: worker processes are not supported by method " << method << std::endl;
+      exit(1);
+    }
+    if (sync_interval == 0) {
+      std::cerr << "Error: worker processes require a nonzero sync interval" << std::endl;
+      exit(1);
+    }
+    if (window > 0 || batch_size > 1 || sample || iters > 0 || frozen || snapshot_interval > 0 || eval_interval > 0
+        || !load_path.empty() || !save_path.empty() || !save_delta_path.empty()) {
+      std::cerr << "Error: worker processes do not support windows, batches, sampling, frozen models, snapshots, "
+                << "background evaluation or checkpoints" << std::endl;
+      exit(1);
+    }
+  }
 
   uint64_t msecs, data_load_ms;
   data::SparseDataset train_dataset, test_dataset;
@@ -180,10 +608,58 @@ int main(int argc, char **argv) {
       {"num_examples", train_dataset.num_examples()},
       {"feature_dim", train_dataset.feature_dim},
       {"pow", pow},
-      {"sample", sample}
+      {"sample", sample},
+      {"batch_size", batch_size},
+      {"frozen", frozen},
+      {"quantize", quantize},
+      {"cell_type", cell_type},
+      {"counter_type", counter_type},
+      {"snapshot_interval", snapshot_interval},
+      {"monitor_ms", monitor_ms},
+      {"dedup", dedup},
+      {"half_life", half_life},
+      {"decay_clock", decay_clock},
+      {"window", window},
+      {"load", load_path},
+      {"save", save_path},
+      {"save_delta", save_delta_path},
+      {"eval_interval", eval_interval},
+      {"workers", workers},
+      {"sync_interval", sync_interval},
+      {"quantize_deltas", quantize_deltas}
   };
 
   std::cerr << params.dump(2) << std::endl;
+  if (workers > 0) {
+    json results;
+    DecayClock clock = (decay_clock == "seconds") ? DECAY_SECONDS : DECAY_EXAMPLES;
+    if (cell_type == "float") {
+      results = train_distributed<cell::Float32>(
+          train_dataset, test_dataset, workers, sync_interval, quantize_deltas, epochs, k, log2_width, depth,
+          seed + 1, lr_init, l2_reg, median_update, dedup, half_life, clock);
+    } else if (cell_type == "bfloat16") {
+      results = train_distributed<cell::BFloat16>(
+          train_dataset, test_dataset, workers, sync_interval, quantize_deltas, epochs, k, log2_width, depth,
+          seed + 1, lr_init, l2_reg, median_update, dedup, half_life, clock);
+    } else if (cell_type == "int16") {
+      results = train_distributed<cell::Int16>(
+          train_dataset, test_dataset, workers, sync_interval, quantize_deltas, epochs, k, log2_width, depth,
+          seed + 1, lr_init, l2_reg, median_update, dedup, half_life, clock);
+    } else if (cell_type == "int8") {
+      results = train_distributed<cell::Int8>(
+          train_dataset, test_dataset, workers, sync_interval, quantize_deltas, epochs, k, log2_width, depth,
+          seed + 1, lr_init, l2_reg, median_update, dedup, half_life, clock);
+    } else {
+      std::cerr << "Error: invalid cell type " << cell_type << std::endl;
+      exit(1);
+    }
+    json output;
+    output["params"] = params;
+    output["results"] = results;
+    std::cout << output.dump(0) << std::endl;
+    return 0;
+  }
+
   std::unique_ptr<TopKFeatures> model;
   if (method == "logistic") {
     model = std::unique_ptr<TopKFeatures>(
@@ -193,25 +669,19 @@ int main(int argc, char **argv) {
             lr_init,
             l2_reg,
             no_bias));
-  } else if (method == "logistic_sketch") {
-    model = std::unique_ptr<TopKFeatures>(
-        new LogisticSketchTopK(
-            k,
-            log2_width,
-            depth,
-            seed + 1,
-            lr_init,
-            l2_reg,
-            median_update));
-  } else if (method == "activeset_logistic") {
-    model = std::unique_ptr<TopKFeatures>(
-        new ActiveSetLogisticTopK(
-            k,
-            log2_width,
-            depth,
-            seed + 1,
-            lr_init,
-            l2_reg));
+  } else if (method == "logistic_sketch" || method == "activeset_logistic") {
+    if (cell_type == "float") {
+      model = sketch_topk<cell::Float32>(method, k, log2_width, depth, seed + 1, lr_init, l2_reg, median_update);
+    } else if (cell_type == "bfloat16") {
+      model = sketch_topk<cell::BFloat16>(method, k, log2_width, depth, seed + 1, lr_init, l2_reg, median_update);
+    } else if (cell_type == "int16") {
+      model = sketch_topk<cell::Int16>(method, k, log2_width, depth, seed + 1, lr_init, l2_reg, median_update);
+    } else if (cell_type == "int8") {
+      model = sketch_topk<cell::Int8>(method, k, log2_width, depth, seed + 1, lr_init, l2_reg, median_update);
+    } else {
+      std::cerr << "Error: invalid cell type " << cell_type << std::endl;
+      exit(1);
+    }
   } else if (method == "truncated_logistic") {
     model = std::unique_ptr<TopKFeatures>(
         new TruncatedLogisticTopK(k, lr_init, l2_reg));
@@ -219,15 +689,30 @@ int main(int argc, char **argv) {
     model = std::unique_ptr<TopKFeatures>(
         new ProbTruncatedLogisticTopK(k, seed, lr_init, l2_reg, pow));
   } else if (method == "countmin_logistic") {
-    model = std::unique_ptr<TopKFeatures>(
-        new CountMinLogisticTopK(
-            k,
-            log2_width,
-            depth,
-            seed + 1,
-            lr_init,
-            l2_reg,
-            consv_update));
+    if (counter_type == "uint32") {
+      model = std::unique_ptr<TopKFeatures>(
+          new CountMinLogisticTopK(
+              k,
+              log2_width,
+              depth,
+              seed + 1,
+              lr_init,
+              l2_reg,
+              consv_update));
+    } else if (counter_type == "uint8") {
+      model = std::unique_ptr<TopKFeatures>(
+          new BasicCountMinLogisticTopK<counter::Uint8>(
+              k,
+              log2_width,
+              depth,
+              seed + 1,
+              lr_init,
+              l2_reg,
+              consv_update));
+    } else {
+      std::cerr << "Error: invalid counter type " << counter_type << std::endl;
+      exit(1);
+    }
   } else if (method == "spacesaving_logistic") {
     model = std::unique_ptr<TopKFeatures>(
         new SpaceSavingLogisticTopK(
@@ -244,18 +729,153 @@ int main(int argc, char **argv) {
   }
 
   json results;
+  if (!load_path.empty()) {
+    std::vector<std::string> paths;
+    std::stringstream ss(load_path);
+    std::string path;
+    while (std::getline(ss, path, ',')) {
+      paths.push_back(path);
+    }
+
+    uint64_t load_ms;
+    tic(msecs);
+    try {
+      for (size_t i = 0; i < paths.size(); i++) {
+        if (!(i == 0 ? model->load(paths[i]) : model->load_delta(paths[i]))) {
+          std::cerr << "Error: method " << method << " does not support checkpoints" << std::endl;
+          exit(1);
+        }
+      }
+    } catch (std::exception& e) {
+      std::cerr << "Error: failed to load checkpoint: " << e.what() << std::endl;
+      exit(1);
+    }
+    load_ms = toc(msecs);
+    std::cerr << "Loaded " << paths.size() << " checkpoint(s) from " << load_path << " in " << load_ms << "ms" << std::endl;
+    results["load_ms"] = load_ms;
+  }
+
+  model->set_dedup(dedup);
+  if (half_life > 0 && !model->set_decay(half_life, decay_clock == "seconds" ? DECAY_SECONDS : DECAY_EXAMPLES)) {
+    std::cerr << "Error: method " << method << " does not support weight decay" << std::endl;
+    exit(1);
+  }
+  try {
+    if (window > 0 && !model->set_window(window)) {
+      std::cerr << "Error: method " << method << " does not support windows" << std::endl;
+      exit(1);
+    }
+  } catch (std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    exit(1);
+  }
+  if (batch_size > 1 && !model->batched_updates()) {
+    std::cerr << "Error: method " << method << " does not support mini-batch updates" << std::endl;
+    exit(1);
+  }
+
   uint64_t train_ms;
   uint32_t err_count, count;
-  std::tie(train_ms, err_count, count) = train(*model, train_dataset, iters, epochs, seed, sample);
+  std::atomic<bool> done(false);
+  std::thread monitor_thread;
+  if (monitor_ms > 0) {
+    monitor_thread = std::thread(monitor, std::ref(*model), monitor_ms, std::cref(done));
+  }
+
+  // evaluate forks of the model taken during training, one at a time, while training continues
+  std::vector<json> fork_evals;
+  std::thread eval_thread;
+  auto evaluate = [&](uint32_t n) {
+    if (eval_thread.joinable()) eval_thread.join();
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<TopKFeatures> snapshot(model->fork());
+    if (!snapshot) {
+      std::cerr << "Error: method " << method << " does not support forks" << std::endl;
+      exit(1);
+    }
+    uint64_t fork_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    size_t idx = fork_evals.size();
+    fork_evals.emplace_back();
+    eval_thread = std::thread([&fork_evals, &test_dataset, snapshot, n, fork_us, idx]() {
+      uint64_t eval_ms;
+      float precision, recall;
+      std::tie(eval_ms, precision, recall) = test(*snapshot, test_dataset);
+      fork_evals[idx] = {
+          {"train_count", n},
+          {"fork_us", fork_us},
+          {"test_ms", eval_ms},
+          {"test_f1", 2. * precision * recall / (precision + recall)}
+      };
+    });
+  };
+
+  std::tie(train_ms, err_count, count) = train(
+      *model, train_dataset, iters, epochs, seed, sample, batch_size, snapshot_interval, eval_interval, evaluate);
+  done.store(true);
+  if (monitor_thread.joinable()) monitor_thread.join();
+  if (eval_thread.joinable()) eval_thread.join();
+  if (eval_interval > 0) {
+    results["fork_evals"] = fork_evals;
+  }
   results["train_ms"] = train_ms;
   results["train_err_count"] = err_count;
   results["train_count"] = count;
   results["train_err_rate"] = double(err_count) / count;
   results["bias"] = model->bias();
+  results["sketch_bytes"] = model->sketch_bytes();
+  results["snapshots_published"] = model->snapshot_version();
+  if (!save_delta_path.empty()) {
+    uint64_t save_delta_ms;
+    tic(msecs);
+    try {
+      if (!model->save_delta(save_delta_path)) {
+        std::cerr << "Error: method " << method << " does not support delta checkpoints" << std::endl;
+        exit(1);
+      }
+    } catch (std::exception& e) {
+      std::cerr << "Error: failed to save delta checkpoint: " << e.what() << std::endl;
+      exit(1);
+    }
+    save_delta_ms = toc(msecs);
+    std::cerr << "Saved delta checkpoint to " << save_delta_path << " in " << save_delta_ms << "ms" << std::endl;
+    results["save_delta_ms"] = save_delta_ms;
+  }
+  if (!save_path.empty()) {
+    uint64_t save_ms;
+    tic(msecs);
+    try {
+      if (!model->save(save_path)) {
+        std::cerr << "Error: method " << method << " does not support checkpoints" << std::endl;
+        exit(1);
+      }
+    } catch (std::exception& e) {
+      std::cerr << "Error: failed to save checkpoint: " << e.what() << std::endl;
+      exit(1);
+    }
+    save_ms = toc(msecs);
+    std::cerr << "Saved checkpoint to " << save_path << " in " << save_ms << "ms" << std::endl;
+    results["save_ms"] = save_ms;
+  }
+  if (dedup) {
+    results["dedup_features"] = model->coalescer().features_in();
+    results["dedup_duplicates"] = model->coalescer().duplicates();
+  }
 
   uint64_t test_ms;
   float precision, recall;
-  auto test_stats = test(*model, test_dataset);
+  std::tuple<uint64_t, float, float> test_stats;
+  if (frozen) {
+    auto frozen_model = model->freeze(quantize);
+    if (!frozen_model) {
+      std::cerr << "Error: method " << method << " does not support frozen models" << std::endl;
+      exit(1);
+    }
+    results["frozen_bytes"] = frozen_model->size_bytes();
+    test_stats = test(*frozen_model, test_dataset);
+  } else {
+    test_stats = test(*model, test_dataset);
+  }
   std::tie(test_ms, precision, recall) = test_stats;
   results["test_ms"] = test_ms;
   results["test_precision"] = precision;
@@ -274,6 +894,9 @@ int main(int argc, char **argv) {
   results["top_indices"] = indices;
   results["top_weights"] = values;
 
+  // hot-path event counts over the whole run
+  if (stats::ENABLED) results["stats"] = stats::totals();
+
   json output;
   output["params"] = params;
   output["results"] = results;
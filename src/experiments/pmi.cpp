@@ -17,6 +17,7 @@
 #include "json.hpp"
 #include "util.h"
 #include "sgns.h"
+#include "stats.h"
 
 using namespace wmsketch;
 using json = nlohmann::json;
@@ -34,6 +35,8 @@ int main(int argc, char** argv) {
       ("k,topk", "Top-k feature weights", cxxopts::value<uint32_t>()->default_value("1024"))
       ("lr_init", "Initial learning rate", cxxopts::value<float>()->default_value("0.1"))
       ("l2_reg", "L2 regularization parameter", cxxopts::value<float>()->default_value("1e-7"))
+      ("load", "Restore the model from this checkpoint before training", cxxopts::value<std::string>()->default_value(""))
+      ("save", "Write a checkpoint of the model to this path after training", cxxopts::value<std::string>()->default_value(""))
       ("h,help", "Print help");
 
   try {
@@ -67,6 +70,8 @@ int main(int argc, char** argv) {
   auto reservoir_size = options["reservoir_size"].as<uint32_t>();
   float lr_init = options["lr_init"].as<float>();
   float l2_reg = options["l2_reg"].as<float>();
+  std::string load_path(options["load"].as<std::string>());
+  std::string save_path(options["save"].as<std::string>());
 
   json params = {
       {"data", data_paths},
@@ -78,7 +83,9 @@ int main(int argc, char** argv) {
       {"window_size", window_size},
       {"reservoir_size", reservoir_size},
       {"lr_init", lr_init},
-      {"l2_reg", l2_reg}
+      {"l2_reg", l2_reg},
+      {"load", load_path},
+      {"save", save_path}
   };
 
   std::cerr << params.dump(2) << std::endl;
@@ -97,6 +104,17 @@ int main(int argc, char** argv) {
   json results;
   uint64_t ms, train_ms;
   uint64_t num_tokens = 0;
+  if (!load_path.empty()) {
+    tic(ms);
+    try {
+      sgns.load(load_path);
+    } catch (std::exception& e) {
+      std::cerr << "Error: failed to load checkpoint: " << e.what() << std::endl;
+      exit(1);
+    }
+    results["load_ms"] = toc(ms);
+  }
+
   tic(ms);
 
   // Process tokens in each file
@@ -120,6 +138,17 @@ int main(int argc, char** argv) {
   results["train_ms"] = toc(ms);
   results["num_tokens"] = num_tokens;
 
+  if (!save_path.empty()) {
+    tic(ms);
+    try {
+      sgns.save(save_path);
+    } catch (std::exception& e) {
+      std::cerr << "Error: failed to save checkpoint: " << e.what() << std::endl;
+      exit(1);
+    }
+    results["save_ms"] = toc(ms);
+  }
+
   // Extract pairs with highest PMI estimates
   std::vector<std::pair<StreamingSGNS::StringPair, float>> pairs;
   std::vector<json> tokens;
@@ -135,6 +164,9 @@ int main(int argc, char** argv) {
   results["tokens"] = tokens;
   results["weights"] = values;
 
+  // hot-path event counts over the whole run
+  if (stats::ENABLED) results["stats"] = stats::totals();
+
   json output;
   output["params"] = params;
   output["results"] = results;
@@ -0,0 +1,1012 @@
+/*
+ * Scoring server for models trained by wmsketch_classification.
+ *
+ * Restores a logistic_sketch or activeset_logistic checkpoint, exports it as a frozen inference model, and scores
+ * batches of examples sent by clients over a Unix domain socket or a localhost TCP port. Connections are served by a
+ * pool of worker threads that share a single epoll set; each connection is handled by one worker at a time, and all
+ * workers read the same model through its const, reentrant read path.
+ *
+ * With --train, a trainer thread keeps updating the model on labeled LIBSVM examples read from a file, a FIFO, or
+ * stdin, and publishes a new frozen model every --publish_interval examples. Workers pick up the latest model with a
+ * single atomic load; replaced models are freed by the trainer once no worker holds them, so serving never waits on
+ * training. Without --load, training starts from an empty model.
+ *
+ * Every request and response is a message framed by its length as a little-endian u64. The payload starts with a
+ * four-character tag:
+ *
+ *   "SVMT" followed by LIBSVM text: one example per line, as "[label] index:value index:value ...". Labels are
+ *          optional and ignored.
+ *   "CSRB" followed by rows (u64) | nnz (u64) | indptr (u64[rows + 1]) | indices (u32[nnz]) | values (f32[nnz]),
+ *          the layout of a CSR batch.
+ *
+ * The response to a batch of n examples is "MRGN" followed by n (u64) and the margin of each example (f32[n]),
+ * including the bias term; an example is positive if its margin is >= 0. A malformed request is answered with "ERRR"
+ * followed by an error message, and the connection stays open.
+ *
+ * On SIGINT or SIGTERM, or after --duration_s seconds, the server stops and outputs the request counts, QPS, and
+ * p50/p99 latencies in JSON format.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cxxopts.hpp"
+#include "json.hpp"
+#include "util.h"
+#include "csr.h"
+#include "epoch_pointer.h"
+#include "frozen.h"
+#include "topk.h"
+
+using namespace wmsketch;
+using json = nlohmann::json;
+
+namespace {
+
+const uint32_t TAG_SVM = checkpoint_tag("SVMT");
+const uint32_t TAG_CSR = checkpoint_tag("CSRB");
+const uint32_t TAG_MARGINS = checkpoint_tag("MRGN");
+const uint32_t TAG_ERROR = checkpoint_tag("ERRR");
+
+// written from the signal handler to wake the workers, the trainer and the main thread
+int stop_fd = -1;
+
+// the served model, replaced by the trainer and read by the workers
+typedef EpochPointer<std::shared_ptr<const FrozenModel> > ModelPointer;
+
+void handle_signal(int) {
+  uint64_t one = 1;
+  ssize_t r = write(stop_fd, &one, sizeof(one));
+  (void) r;
+}
+
+std::runtime_error sys_error(const std::string& what) {
+  return std::runtime_error(what + ": " + strerror(errno));
+}
+
+/**
+ * Log-linear histogram of latencies in nanoseconds: each power of two is split into 16 buckets, so a percentile is
+ * reported within 1/16 of its value. A histogram has a single writer; other threads may read it concurrently.
+ */
+class LatencyHistogram {
+ public:
+  static const uint32_t SUB_BUCKETS = 16;
+  static const uint32_t NUM_BUCKETS = 61 * SUB_BUCKETS;
+
+ private:
+  std::atomic<uint64_t> counts_[NUM_BUCKETS];
+
+ public:
+  LatencyHistogram() {
+    for (auto& c : counts_) c.store(0, std::memory_order_relaxed);
+  }
+
+  void record(uint64_t ns) {
+    std::atomic<uint64_t>& c = counts_[bucket(ns)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  /**
+   * Add the counts of this histogram to \p out.
+   */
+  void read(std::vector<uint64_t>& out) const {
+    out.resize(NUM_BUCKETS);
+    for (uint32_t b = 0; b < NUM_BUCKETS; b++) {
+      out[b] += counts_[b].load(std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @param counts Bucket counts, as read by read().
+   * @param q Quantile in [0, 1].
+   * @return Upper bound of the bucket holding the \p q quantile, in nanoseconds, or 0 if \p counts is empty.
+   */
+  static uint64_t quantile(const std::vector<uint64_t>& counts, double q) {
+    uint64_t total = 0;
+    for (uint64_t c : counts) total += c;
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t) (q * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < counts.size(); b++) {
+      seen += counts[b];
+      if (seen >= rank) return upper_bound(b);
+    }
+    return upper_bound(NUM_BUCKETS - 1);
+  }
+
+ private:
+  static uint32_t bucket(uint64_t ns) {
+    if (ns < SUB_BUCKETS) return ns;
+    uint32_t e = 63 - __builtin_clzll(ns);
+    uint32_t b = (e - 3) * SUB_BUCKETS + ((ns >> (e - 4)) & (SUB_BUCKETS - 1));
+    return MIN(b, NUM_BUCKETS - 1);
+  }
+
+  static uint64_t upper_bound(uint32_t b) {
+    if (b < SUB_BUCKETS) return b;
+    uint32_t e = b / SUB_BUCKETS + 3;
+    uint64_t sub = b % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (e - 4)) - 1;
+  }
+};
+
+/**
+ * Counters of a worker thread. Written by the worker only.
+ */
+struct WorkerStats {
+  std::atomic<uint64_t> requests;
+  std::atomic<uint64_t> rows;
+  std::atomic<uint64_t> errors;
+  LatencyHistogram latency;
+
+  WorkerStats() : requests{0}, rows{0}, errors{0} { }
+
+  static void bump(std::atomic<uint64_t>& c, uint64_t n) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+};
+
+struct Totals {
+  uint64_t requests = 0;
+  uint64_t rows = 0;
+  uint64_t errors = 0;
+  std::vector<uint64_t> latency;
+
+  void add(const WorkerStats& s) {
+    requests += s.requests.load(std::memory_order_relaxed);
+    rows += s.rows.load(std::memory_order_relaxed);
+    errors += s.errors.load(std::memory_order_relaxed);
+    s.latency.read(latency);
+  }
+
+  Totals since(const Totals& prev) const {
+    Totals d;
+    d.requests = requests - prev.requests;
+    d.rows = rows - prev.rows;
+    d.errors = errors - prev.errors;
+    d.latency = latency;
+    for (size_t b = 0; b < prev.latency.size(); b++) {
+      d.latency[b] -= prev.latency[b];
+    }
+    return d;
+  }
+};
+
+struct Connection {
+  int fd;
+  std::string in;
+  std::string out;
+  size_t out_pos = 0;
+  bool closing = false;
+
+  explicit Connection(int fd) : fd{fd} { }
+};
+
+/**
+ * Parse the LIBSVM row in [p, end) and append it to \p out.
+ *
+ * @param label If not null, the row must start with a label, which is set to whether it is 1. Otherwise a label is
+ *   optional and skipped.
+ */
+void parse_row(const char* p, const char* end, CSR& out, bool* label = nullptr) {
+  bool first = true;
+  while (true) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    if (p == end) break;
+    const char* tok = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+
+    // tokens are copied out since strtol and strtof need terminated strings
+    char buf[64];
+    if (p - tok >= (ptrdiff_t) sizeof(buf)) {
+      throw std::invalid_argument("Malformed LIBSVM row " + std::to_string(out.rows()));
+    }
+    memcpy(buf, tok, p - tok);
+    buf[p - tok] = '\0';
+    char* colon = strchr(buf, ':');
+    if (colon == nullptr) {
+      if (!first) throw std::invalid_argument("Malformed LIBSVM row " + std::to_string(out.rows()));
+      if (label != nullptr) {
+        char* label_end;
+        long y = strtol(buf, &label_end, 10);
+        if (*label_end != '\0') throw std::invalid_argument("Malformed LIBSVM label");
+        *label = (y == 1);
+        label = nullptr;
+      }
+      first = false;
+      continue;
+    }
+    if (label != nullptr) throw std::invalid_argument("LIBSVM row is missing its label");
+    first = false;
+
+    char* key_end;
+    char* val_end;
+    unsigned long key = strtoul(buf, &key_end, 10);
+    float val = strtof(colon + 1, &val_end);
+    if (key_end != colon || *val_end != '\0' || key > UINT32_MAX) {
+      throw std::invalid_argument("Malformed LIBSVM row " + std::to_string(out.rows()));
+    }
+    out.indices.push_back((uint32_t) key);
+    out.values.push_back(val);
+  }
+  if (label != nullptr) throw std::invalid_argument("LIBSVM row is missing its label");
+  out.indptr.push_back(out.indices.size());
+}
+
+/**
+ * Parse a batch of LIBSVM rows into \p out. Each line is one example; labels are skipped.
+ */
+void parse_libsvm(const char* p, const char* end, CSR& out) {
+  out.clear();
+  while (p < end) {
+    const char* eol = (const char*) memchr(p, '\n', end - p);
+    if (eol == nullptr) eol = end;
+    parse_row(p, eol, out);
+    p = eol + 1;
+  }
+}
+
+/**
+ * Parse a binary CSR batch into \p out, validating its layout.
+ */
+void parse_csr(const char* p, const char* end, CSR& out) {
+  uint64_t dims[2];
+  if ((size_t) (end - p) < sizeof(dims)) throw std::invalid_argument("Truncated CSR batch");
+  memcpy(dims, p, sizeof(dims));
+  p += sizeof(dims);
+  uint64_t rows = dims[0];
+  uint64_t nnz = dims[1];
+  uint64_t size = end - p;
+  if (rows >= size / sizeof(uint64_t) || nnz > size / (sizeof(uint32_t) + sizeof(float))
+      || (rows + 1) * sizeof(uint64_t) + nnz * (sizeof(uint32_t) + sizeof(float)) != size) {
+    throw std::invalid_argument("CSR batch has unexpected size");
+  }
+
+  out.indptr.resize(rows + 1);
+  out.indices.resize(nnz);
+  out.values.resize(nnz);
+  memcpy(out.indptr.data(), p, (rows + 1) * sizeof(uint64_t));
+  p += (rows + 1) * sizeof(uint64_t);
+  memcpy(out.indices.data(), p, nnz * sizeof(uint32_t));
+  p += nnz * sizeof(uint32_t);
+  memcpy(out.values.data(), p, nnz * sizeof(float));
+
+  if (out.indptr[0] != 0 || out.indptr[rows] != nnz) throw std::invalid_argument("Malformed CSR row pointers");
+  for (uint64_t r = 0; r < rows; r++) {
+    if (out.indptr[r] > out.indptr[r+1]) throw std::invalid_argument("Malformed CSR row pointers");
+  }
+}
+
+class Server {
+ private:
+  ModelPointer& models_;
+  uint64_t max_message_;
+  int listen_fd_;
+  int epoll_fd_;
+  std::vector<std::unique_ptr<WorkerStats> > stats_;
+  std::vector<std::thread> workers_;
+  std::mutex conns_mutex_;
+  std::unordered_set<Connection*> conns_;
+  std::atomic<uint64_t> connections_;
+
+ public:
+  /**
+   * @param models Served model. Worker i reads it as reader i.
+   */
+  Server(ModelPointer& models, int listen_fd, uint64_t max_message)
+   : models_(models),
+     max_message_{max_message},
+     listen_fd_{listen_fd},
+     connections_{0} {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) throw sys_error("Failed to create epoll set");
+
+    // the listening socket is re-armed after each round of accepts, so only one worker wakes per connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &listen_fd_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) != 0) throw sys_error("Failed to watch socket");
+
+    // the stop event is level-triggered and never cleared, so that it wakes every worker
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stop_fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd, &ev) != 0) throw sys_error("Failed to watch stop event");
+  }
+
+  ~Server() {
+    for (Connection* c : conns_) {
+      close(c->fd);
+      delete c;
+    }
+    close(epoll_fd_);
+  }
+
+  void start(uint32_t threads) {
+    for (uint32_t i = 0; i < threads; i++) {
+      stats_.emplace_back(new WorkerStats());
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+      workers_.emplace_back(&Server::run, this, i, stats_[i].get());
+    }
+  }
+
+  void join() {
+    for (auto& t : workers_) t.join();
+  }
+
+  Totals totals() const {
+    Totals t;
+    for (const auto& s : stats_) t.add(*s);
+    return t;
+  }
+
+  uint64_t connections() const {
+    return connections_.load();
+  }
+
+ private:
+  void run(uint32_t id, WorkerStats* stats) {
+    const int MAX_EVENTS = 16;
+    struct epoll_event events[MAX_EVENTS];
+    CSR batch;
+    std::vector<float> margins;
+    while (true) {
+      int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        throw sys_error("Failed to wait for events");
+      }
+      for (int i = 0; i < n; i++) {
+        void* tag = events[i].data.ptr;
+        if (tag == &stop_fd) return;
+        if (tag == &listen_fd_) {
+          accept_all();
+        } else {
+          serve((Connection*) tag, id, *stats, batch, margins);
+        }
+      }
+    }
+  }
+
+  void accept_all() {
+    while (true) {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+        break;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));  // fails harmlessly on Unix sockets
+
+      Connection* c = new Connection(fd);
+      {
+        std::lock_guard<std::mutex> lock(conns_mutex_);
+        conns_.insert(c);
+      }
+      connections_++;
+      struct epoll_event ev;
+      ev.events = EPOLLIN | EPOLLONESHOT;
+      ev.data.ptr = c;
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        std::cerr << "Failed to watch connection: " << strerror(errno) << std::endl;
+        drop(c);
+      }
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &listen_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, listen_fd_, &ev);
+  }
+
+  // the connection is disarmed until this returns, so no other worker touches it
+  void serve(Connection* c, uint32_t id, WorkerStats& stats, CSR& batch, std::vector<float>& margins) {
+    if (!flush(c)) return drop(c);
+    if (c->out_pos < c->out.size()) return rearm(c, EPOLLOUT);
+    if (c->closing) return drop(c);
+
+    // reading stops at the first complete request, so a client that keeps sending cannot grow the input without bound
+    char buf[65536];
+    while (!request_ready(c)) {
+      ssize_t r = recv(c->fd, buf, sizeof(buf), 0);
+      if (r > 0) {
+        c->in.append(buf, r);
+        continue;
+      }
+      if (r == 0) {
+        c->closing = true;
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return drop(c);
+      }
+      break;
+    }
+
+    // requests received together are timed from the end of the read, and scored against the same model
+    auto received = std::chrono::steady_clock::now();
+    size_t pos = 0;
+    {
+      auto model = models_.read(id);
+      while (c->in.size() - pos >= sizeof(uint64_t)) {
+        uint64_t size;
+        memcpy(&size, c->in.data() + pos, sizeof(size));
+        if (size > max_message_) {
+          respond_error(c, "Request of " + std::to_string(size) + " bytes exceeds the size limit");
+          WorkerStats::bump(stats.errors, 1);
+          c->closing = true;
+          pos = c->in.size();
+          break;
+        }
+        if (c->in.size() - pos - sizeof(uint64_t) < size) break;
+
+        const char* p = c->in.data() + pos + sizeof(uint64_t);
+        handle(c, p, p + size, **model, stats, batch, margins);
+        pos += sizeof(uint64_t) + size;
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - received).count();
+        stats.latency.record(ns);
+        WorkerStats::bump(stats.requests, 1);
+      }
+    }
+    c->in.erase(0, pos);
+
+    if (!flush(c)) return drop(c);
+    if (c->out_pos < c->out.size()) return rearm(c, EPOLLOUT);
+    if (c->closing) return drop(c);
+    rearm(c, EPOLLIN);
+  }
+
+  // whether the input of c starts with a complete request, or with the header of one that exceeds the size limit
+  bool request_ready(const Connection* c) const {
+    if (c->in.size() < sizeof(uint64_t)) return false;
+    uint64_t size;
+    memcpy(&size, c->in.data(), sizeof(size));
+    return size > max_message_ || c->in.size() - sizeof(uint64_t) >= size;
+  }
+
+  void handle(
+      Connection* c,
+      const char* p,
+      const char* end,
+      const FrozenModel& model,
+      WorkerStats& stats,
+      CSR& batch,
+      std::vector<float>& margins) {
+    try {
+      uint32_t tag;
+      if ((size_t) (end - p) < sizeof(tag)) throw std::invalid_argument("Request is missing its tag");
+      memcpy(&tag, p, sizeof(tag));
+      p += sizeof(tag);
+      if (tag == TAG_SVM) {
+        parse_libsvm(p, end, batch);
+      } else if (tag == TAG_CSR) {
+        parse_csr(p, end, batch);
+      } else {
+        throw std::invalid_argument("Unknown request type");
+      }
+    } catch (std::exception& e) {
+      respond_error(c, e.what());
+      WorkerStats::bump(stats.errors, 1);
+      return;
+    }
+
+    uint64_t rows = batch.rows();
+    margins.resize(rows);
+    model.predict_batch(batch, margins.data());
+
+    uint64_t size = sizeof(uint32_t) + sizeof(rows) + rows * sizeof(float);
+    c->out.append((const char*) &size, sizeof(size));
+    c->out.append((const char*) &TAG_MARGINS, sizeof(TAG_MARGINS));
+    c->out.append((const char*) &rows, sizeof(rows));
+    c->out.append((const char*) margins.data(), rows * sizeof(float));
+    WorkerStats::bump(stats.rows, rows);
+  }
+
+  void respond_error(Connection* c, const std::string& msg) {
+    uint64_t size = sizeof(uint32_t) + msg.size();
+    c->out.append((const char*) &size, sizeof(size));
+    c->out.append((const char*) &TAG_ERROR, sizeof(TAG_ERROR));
+    c->out.append(msg);
+  }
+
+  /**
+   * Write as much pending output as the socket accepts.
+   *
+   * @return False if the connection failed.
+   */
+  bool flush(Connection* c) {
+    while (c->out_pos < c->out.size()) {
+      ssize_t w = send(c->fd, c->out.data() + c->out_pos, c->out.size() - c->out_pos, MSG_NOSIGNAL);
+      if (w < 0) {
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      c->out_pos += w;
+    }
+    c->out.clear();
+    c->out_pos = 0;
+    return true;
+  }
+
+  // a connection with pending output is not read from until the output drains
+  void rearm(Connection* c, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c->fd, &ev) != 0) drop(c);
+  }
+
+  void drop(Connection* c) {
+    {
+      std::lock_guard<std::mutex> lock(conns_mutex_);
+      conns_.erase(c);
+    }
+    close(c->fd);
+    delete c;
+  }
+};
+
+/**
+ * Counters of the trainer thread. Written by the trainer only.
+ */
+struct TrainStats {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> err_count;
+  std::atomic<uint64_t> malformed;
+  std::atomic<uint64_t> published;
+  std::atomic<uint64_t> publish_us;
+
+  TrainStats() : count{0}, err_count{0}, malformed{0}, published{0}, publish_us{0} { }
+};
+
+/**
+ * Keep training a model on labeled examples read from \p fd, one per line in LIBSVM format, and publish a frozen
+ * copy of it for the workers every \p publish_interval examples and at the end of the stream. Freezing and the
+ * reclamation of replaced models run on this thread, so a worker only ever pins the latest model and training never
+ * blocks serving. Returns at the end of the stream or when the stop event is signalled.
+ */
+void train_stream(
+    TopKFeatures& model,
+    int fd,
+    uint32_t publish_interval,
+    bool quantize,
+    ModelPointer& models,
+    TrainStats& stats) {
+  uint64_t since_publish = 0;
+  auto publish = [&]() {
+    auto start = std::chrono::steady_clock::now();
+    models.publish(std::unique_ptr<const std::shared_ptr<const FrozenModel> >(
+        new std::shared_ptr<const FrozenModel>(model.freeze(quantize))));
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    WorkerStats::bump(stats.publish_us, us);
+    WorkerStats::bump(stats.published, 1);
+    since_publish = 0;
+  };
+
+  CSR row;
+  std::vector<std::pair<uint32_t, float> > x;
+  auto train_line = [&](const char* p, const char* end) {
+    const char* q = p;
+    while (q < end && isspace((unsigned char) *q)) q++;
+    if (q == end) return;
+
+    bool label;
+    row.clear();
+    try {
+      parse_row(p, end, row, &label);
+    } catch (std::invalid_argument&) {
+      WorkerStats::bump(stats.malformed, 1);
+      return;
+    }
+    row.row(0, x);
+    if (model.update(x, label) != label) WorkerStats::bump(stats.err_count, 1);
+    WorkerStats::bump(stats.count, 1);
+    if (publish_interval > 0 && ++since_publish >= publish_interval) publish();
+  };
+
+  std::string buf;
+  char chunk[65536];
+  while (true) {
+    struct pollfd pfds[2] = {{fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      throw sys_error("Failed to wait for training examples");
+    }
+    if (pfds[1].revents != 0) return;
+
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+      throw sys_error("Failed to read training examples");
+    }
+    if (n == 0) break;
+    buf.append(chunk, n);
+
+    size_t pos = 0;
+    size_t eol;
+    while ((eol = buf.find('\n', pos)) != std::string::npos) {
+      train_line(buf.data() + pos, buf.data() + eol);
+      pos = eol + 1;
+    }
+    buf.erase(0, pos);
+  }
+
+  train_line(buf.data(), buf.data() + buf.size());
+  if (since_publish > 0) publish();
+}
+
+int listen_unix(const std::string& path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) throw std::invalid_argument("Socket path too long: " + path);
+  memcpy(addr.sun_path, path.data(), path.size());
+
+  // replace a stale socket left by a previous server, but never another kind of file
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) throw std::runtime_error("Not a socket: " + path);
+    unlink(path.c_str());
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) throw sys_error("Failed to create socket");
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) throw sys_error("Failed to bind " + path);
+  if (listen(fd, SOMAXCONN) != 0) throw sys_error("Failed to listen on " + path);
+  return fd;
+}
+
+int listen_tcp(uint16_t port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) throw sys_error("Failed to create socket");
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    throw sys_error("Failed to bind port " + std::to_string(port));
+  }
+  if (listen(fd, SOMAXCONN) != 0) throw sys_error("Failed to listen on port " + std::to_string(port));
+  return fd;
+}
+
+template <class Cell>
+std::unique_ptr<TopKFeatures>
+sketch_topk(
+    const std::string& method,
+    uint32_t k,
+    uint32_t log2_width,
+    uint32_t depth,
+    int32_t seed,
+    float lr_init,
+    float l2_reg,
+    bool median_update) {
+  if (method == "logistic_sketch") {
+    return std::unique_ptr<TopKFeatures>(
+        new BasicLogisticSketchTopK<Cell>(
+            k,
+            log2_width,
+            depth,
+            seed,
+            lr_init,
+            l2_reg,
+            median_update));
+  }
+  return std::unique_ptr<TopKFeatures>(
+      new BasicActiveSetLogisticTopK<Cell>(
+          k,
+          log2_width,
+          depth,
+          seed,
+          lr_init,
+          l2_reg));
+}
+
+json latency_json(const Totals& t, double secs) {
+  return {
+      {"requests", t.requests},
+      {"rows", t.rows},
+      {"errors", t.errors},
+      {"qps", secs > 0 ? t.requests / secs : 0.},
+      {"rows_per_sec", secs > 0 ? t.rows / secs : 0.},
+      {"latency_p50_us", LatencyHistogram::quantile(t.latency, 0.5) / 1e3},
+      {"latency_p99_us", LatencyHistogram::quantile(t.latency, 0.99) / 1e3},
+      {"latency_max_us", LatencyHistogram::quantile(t.latency, 1.0) / 1e3}
+  };
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  cxxopts::Options options("wmsketch_serve");
+  options.add_options()
+      ("load", "Checkpoint to serve, followed by a comma-separated list of delta checkpoints to apply in order", cxxopts::value<std::string>()->default_value(""))
+      ("train", "Keep training the served model on labeled LIBSVM examples read from this file or FIFO (- => stdin)", cxxopts::value<std::string>()->default_value(""))
+      ("publish_interval", "Publish the model for serving every this many training examples (0 => at the end of the training stream)", cxxopts::value<uint32_t>()->default_value("10000"))
+      ("m,method", "Estimation method of the checkpoint: logistic_sketch or activeset_logistic", cxxopts::value<std::string>()->default_value("activeset_logistic"))
+      ("w,log2_width", "Base-2 logarithm of sketch width", cxxopts::value<uint32_t>()->default_value("10"))
+      ("d,depth", "Sketch depth", cxxopts::value<uint32_t>()->default_value("1"))
+      ("s,seed", "Random seed the model was trained with", cxxopts::value<int32_t>())
+      ("k,topk", "Number of high-magnitude weights the model tracks", cxxopts::value<uint32_t>()->default_value("512"))
+      ("lr_init", "Initial learning rate the model was trained with", cxxopts::value<float>()->default_value("0.1"))
+      ("l2_reg", "L2 regularization parameter the model was trained with", cxxopts::value<float>()->default_value("1e-6"))
+      ("median_update", "The model was trained with median weight estimates")
+      ("cell_type", "Sketch cell type: float, bfloat16, int16 or int8", cxxopts::value<std::string>()->default_value("float"))
+      ("quantize", "Quantize the sketch table of the served model to 8-bit cells")
+      ("socket", "Listen on a Unix domain socket at this path", cxxopts::value<std::string>()->default_value(""))
+      ("port", "Listen on this TCP port on localhost (0 => use --socket)", cxxopts::value<uint16_t>()->default_value("0"))
+      ("threads", "Number of worker threads (0 => one per core)", cxxopts::value<uint32_t>()->default_value("0"))
+      ("max_message", "Maximum size of a request in bytes", cxxopts::value<uint64_t>()->default_value("67108864"))
+      ("report_s", "Report QPS and latency on stderr at this interval in seconds (0 => never)", cxxopts::value<uint32_t>()->default_value("10"))
+      ("duration_s", "Stop serving after this many seconds (0 => serve until interrupted)", cxxopts::value<uint32_t>()->default_value("0"))
+      ("h,help", "Print help");
+
+  try {
+    options.parse(argc, argv);
+  } catch (cxxopts::OptionException& e) {
+    std::cerr << "Error parsing options: " << e.what() << std::endl;
+    std::cerr << options.help() << std::endl;
+    exit(1);
+  }
+
+  if (options.count("help")) {
+    std::cout << options.help() << std::endl;
+    exit(0);
+  }
+
+  std::string load_path(options["load"].as<std::string>());
+  std::string train_path(options["train"].as<std::string>());
+  if (load_path.empty() && train_path.empty()) {
+    std::cerr << "Error: a checkpoint or a training stream must be specified" << std::endl;
+    std::cerr << options.help() << std::endl;
+    exit(1);
+  }
+
+  if (!load_path.empty() && !options.count("seed")) {
+    std::cerr << "Error: the seed the checkpoint was trained with must be specified" << std::endl;
+    exit(1);
+  }
+
+  uint32_t publish_interval = options["publish_interval"].as<uint32_t>();
+  std::string method(options["method"].as<std::string>());
+  uint32_t log2_width = options["log2_width"].as<uint32_t>();
+  uint32_t depth = options["depth"].as<uint32_t>();
+  int32_t seed = options.count("seed") ?
+                 options["seed"].as<int32_t>() :
+                 (int32_t) std::chrono::system_clock::now().time_since_epoch().count();
+  uint32_t k = options["topk"].as<uint32_t>();
+  float lr_init = options["lr_init"].as<float>();
+  float l2_reg = options["l2_reg"].as<float>();
+  bool median_update = (options.count("median_update") != 0);
+  std::string cell_type(options["cell_type"].as<std::string>());
+  bool quantize = (options.count("quantize") != 0);
+  std::string socket_path(options["socket"].as<std::string>());
+  uint16_t port = options["port"].as<uint16_t>();
+  uint32_t threads = options["threads"].as<uint32_t>();
+  uint64_t max_message = options["max_message"].as<uint64_t>();
+  uint32_t report_s = options["report_s"].as<uint32_t>();
+  uint32_t duration_s = options["duration_s"].as<uint32_t>();
+  if (threads == 0) threads = MAX(std::thread::hardware_concurrency(), 1u);
+
+  if (socket_path.empty() == (port == 0)) {
+    std::cerr << "Error: exactly one of --socket and --port must be specified" << std::endl;
+    exit(1);
+  }
+
+  if (method != "logistic_sketch" && method != "activeset_logistic") {
+    std::cerr << "Error: invalid method " << method << std::endl;
+    std::cerr << "Options: logistic_sketch, activeset_logistic" << std::endl;
+    exit(1);
+  }
+
+  json params = {
+      {"load", load_path},
+      {"train", train_path},
+      {"publish_interval", publish_interval},
+      {"method", method},
+      {"log2_width", log2_width},
+      {"depth", depth},
+      {"seed", seed},
+      {"topk", k},
+      {"lr_init", lr_init},
+      {"l2_reg", l2_reg},
+      {"median_update", median_update},
+      {"cell_type", cell_type},
+      {"quantize", quantize},
+      {"socket", socket_path},
+      {"port", port},
+      {"threads", threads},
+      {"max_message", max_message},
+      {"duration_s", duration_s}
+  };
+  std::cerr << params.dump(2) << std::endl;
+
+  // the model is built as in wmsketch_classification, whose sketches are seeded with seed + 1
+  std::unique_ptr<TopKFeatures> model;
+  if (cell_type == "float") {
+    model = sketch_topk<cell::Float32>(method, k, log2_width, depth, seed + 1, lr_init, l2_reg, median_update);
+  } else if (cell_type == "bfloat16") {
+    model = sketch_topk<cell::BFloat16>(method, k, log2_width, depth, seed + 1, lr_init, l2_reg, median_update);
+  } else if (cell_type == "int16") {
+    model = sketch_topk<cell::Int16>(method, k, log2_width, depth, seed + 1, lr_init, l2_reg, median_update);
+  } else if (cell_type == "int8") {
+    model = sketch_topk<cell::Int8>(method, k, log2_width, depth, seed + 1, lr_init, l2_reg, median_update);
+  } else {
+    std::cerr << "Error: invalid cell type " << cell_type << std::endl;
+    exit(1);
+  }
+
+  json results;
+  uint64_t msecs;
+  tic(msecs);
+  std::shared_ptr<const FrozenModel> frozen;
+  try {
+    std::stringstream ss(load_path);
+    std::string path;
+    for (size_t i = 0; std::getline(ss, path, ','); i++) {
+      if (i == 0) model->load(path);
+      else model->load_delta(path);
+    }
+    frozen = model->freeze(quantize);
+  } catch (std::exception& e) {
+    std::cerr << "Error: failed to load checkpoint: " << e.what() << std::endl;
+    exit(1);
+  }
+  results["load_ms"] = toc(msecs);
+  results["model_bytes"] = frozen->size_bytes();
+
+  // a FIFO is opened without waiting for a writer, and read once poll() reports data
+  int train_fd = -1;
+  if (!train_path.empty()) {
+    train_fd = (train_path == "-") ? STDIN_FILENO : open(train_path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (train_fd < 0) {
+      std::cerr << "Error: failed to open " << train_path << ": " << strerror(errno) << std::endl;
+      exit(1);
+    }
+  } else {
+    model.reset();
+  }
+
+  ModelPointer models(threads);
+  models.publish(std::unique_ptr<const std::shared_ptr<const FrozenModel> >(
+      new std::shared_ptr<const FrozenModel>(std::move(frozen))));
+
+  stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd < 0) {
+    std::cerr << "Error: failed to create event: " << strerror(errno) << std::endl;
+    exit(1);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  int listen_fd;
+  std::unique_ptr<Server> server;
+  try {
+    listen_fd = socket_path.empty() ? listen_tcp(port) : listen_unix(socket_path);
+    server.reset(new Server(models, listen_fd, max_message));
+  } catch (std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    exit(1);
+  }
+
+  std::cerr << "Serving " << method << " model"
+            << (load_path.empty() ? "" : " from " + load_path)
+            << (train_path.empty() ? "" : " trained on " + train_path) << " on "
+            << (socket_path.empty() ? "port " + std::to_string(port) : socket_path)
+            << " with " << threads << " threads" << std::endl;
+  auto start = std::chrono::steady_clock::now();
+  auto last = start;
+  server->start(threads);
+
+  TrainStats train_stats;
+  std::thread trainer;
+  if (model) {
+    trainer = std::thread([&]() {
+      try {
+        train_stream(*model, train_fd, publish_interval, quantize, models, train_stats);
+        std::cerr << "Trained on " << train_stats.count.load() << " examples" << std::endl;
+      } catch (std::exception& e) {
+        std::cerr << "Error: training stopped: " << e.what() << std::endl;
+      }
+    });
+  }
+
+  // wait for a stop signal or the end of the run, reporting progress at each interval
+  Totals prev;
+  while (true) {
+    auto now = std::chrono::steady_clock::now();
+    int64_t timeout_ms = -1;  // wait indefinitely
+    if (report_s > 0) {
+      auto next = last + std::chrono::seconds(report_s);
+      timeout_ms = MAX(std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count(), (int64_t) 0);
+    }
+    if (duration_s > 0) {
+      auto stop = start + std::chrono::seconds(duration_s);
+      int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(stop - now).count();
+      if (ms <= 0) break;
+      timeout_ms = (timeout_ms < 0) ? ms : MIN(timeout_ms, ms);
+    }
+
+    struct pollfd pfd = {stop_fd, POLLIN, 0};
+    int r = poll(&pfd, 1, (int) timeout_ms);
+    if (r > 0) break;
+    if (r < 0 && errno != EINTR) break;
+
+    now = std::chrono::steady_clock::now();
+    if (report_s > 0 && now - last >= std::chrono::seconds(report_s)) {
+      Totals cur = server->totals();
+      double secs = std::chrono::duration<double>(now - last).count();
+      json report = latency_json(cur.since(prev), secs);
+      if (model) {
+        report["train_count"] = train_stats.count.load();
+        report["models_published"] = train_stats.published.load();
+      }
+      std::cerr << report.dump() << std::endl;
+      prev = cur;
+      last = now;
+    }
+  }
+
+  uint64_t one = 1;
+  if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+    std::cerr << "Error: failed to stop workers: " << strerror(errno) << std::endl;
+    exit(1);
+  }
+  server->join();
+  if (trainer.joinable()) trainer.join();
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  close(listen_fd);
+  if (!socket_path.empty()) unlink(socket_path.c_str());
+
+  json serve_stats = latency_json(server->totals(), secs);
+  for (auto it = serve_stats.begin(); it != serve_stats.end(); ++it) {
+    results[it.key()] = it.value();
+  }
+  results["connections"] = server->connections();
+  if (model) {
+    uint64_t count = train_stats.count.load();
+    results["train_count"] = count;
+    results["train_err_count"] = train_stats.err_count.load();
+    results["train_err_rate"] = count > 0 ? train_stats.err_count.load() / (double) count : 0.;
+    results["train_malformed"] = train_stats.malformed.load();
+    results["models_published"] = train_stats.published.load();
+    results["publish_ms"] = train_stats.publish_us.load() / 1e3;
+  }
+  results["serve_ms"] = (uint64_t) (secs * 1e3);
+  server.reset();
+
+  json output;
+  output["params"] = params;
+  output["results"] = results;
+  std::cout << output.dump(0) << std::endl;
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include "frozen.h"
+#include <cmath>
+#include "util.h"
+#include "stats.h"
+
+namespace wmsketch {
+
+const uint64_t FrozenModel::EMPTY_KEY;
+
+FrozenModel::FrozenModel(
+    const hash::TabulationHash& hash_fn,
+    uint32_t depth,
+    uint32_t log2_width,
+    std::vector<float> weights,
+    float scale,
+    float bias,
+    bool median,
+    const std::vector<std::pair<uint32_t, float> >& exact,
+    const std::vector<uint32_t>& precompute,
+    bool quantize)
+ : hash_fn_(hash_fn),
+   depth_{depth},
+   width_mask_{(1u << log2_width) - 1},
+   median_{median},
+   quantized_{false},
+   bias_{bias},
+   weights_(std::move(weights)) {
+
+  uint64_t width = (uint64_t) width_mask_ + 1;
+  for (auto& w : weights_) {
+    w *= scale;
+  }
+
+  // size the flat hash table for a load factor of at most 1/2
+  uint64_t n = exact.size() + precompute.size();
+  uint32_t log2_cap = 1;
+  while ((1ull << log2_cap) < 2 * n) log2_cap++;
+  key_shift_ = 64 - log2_cap;
+  keys_.assign(1ull << log2_cap, EMPTY_KEY);
+  vals_.assign(1ull << log2_cap, 0.f);
+
+  // precomputed estimates are taken from the unquantized table
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  for (uint32_t key : precompute) {
+    hash_fn_.hash(hashes.data(), key);
+    insert(key, estimate(hashes.data()));
+  }
+
+  for (const auto& p : exact) {
+    insert(p.first, scale * p.second);
+  }
+
+  if (quantize) {
+    qweights_.resize(depth * width);
+    row_scales_.resize(depth);
+    for (int i = 0; i < depth_; i++) {
+      const float* row = weights_.data() + i * width;
+      float max = 0.f;
+      for (uint64_t j = 0; j < width; j++) {
+        max = MAX(max, fabsf(row[j]));
+      }
+      float s = (max > 0.f) ? max / 127.f : 1.f;
+      row_scales_[i] = s;
+      for (uint64_t j = 0; j < width; j++) {
+        qweights_[i * width + j] = (int8_t) lrintf(row[j] / s);
+      }
+    }
+    weights_.clear();
+    weights_.shrink_to_fit();
+    quantized_ = true;
+  }
+}
+
+float FrozenModel::get(uint32_t key) const {
+  const float* w = find(key);
+  if (w != nullptr) return *w;
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
+  return estimate(hashes.data());
+}
+
+float FrozenModel::dot(const std::vector<std::pair<uint32_t, float> >& x) const {
+  float z = 0.f;
+  for (const auto& p : x) {
+    z += get(p.first) * p.second;
+  }
+  return z;
+}
+
+bool FrozenModel::predict(const std::vector<std::pair<uint32_t, float> >& x) const {
+  return dot(x) + bias_ >= 0.;
+}
+
+void FrozenModel::predict_batch(const CSR& x, float* margins_out) const {
+  uint64_t n = x.rows();
+  uint64_t nnz = x.nnz();
+
+  // hashes for feature j are kept in slot j % (PREFETCH_DISTANCE + 1) of the hash buffer
+  uint32_t slots = PREFETCH_DISTANCE + 1;
+  ScratchBuffer<uint32_t, STACK_DEPTH * (PREFETCH_DISTANCE + 1)> hashes(depth_ * slots);
+  for (uint64_t j = 0; j < nnz && j < PREFETCH_DISTANCE; j++) {
+    prefetch(hashes.data() + (j % slots) * depth_, x.indices[j]);
+  }
+
+  uint64_t j = 0;
+  for (uint64_t r = 0; r < n; r++) {
+    float z = 0.f;
+    for (; j < x.indptr[r+1]; j++) {
+      if (j + PREFETCH_DISTANCE < nnz) {
+        uint64_t a = j + PREFETCH_DISTANCE;
+        prefetch(hashes.data() + (a % slots) * depth_, x.indices[a]);
+      }
+
+      const float* w = find(x.indices[j]);
+      z += x.values[j] * ((w != nullptr) ? *w : estimate(hashes.data() + (j % slots) * depth_));
+    }
+    margins_out[r] = z + bias_;
+  }
+}
+
+float FrozenModel::bias() const {
+  return bias_;
+}
+
+uint64_t FrozenModel::size_bytes() const {
+  return weights_.size() * sizeof(float)
+      + qweights_.size() * sizeof(int8_t)
+      + row_scales_.size() * sizeof(float)
+      + keys_.size() * (sizeof(uint64_t) + sizeof(float));
+}
+
+const float* FrozenModel::find(uint32_t key) const {
+  uint64_t mask = keys_.size() - 1;
+  uint64_t i = ((uint64_t) key * 0x9E3779B97F4A7C15ull) >> key_shift_;
+  while (keys_[i] != EMPTY_KEY) {
+    if (keys_[i] == key) return &vals_[i];
+    i = (i + 1) & mask;
+  }
+  return nullptr;
+}
+
+void FrozenModel::insert(uint32_t key, float val) {
+  uint64_t mask = keys_.size() - 1;
+  uint64_t i = ((uint64_t) key * 0x9E3779B97F4A7C15ull) >> key_shift_;
+  while (keys_[i] != EMPTY_KEY && keys_[i] != key) {
+    i = (i + 1) & mask;
+  }
+  keys_[i] = key;
+  vals_[i] = val;
+}
+
+float FrozenModel::estimate(const uint32_t* hashes) const {
+  WMSKETCH_COUNT(CELLS, depth_);
+  ScratchBuffer<float, STACK_DEPTH> buf(depth_);
+  uint64_t width = (uint64_t) width_mask_ + 1;
+  for (int i = 0; i < depth_; i++) {
+    uint32_t h = hashes[i];
+    int sgn = (h >> 31) ? +1 : -1;
+    uint64_t j = i * width + (h & width_mask_);
+    buf[i] = sgn * (quantized_ ? row_scales_[i] * qweights_[j] : weights_[j]);
+  }
+  return median_ ? median(buf.data(), depth_) : mean(buf.data(), depth_);
+}
+
+void FrozenModel::prefetch(uint32_t* hashes, uint32_t key) const {
+  hash_fn_.hash(hashes, key);
+  uint64_t width = (uint64_t) width_mask_ + 1;
+  for (int i = 0; i < depth_; i++) {
+    uint64_t j = i * width + (hashes[i] & width_mask_);
+    if (quantized_) __builtin_prefetch(qweights_.data() + j);
+    else __builtin_prefetch(weights_.data() + j);
+  }
+}
+
+} // namespace wmsketch
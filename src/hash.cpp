@@ -2,9 +2,6 @@
 #include <random>
 #include "hash.h"
 
-#define MOD 2147483647  // 2^31 - 1
-#define HL 31
-
 namespace wmsketch {
 namespace hash {
 
@@ -21,19 +18,21 @@ PolynomialHash::PolynomialHash(uint32_t copies, int32_t seed)
   }
 }
 
+PolynomialHash::PolynomialHash(const PolynomialHash& other)
+ : copies_{other.copies_} {
+  table_ = (uint32_t**) calloc(copies_, sizeof(uint32_t*));
+  table_[0] = (uint32_t*) calloc(2 * copies_, sizeof(uint32_t));
+  memcpy(table_[0], other.table_[0], 2 * copies_ * sizeof(uint32_t));
+  for (int i = 0; i < copies_; i++) {
+    table_[i] = table_[0] + 2 * i;
+  }
+}
+
 PolynomialHash::~PolynomialHash() {
   free(table_[0]);
   free(table_);
 }
 
-void PolynomialHash::hash(uint32_t* out, uint32_t x) {
-  for (int i = 0; i < copies_; i++) {
-    uint64_t res = ((uint64_t) table_[i][0] * x) + table_[i][1];
-    res = ((res >> HL) + res) & MOD;
-    out[i] = res;
-  }
-}
-
 // tabulation hashing
 TabulationHash::TabulationHash(uint32_t copies, int32_t seed)
  : copies_{copies} {
@@ -48,22 +47,21 @@ TabulationHash::TabulationHash(uint32_t copies, int32_t seed)
   }
 }
 
+TabulationHash::TabulationHash(const TabulationHash& other)
+ : copies_{other.copies_} {
+  table_ = (uint32_t**) calloc(THASH_NUM_CHUNKS, sizeof(uint32_t*));
+  table_[0] = (uint32_t*) calloc(THASH_NUM_CHUNKS * THASH_CHUNK_CARD * copies_, sizeof(uint32_t));
+  memcpy(table_[0], other.table_[0], THASH_NUM_CHUNKS * THASH_CHUNK_CARD * copies_ * sizeof(uint32_t));
+  for (int i = 0; i < THASH_NUM_CHUNKS; i++) {
+    table_[i] = table_[0] + i * THASH_CHUNK_CARD * copies_;
+  }
+}
+
 TabulationHash::~TabulationHash() {
   free(table_[0]);
   free(table_);
 }
 
-void TabulationHash::hash(uint32_t* out, uint32_t x) {
-  memset(out, 0, copies_ * sizeof(uint32_t));
-  for (int i = 0; i < THASH_NUM_CHUNKS; i++) {
-    uint32_t c = (x >> (i * THASH_CHUNK_BITS)) & (THASH_CHUNK_CARD - 1);
-    uint32_t *hashes = table_[i] + c * copies_;
-    for (int j = 0; j < copies_; j++) {
-      out[j] ^= hashes[j];
-    }
-  }
-}
-
 inline __attribute__((always_inline)) uint32_t fmix32 ( uint32_t h )
 {
   h ^= h >> 16;
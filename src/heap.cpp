@@ -5,7 +5,8 @@ namespace wmsketch {
 
 TopKCountHeap::TopKCountHeap(uint32_t capacity)
  : capacity_{capacity},
-   n_{0} {
+   n_{0},
+   version_{0} {
   pq_.resize(capacity + 1);
   qp_.reserve(capacity + 1);
 }
@@ -24,6 +25,10 @@ bool TopKCountHeap::is_full() {
   return n_ == capacity_;
 }
 
+uint64_t TopKCountHeap::version() {
+  return version_;
+}
+
 bool TopKCountHeap::contains(uint32_t key) {
   return qp_.find(key) != qp_.end();
 }
@@ -58,6 +63,7 @@ void TopKCountHeap::change_val(uint32_t key, uint32_t count, float val) {
   if (!contains(key)) throw std::invalid_argument("Key does not exist");
   std::get<1>(qp_[key]) = count;
   std::get<2>(qp_[key]) = val;
+  version_++;
   swim(std::get<0>(qp_[key]));
   sink(std::get<0>(qp_[key]));
 }
@@ -76,6 +82,7 @@ TopKCountHeap::insert(uint32_t key, uint32_t count, float val) {
     }
   }
   n_++;
+  version_++;
   qp_[key] = std::make_tuple(n_, count, val);
   pq_[n_] = key;
   swim(n_);
@@ -110,6 +117,7 @@ std::tuple<uint32_t, uint32_t, float> TopKCountHeap::del_min() {
   uint32_t idx = pq_[1];
   auto tup = std::make_tuple(idx, std::get<1>(qp_[idx]), std::get<2>(qp_[idx]));
   exch(1, n_--);
+  version_++;
   sink(1);
   qp_.erase(idx);
   return tup;
@@ -149,6 +157,7 @@ void TopKCountHeap::sink(uint32_t k) {
 WeightedReservoir::WeightedReservoir(uint32_t capacity)
  : capacity_{capacity},
    n_{0},
+   version_{0},
    rand_(0, 1),
    pow_{1.} {
   pq_.resize(capacity + 1);
@@ -158,6 +167,7 @@ WeightedReservoir::WeightedReservoir(uint32_t capacity)
 WeightedReservoir::WeightedReservoir(uint32_t capacity, int32_t seed, float pow)
  : capacity_{capacity},
    n_{0},
+   version_{0},
    gen_(seed),
    rand_(0, 1),
    pow_{pow} {
@@ -179,6 +189,10 @@ bool WeightedReservoir::is_full() {
   return n_ == capacity_;
 }
 
+uint64_t WeightedReservoir::version() {
+  return version_;
+}
+
 bool WeightedReservoir::contains(uint32_t key) {
   return qp_.find(key) != qp_.end();
 }
@@ -210,6 +224,7 @@ void WeightedReservoir::change_val(uint32_t key, float val) {
     std::get<1>(qp_[key]) *= pow(fabs(val / old_val), pow_);
   }
   std::get<2>(qp_[key]) = val;
+  version_++;
   swim(std::get<0>(qp_[key]));
   sink(std::get<0>(qp_[key]));
 }
@@ -233,6 +248,7 @@ WeightedReservoir::insert(uint32_t key, float val) {
     }
   }
   n_++;
+  version_++;
   qp_[key] = std::make_tuple(n_, r, val);
   pq_[n_] = key;
   swim(n_);
@@ -261,6 +277,7 @@ std::pair<uint32_t, float> WeightedReservoir::del_max() {
   uint32_t idx = pq_[1];
   auto pair = std::make_pair(idx, std::get<2>(qp_[idx]));
   exch(1, n_--);
+  version_++;
   sink(1);
   qp_.erase(idx);
   return pair;
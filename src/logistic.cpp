@@ -13,7 +13,7 @@ LogisticRegression::LogisticRegression(uint32_t dim, float lr_init, float l2_reg
    t_{0},
    no_bias_{no_bias} { }
 
-float LogisticRegression::get(uint32_t x) {
+float LogisticRegression::get(uint32_t x) const {
   if (x >= dim_) {
     throw std::out_of_range("Feature index out of bounds.");
   }
@@ -96,7 +96,7 @@ bool LogisticRegression::update(
   return yhat;
 }
 
-float LogisticRegression::bias() {
+float LogisticRegression::bias() const {
   return bias_;
 }
 
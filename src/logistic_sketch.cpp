@@ -1,29 +1,73 @@
 #include "logistic_sketch.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <numeric>
 #include "util.h"
+#include "stats.h"
 
 namespace wmsketch {
 
-LogisticSketch::LogisticSketch(
+template <class Cell>
+constexpr float BasicLogisticSketch<Cell>::MIN_SCALE;
+
+namespace {
+
+struct LogisticSketchConfig {
+  uint32_t log2_width;
+  uint32_t depth;
+  int32_t seed;
+  float lr_init;
+  float l2_reg;
+  uint32_t median_update;
+};
+
+struct LogisticSketchState {
+  uint64_t t;
+  uint64_t renormalizations;
+  uint64_t window;
+  uint64_t window_t;
+  float bias;
+  float scale;
+  float half_life;
+  uint32_t decay_clock;
+};
+
+} // namespace
+
+template <class Cell>
+BasicLogisticSketch<Cell>::BasicLogisticSketch(
     uint32_t log2_width,
     uint32_t depth,
     int32_t seed,
     float lr_init,
     float l2_reg,
     bool median_update)
- : bias_{0.f},
+ : weights_(log2_width <= MAX_LOG2_WIDTH ? log2_width : 0, depth, seed),  // width is validated below
+   bias_{0.f},
    lr_init_{lr_init},
    l2_reg_{l2_reg},
    scale_{1.f},
    t_{0},
    depth_{depth},
+   log2_width_{log2_width},
    median_update_{median_update},
+   seed_{seed},
    hash_fn_(depth, seed),
    hash_buf_(depth, 0),
-   weight_buf_(depth, 0) {
+   dedup_{false},
+   half_life_{0.f},
+   decay_clock_{DECAY_EXAMPLES},
+   example_decay_{1.f},
+   renormalizations_{0},
+   window_{0},
+   window_t_{0},
+   sync_scale_{1.f},
+   sync_bias_{0.f},
+   sync_t_{0},
+   sync_renorm_{1.f} {
 
-  if (log2_width > LogisticSketch::MAX_LOG2_WIDTH) {
+  if (log2_width > BasicLogisticSketch::MAX_LOG2_WIDTH) {
     throw std::invalid_argument("Invalid sketch width");
   }
 
@@ -33,24 +77,79 @@ LogisticSketch::LogisticSketch(
 
   uint32_t width = 1 << log2_width;
   width_mask_ = width - 1;
-
-  weights_ = (float**) calloc(depth, sizeof(float*));
-  weights_[0] = (float*) calloc(width * depth, sizeof(float));
-  for (int i = 0; i < depth; i++) {
-    weights_[i] = weights_[0] + i * width;
-  }
 }
 
-LogisticSketch::~LogisticSketch() {
-  free(weights_[0]);
-  free(weights_);
+template <class Cell>
+BasicLogisticSketch<Cell>::BasicLogisticSketch(BasicLogisticSketch& other)
+ : weights_(other.weights_),
+   bias_{other.bias_},
+   lr_init_{other.lr_init_},
+   l2_reg_{other.l2_reg_},
+   scale_{other.scale_},
+   t_{other.t_},
+   depth_{other.depth_},
+   log2_width_{other.log2_width_},
+   width_mask_{other.width_mask_},
+   median_update_{other.median_update_},
+   seed_{other.seed_},
+   hash_fn_(other.hash_fn_),
+   hash_buf_(other.depth_, 0),
+   dedup_{other.dedup_},
+   half_life_{other.half_life_},
+   decay_clock_{other.decay_clock_},
+   example_decay_{other.example_decay_},
+   last_tick_{other.last_tick_},
+   renormalizations_{other.renormalizations_},
+   window_{other.window_},
+   window_t_{other.window_t_},
+   sync_scale_{1.f},
+   sync_bias_{0.f},
+   sync_t_{0},
+   sync_renorm_{1.f} {
+  if (other.prev_) prev_.reset(new SketchTable<Cell>(*other.prev_));
 }
 
-float LogisticSketch::get(uint32_t key) {
+template <class Cell>
+BasicLogisticSketch<Cell>::~BasicLogisticSketch() = default;
+
+template <class Cell>
+float BasicLogisticSketch<Cell>::get(uint32_t key) const {
   return scale_ * get_weight(key, true);
 }
 
-float LogisticSketch::dot(const std::vector<std::pair<uint32_t, float> >& x) {
+template <class Cell>
+void BasicLogisticSketch<Cell>::get_batch(const uint32_t* keys, uint64_t n, float* out) const {
+  // hashes for key j are kept in slot j % (PREFETCH_DISTANCE + 1) of the hash buffer
+  uint32_t slots = PREFETCH_DISTANCE + 1;
+  ScratchBuffer<uint32_t, STACK_DEPTH * (PREFETCH_DISTANCE + 1)> hashes(depth_ * slots);
+  for (uint64_t j = 0; j < n && j < PREFETCH_DISTANCE; j++) {
+    prefetch(hashes.data() + (j % slots) * depth_, keys[j]);
+  }
+
+  for (uint64_t j = 0; j < n; j++) {
+    if (j + PREFETCH_DISTANCE < n) {
+      uint64_t a = j + PREFETCH_DISTANCE;
+      prefetch(hashes.data() + (a % slots) * depth_, keys[a]);
+    }
+
+    out[j] = scale_ * estimate(hashes.data() + (j % slots) * depth_, true);
+  }
+}
+
+template <class Cell>
+float BasicLogisticSketch<Cell>::dot(const std::vector<std::pair<uint32_t, float> >& x) const {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  float z = 0.f;
+  for (const auto& p : x) {
+    hash_fn_.hash(hashes.data(), p.first);
+    z += p.second * estimate(hashes.data(), median_update_);
+  }
+  z *= scale_;
+  return z;
+}
+
+template <class Cell>
+float BasicLogisticSketch<Cell>::gather_dot(const std::vector<std::pair<uint32_t, float> >& x) {
   if (x.size() == 0) return 0.f;
   float z = 0.f;
   get_weights(x);
@@ -66,27 +165,58 @@ float LogisticSketch::dot(const std::vector<std::pair<uint32_t, float> >& x) {
   return z;
 }
 
-bool LogisticSketch::predict(const std::vector<std::pair<uint32_t, float> >& x) {
+template <class Cell>
+bool BasicLogisticSketch<Cell>::predict(const std::vector<std::pair<uint32_t, float> >& x) const {
   float z = dot(x) + bias_;
   return z >= 0.;
 }
 
-bool LogisticSketch::update(uint32_t key, bool label) {
-  float med = get_weight(key, true);
+template <class Cell>
+void BasicLogisticSketch<Cell>::predict_batch(const CSR& x, float* margins_out) const {
+  uint64_t n = x.rows();
+  uint64_t nnz = x.nnz();
+
+  // hashes for feature j are kept in slot j % (PREFETCH_DISTANCE + 1) of the hash buffer
+  uint32_t slots = PREFETCH_DISTANCE + 1;
+  ScratchBuffer<uint32_t, STACK_DEPTH * (PREFETCH_DISTANCE + 1)> hashes(depth_ * slots);
+  for (uint64_t j = 0; j < nnz && j < PREFETCH_DISTANCE; j++) {
+    prefetch(hashes.data() + (j % slots) * depth_, x.indices[j]);
+  }
+
+  uint64_t j = 0;
+  for (uint64_t r = 0; r < n; r++) {
+    float z = 0.f;
+    for (; j < x.indptr[r+1]; j++) {
+      if (j + PREFETCH_DISTANCE < nnz) {
+        uint64_t a = j + PREFETCH_DISTANCE;
+        prefetch(hashes.data() + (a % slots) * depth_, x.indices[a]);
+      }
+
+      z += x.values[j] * estimate(hashes.data() + (j % slots) * depth_, median_update_);
+    }
+    margins_out[r] = z * scale_ + bias_;
+  }
+}
+
+template <class Cell>
+bool BasicLogisticSketch<Cell>::update(uint32_t key, bool label) {
+  begin_update(1);
+  hash_fn_.hash(hash_buf_.data(), key);
 
   int y = label ? +1 : -1;
   float lr = lr_init_ / (1.f + lr_init_ * l2_reg_ * t_);
-  float z = median_update_ ? med : mean(weight_buf_);
+  float z = estimate(hash_buf_.data(), median_update_);
   z *= scale_;
   z += bias_;
 
   float g = logistic_grad(y * z);
   scale_ *= (1 - lr * l2_reg_);
+  decay(example_decay_);
   float u = lr * y * g / scale_;
   for (int i = 0; i < depth_; i++) {
     uint32_t h = hash_buf_[i];
     int sgn = (h >> 31) ? +1 : -1;
-    weights_[i][h & width_mask_] -= sgn * u;
+    weights_.add(i, h & width_mask_, -sgn * u);
   }
 
   bias_ -= lr * y * g;
@@ -94,23 +224,27 @@ bool LogisticSketch::update(uint32_t key, bool label) {
   return z >= 0.;
 }
 
-bool LogisticSketch::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
+template <class Cell>
+bool BasicLogisticSketch<Cell>::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
   if (x.size() == 0) {
     return bias_ >= 0;
   }
+  begin_update(1);
+  const auto& xs = (dedup_ && coalescer_.coalesce(x)) ? coalescer_.features() : x;
   int y = label ? +1 : -1;
   float lr = lr_init_ / (1.f + lr_init_ * l2_reg_ * t_);
-  float z = dot(x) + bias_;
+  float z = gather_dot(xs) + bias_;
   float g = logistic_grad(y * z);
   scale_ *= (1 - lr * l2_reg_);
+  decay(example_decay_);
   float u = lr * y * g / scale_;
 
-  for (int idx = 0; idx < x.size(); idx++) {
-    float val = x[idx].second;
+  for (int idx = 0; idx < xs.size(); idx++) {
+    float val = xs[idx].second;
     for (int i = 0; i < depth_; i++) {
       uint32_t h = hash_buf_[idx*depth_ + i];
       int sgn = (h >> 31) ? +1 : -1;
-      weights_[i][h & width_mask_] -= sgn * u * val;
+      weights_.add(i, h & width_mask_, -sgn * u * val);
     }
   }
 
@@ -119,32 +253,49 @@ bool LogisticSketch::update(const std::vector<std::pair<uint32_t, float> >& x, b
   return z >= 0;
 }
 
-bool LogisticSketch::update(
+template <class Cell>
+bool BasicLogisticSketch<Cell>::update(
     std::vector<float>& new_weights,
     const std::vector<std::pair<uint32_t, float> >& x,
     bool label) {
-  uint64_t n = x.size();
-  new_weights.resize(n);
-  if (n == 0) {
+  new_weights.resize(x.size());
+  if (x.size() == 0) {
     return bias_ >= 0;
   }
 
+  begin_update(1);
+
+  // with merged duplicates, new weights are computed per distinct key and then copied to each input feature
+  bool merged = dedup_ && coalescer_.coalesce(x);
+  const auto& xs = merged ? coalescer_.features() : x;
+  std::vector<float>& out = merged ? dedup_weights_ : new_weights;
+  uint64_t n = xs.size();
+  out.resize(n);
+
   int y = label ? +1 : -1;
   float lr = lr_init_ / (1.f + lr_init_ * l2_reg_ * t_);
-  float z = dot(x) + bias_;
+  float z = gather_dot(xs) + bias_;
   float g = logistic_grad(y * z);
   scale_ *= (1 - lr * l2_reg_);
+  decay(example_decay_);
   float u = lr * y * g / scale_;
 
   for (int idx = 0; idx < n; idx++) {
-    float val = x[idx].second;
+    float val = xs[idx].second;
     for (int i = 0; i < depth_; i++) {
       uint32_t h = hash_buf_[idx*depth_ + i];
       int sgn = (h >> 31) ? +1 : -1;
-      weights_[i][h & width_mask_] -= sgn * u * val;
+      weights_.add(i, h & width_mask_, -sgn * u * val);
     }
 
-    new_weights[idx] = weight_medians_[idx] - u * val;
+    out[idx] = weight_medians_[idx] - u * val;
+  }
+
+  if (merged) {
+    const std::vector<uint32_t>& pos = coalescer_.positions();
+    for (uint64_t j = 0; j < x.size(); j++) {
+      new_weights[j] = dedup_weights_[pos[j]];
+    }
   }
 
   bias_ -= lr * y * g;
@@ -152,27 +303,294 @@ bool LogisticSketch::update(
   return z >= 0;
 }
 
-float LogisticSketch::bias() {
+template <class Cell>
+void BasicLogisticSketch<Cell>::update_batch(std::vector<bool>& yhat, const CSR& x, const std::vector<bool>& labels) {
+  apply_batch(yhat, nullptr, x, labels);
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::update_batch(
+    std::vector<bool>& yhat,
+    std::vector<std::pair<uint32_t, float> >& new_weights,
+    const CSR& x,
+    const std::vector<bool>& labels) {
+  apply_batch(yhat, &new_weights, x, labels);
+}
+
+template <class Cell>
+float BasicLogisticSketch<Cell>::bias() const {
   return bias_;
 }
 
-float LogisticSketch::scale() {
+template <class Cell>
+float BasicLogisticSketch<Cell>::scale() const {
   return scale_;
 }
 
-float LogisticSketch::get_weight(uint32_t key, bool use_median) {
-  hash_fn_.hash(hash_buf_.data(), key);
+template <class Cell>
+void BasicLogisticSketch<Cell>::set_dedup(bool dedup) {
+  dedup_ = dedup;
+}
+
+template <class Cell>
+const FeatureCoalescer& BasicLogisticSketch<Cell>::coalescer() const {
+  return coalescer_;
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::set_decay(float half_life, DecayClock clock) {
+  if (half_life < 0.f) {
+    throw std::invalid_argument("Decay half-life must be nonnegative");
+  }
+  half_life_ = half_life;
+  decay_clock_ = clock;
+  example_decay_ = (half_life > 0.f && clock == DECAY_EXAMPLES) ? exp2f(-1.f / half_life) : 1.f;
+  last_tick_ = std::chrono::steady_clock::now();
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::set_window(uint64_t period) {
+  if (period == window_) return;
+  if (t_ > 0) {
+    throw std::runtime_error("Window must be set before the first update");
+  }
+  window_ = period;
+  window_t_ = 0;
+  if (period > 0 && !prev_) {
+    prev_.reset(new SketchTable<Cell>(log2_width_, depth_, seed_ + 1));
+  } else if (period == 0) {
+    prev_.reset();
+  }
+}
+
+template <class Cell>
+float BasicLogisticSketch<Cell>::renormalize() {
+  float s = scale_;
+  weights_.scale(s);
+  if (prev_) prev_->scale(s);
+  scale_ = 1.f;
+  sync_renorm_ *= s;
+  renormalizations_++;
+  return s;
+}
+
+template <class Cell>
+uint64_t BasicLogisticSketch<Cell>::renormalizations() const {
+  return renormalizations_;
+}
+
+template <class Cell>
+std::shared_ptr<const FrozenModel> BasicLogisticSketch<Cell>::freeze(bool quantize) const {
+  return freeze(std::vector<uint32_t>(), quantize);
+}
+
+template <class Cell>
+std::shared_ptr<const FrozenModel> BasicLogisticSketch<Cell>::freeze(const std::vector<uint32_t>& keys, bool quantize) const {
+  std::vector<float> table;
+  weights_.decode(table);
+  if (prev_) {
+    std::vector<float> prev;
+    prev_->decode(prev);
+    for (uint64_t j = 0; j < table.size(); j++) {
+      table[j] += prev[j];
+    }
+  }
+  return std::make_shared<const FrozenModel>(
+      hash_fn_, depth_, log2_width_, std::move(table), scale_, bias_, median_update_,
+      std::vector<std::pair<uint32_t, float> >(), keys, quantize);
+}
+
+template <class Cell>
+uint64_t BasicLogisticSketch<Cell>::size_bytes() const {
+  return weights_.size_bytes() + (prev_ ? prev_->size_bytes() : 0);
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::save(CheckpointWriter& out) const {
+  save_state(out);
+  weights_.save(out);
+  if (prev_) prev_->save(out);
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::load(CheckpointReader& in) {
+  load_state(in);
+  weights_.load(in);
+  if (window_ > 0) {
+    if (!prev_) prev_.reset(new SketchTable<Cell>(log2_width_, depth_, seed_ + 1));
+    prev_->load(in);
+  } else {
+    prev_.reset();
+  }
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::save_delta(CheckpointWriter& out) const {
+  save_state(out);
+  weights_.save_delta(out);
+  if (prev_) prev_->save_delta(out);
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::load_delta(CheckpointReader& in) {
+  load_state(in);
+  weights_.load_delta(in);
+  if (window_ > 0) {
+    if (!prev_) prev_.reset(new SketchTable<Cell>(log2_width_, depth_, seed_ + 1));
+    prev_->load_delta(in);
+  } else {
+    prev_.reset();
+  }
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::mark_clean() {
+  weights_.mark_clean();
+  if (prev_) prev_->mark_clean();
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::mark_synced() {
+  if (window_ > 0) throw std::runtime_error("Sync is not supported with a window");
+  // release the previous copy first, so that the fork only writes back the pages changed since it was taken
+  sync_base_.reset();
+  sync_base_.reset(new SketchTable<Cell>(weights_));
+  weights_.mark_synced();
+  sync_scale_ = scale_;
+  sync_bias_ = bias_;
+  sync_t_ = t_;
+  sync_renorm_ = 1.f;
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::extract_delta(SketchDelta& out) const {
+  if (!sync_base_) throw std::runtime_error("No sync point");
+  if (window_ > 0) throw std::runtime_error("Sync is not supported with a window");
+  // the weights of unwritten cells have only decayed, by the ratio of the current and sync point scales
+  out.depth = depth_;
+  out.log2_width = log2_width_;
+  out.steps = t_ - sync_t_;
+  out.decay = scale_ * sync_renorm_ / sync_scale_;
+  out.bias = bias_ - sync_bias_;
+  weights_.diff(*sync_base_, sync_renorm_, scale_, out.indices, out.values);
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::apply_delta(const SketchDelta& delta, float weight) {
+  if (delta.depth != depth_ || delta.log2_width != log2_width_) {
+    throw std::runtime_error("Delta does not match the sketch dimensions");
+  }
+  if (window_ > 0) throw std::runtime_error("Sync is not supported with a window");
+  if (delta.indices.size() != delta.values.size()) throw std::runtime_error("Malformed sketch delta");
+
+  scale_ *= (weight == 1.f) ? delta.decay : powf(delta.decay, weight);
+  if (scale_ < MIN_SCALE) renormalize();
+  bias_ += weight * delta.bias;
+  t_ += (uint64_t) llrint(weight * delta.steps);
+  float c = weight / scale_;
+  uint64_t n = (uint64_t) depth_ << log2_width_;
+  for (size_t i = 0; i < delta.indices.size(); i++) {
+    uint32_t idx = delta.indices[i];
+    if (idx >= n) throw std::runtime_error("Malformed sketch delta");
+    weights_.add(idx >> log2_width_, idx & width_mask_, c * delta.values[i]);
+  }
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::revert_to_sync() {
+  if (!sync_base_) throw std::runtime_error("No sync point");
+  // a renormalization rescales every cell
+  weights_.revert(*sync_base_, sync_renorm_ != 1.f);
+  scale_ = sync_scale_;
+  bias_ = sync_bias_;
+  t_ = sync_t_;
+  sync_renorm_ = 1.f;
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::save_state(CheckpointWriter& out) const {
+  LogisticSketchConfig conf = {log2_width_, depth_, seed_, lr_init_, l2_reg_, median_update_};
+  LogisticSketchState state = {
+      t_, renormalizations_, window_, window_t_, bias_, scale_, half_life_, (uint32_t) decay_clock_};
+  out.write_value(checkpoint_tag("LSKC"), conf);
+  out.write_value(checkpoint_tag("LSKS"), state);
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::load_state(CheckpointReader& in) {
+  LogisticSketchConfig conf;
+  LogisticSketchState state;
+  in.read_value(checkpoint_tag("LSKC"), conf);
+  if (conf.log2_width != log2_width_ || conf.depth != depth_ || conf.seed != seed_ || conf.lr_init != lr_init_
+      || conf.l2_reg != l2_reg_ || conf.median_update != median_update_) {
+    throw std::runtime_error("Checkpoint does not match the model configuration");
+  }
+  in.read_value(checkpoint_tag("LSKS"), state);
+  if (state.decay_clock != DECAY_EXAMPLES && state.decay_clock != DECAY_SECONDS) {
+    throw std::runtime_error("Malformed checkpoint record");
+  }
+
+  t_ = state.t;
+  renormalizations_ = state.renormalizations;
+  window_ = state.window;
+  window_t_ = state.window_t;
+  bias_ = state.bias;
+  scale_ = state.scale;
+  set_decay(state.half_life, (DecayClock) state.decay_clock);
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::begin_update(uint64_t n) {
+  if (scale_ < MIN_SCALE) renormalize();
+
+  if (window_ > 0) {
+    if (window_t_ >= window_) rotate();
+    window_t_ += n;
+  }
+
+  if (half_life_ > 0.f && decay_clock_ == DECAY_SECONDS) {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_tick_).count();
+    last_tick_ = now;
+    decay((float) exp2(-elapsed / half_life_));
+  }
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::decay(float factor) {
+  // a tiny scale would inflate updates to the cells beyond their range
+  scale_ = MAX(scale_ * factor, MIN_SCALE * MIN_SCALE);
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::rotate() {
+  prev_->swap(weights_);
+  weights_.clear();
+  window_t_ = 0;
+}
+
+template <class Cell>
+float BasicLogisticSketch<Cell>::estimate(const uint32_t* hashes, bool use_median) const {
+  ScratchBuffer<float, STACK_DEPTH> buf(depth_);
   for (int i = 0; i < depth_; i++) {
-    uint32_t h = hash_buf_[i];
+    uint32_t h = hashes[i];
     int sgn = (h >> 31) ? +1 : -1;
-    weight_buf_[i] = sgn * weights_[i][h & width_mask_];
+    buf[i] = sgn * cell(i, h & width_mask_);
   }
 
-  if (use_median) return median(weight_buf_);
-  return mean(weight_buf_);
+  if (use_median) return median(buf.data(), depth_);
+  return mean(buf.data(), depth_);
+}
+
+template <class Cell>
+float BasicLogisticSketch<Cell>::get_weight(uint32_t key, bool use_median) const {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
+  return estimate(hashes.data(), use_median);
 }
 
-void LogisticSketch::get_weights(const std::vector<std::pair<uint32_t, float> >& x) {
+template <class Cell>
+void BasicLogisticSketch<Cell>::get_weights(const std::vector<std::pair<uint32_t, float> >& x) {
   uint64_t n = x.size();
   if (hash_buf_.size() < depth_ * n) {
     hash_buf_.resize(depth_ * n);
@@ -180,18 +598,131 @@ void LogisticSketch::get_weights(const std::vector<std::pair<uint32_t, float> >&
 
   weight_medians_.resize(n);
   if (!median_update_) weight_means_.resize(n);
-  uint32_t* ph = hash_buf_.data();
   for (int idx = 0; idx < n; idx++) {
-    hash_fn_.hash(ph + idx*depth_, x[idx].first);
+    gather_weight(idx, x[idx].first);
+  }
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::get_weights(const uint32_t* keys, uint64_t n) {
+  if (hash_buf_.size() < depth_ * n) {
+    hash_buf_.resize(depth_ * n);
+  }
+
+  weight_medians_.resize(n);
+  if (!median_update_) weight_means_.resize(n);
+  for (int idx = 0; idx < n; idx++) {
+    gather_weight(idx, keys[idx]);
+  }
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::gather_weight(uint64_t idx, uint32_t key) {
+  uint32_t* ph = hash_buf_.data() + idx*depth_;
+  hash_fn_.hash(ph, key);
+  ScratchBuffer<float, STACK_DEPTH> buf(depth_);
+  for (int i = 0; i < depth_; i++) {
+    uint32_t h = ph[i];
+    int sgn = (h >> 31) ? +1 : -1;
+    buf[i] = sgn * cell(i, h & width_mask_);
+  }
+
+  weight_medians_[idx] = median(buf.data(), depth_);
+  if (!median_update_) weight_means_[idx] = mean(buf.data(), depth_);
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::prefetch(uint32_t* hashes, uint32_t key) const {
+  hash_fn_.hash(hashes, key);
+  for (int i = 0; i < depth_; i++) {
+    __builtin_prefetch(weights_.cell_ptr(i, hashes[i] & width_mask_));
+    if (prev_) __builtin_prefetch(prev_->cell_ptr(i, hashes[i] & width_mask_));
+  }
+}
+
+template <class Cell>
+void BasicLogisticSketch<Cell>::apply_batch(
+    std::vector<bool>& yhat,
+    std::vector<std::pair<uint32_t, float> >* new_weights,
+    const CSR& x,
+    const std::vector<bool>& labels) {
+  uint64_t n = x.rows();
+  uint64_t nnz = x.nnz();
+  yhat.resize(n);
+  if (new_weights) new_weights->clear();
+  if (n == 0) return;
+  begin_update(n);
+
+  // gather weight estimates for every feature in the batch
+  get_weights(x.indices.data(), nnz);
+  const std::vector<float>& w = median_update_ ? weight_medians_ : weight_means_;
+
+  // compute all margins against the model as of the start of the batch
+  margin_buf_.resize(n);
+  for (uint64_t r = 0; r < n; r++) {
+    float z = 0.f;
+    for (uint64_t j = x.indptr[r]; j < x.indptr[r+1]; j++) {
+      z += x.values[j] * w[j];
+    }
+    margin_buf_[r] = z * scale_ + bias_;
+  }
+
+  // per-example gradient steps; sketch updates are deferred
+  coef_buf_.resize(nnz);
+  for (uint64_t r = 0; r < n; r++) {
+    float z = margin_buf_[r];
+    if (x.indptr[r] == x.indptr[r+1]) {
+      yhat[r] = bias_ >= 0;
+      continue;
+    }
+
+    yhat[r] = z >= 0;
+    int y = labels[r] ? +1 : -1;
+    float lr = lr_init_ / (1.f + lr_init_ * l2_reg_ * t_);
+    float g = logistic_grad(y * z);
+    scale_ *= (1 - lr * l2_reg_);
+    decay(example_decay_);
+    float u = lr * y * g / scale_;
+    for (uint64_t j = x.indptr[r]; j < x.indptr[r+1]; j++) {
+      coef_buf_[j] = u * x.values[j];
+    }
+
+    bias_ -= lr * y * g;
+    t_++;
+  }
+
+  // coalesce duplicate keys and scatter the aggregated update
+  order_buf_.resize(nnz);
+  std::iota(order_buf_.begin(), order_buf_.end(), 0);
+  std::sort(order_buf_.begin(), order_buf_.end(),
+      [&x](uint32_t a, uint32_t b) { return x.indices[a] < x.indices[b]; });
+
+  uint64_t s = 0;
+  while (s < nnz) {
+    uint32_t first = order_buf_[s];
+    uint32_t key = x.indices[first];
+    float c = 0.f;
+    uint64_t e = s;
+    for (; e < nnz && x.indices[order_buf_[e]] == key; e++) {
+      c += coef_buf_[order_buf_[e]];
+    }
+    WMSKETCH_COUNT(DUPLICATE_KEYS, e - s - 1);
+
+    const uint32_t* ph = hash_buf_.data() + (uint64_t) first*depth_;
     for (int i = 0; i < depth_; i++) {
-      uint32_t h = hash_buf_[idx*depth_ + i];
+      uint32_t h = ph[i];
       int sgn = (h >> 31) ? +1 : -1;
-      weight_buf_[i] = sgn * weights_[i][h & width_mask_];
+      weights_.add(i, h & width_mask_, -sgn * c);
     }
 
-    weight_medians_[idx] = median(weight_buf_);
-    if (!median_update_) weight_means_[idx] = mean(weight_buf_);
+    if (new_weights) new_weights->emplace_back(key, weight_medians_[first] - c);
+    s = e;
   }
 }
 
+template class BasicLogisticSketch<cell::Float32>;
+template class BasicLogisticSketch<cell::BFloat16>;
+template class BasicLogisticSketch<cell::Int16>;
+template class BasicLogisticSketch<cell::Int8>;
+
 } // namespace wmsketch
@@ -1,18 +1,25 @@
 #include "paired_countmin.h"
+#include <cstring>
 #include "util.h"
 
 namespace wmsketch {
 
-PairedCountMin::PairedCountMin(uint32_t log2_width, uint32_t depth, int32_t seed, float smooth, bool consv_update)
+template <class Counter>
+BasicPairedCountMin<Counter>::BasicPairedCountMin(
+    uint32_t log2_width,
+    uint32_t depth,
+    int32_t seed,
+    float smooth,
+    bool consv_update)
  : depth_{depth},
    smooth_{smooth},
    consv_update_{consv_update},
+   counts_(log2_width <= MAX_LOG2_WIDTH ? log2_width : 0, depth),  // width is validated below
    pos_count_{0},
    neg_count_{0},
-   hash_fn_(depth, seed),
-   hash_buf_(depth, 0) {
+   hash_fn_(depth, seed) {
 
-  if (log2_width < 1 || log2_width > PairedCountMin::MAX_LOG2_WIDTH) {
+  if (log2_width < 1 || log2_width > BasicPairedCountMin::MAX_LOG2_WIDTH) {
     throw std::invalid_argument("Invalid sketch width");
   }
 
@@ -20,74 +27,72 @@ PairedCountMin::PairedCountMin(uint32_t log2_width, uint32_t depth, int32_t seed
     throw std::invalid_argument("Invalid sketch depth");
   }
 
-  uint32_t width = 1 << (log2_width - 1);  // two count-min tables of half width
+  uint32_t width = 1 << (log2_width - 1);  // two interleaved count-min tables of half width
   width_mask_ = width - 1;
-
-  counts_num_ = (uint32_t**) calloc(depth, sizeof(uint32_t*));
-  counts_num_[0] = (uint32_t*) calloc(depth * width, sizeof(uint32_t));
-  counts_den_ = (uint32_t**) calloc(depth, sizeof(uint32_t*));
-  counts_den_[0] = (uint32_t*) calloc(depth * width, sizeof(uint32_t));
-
-  for (int i = 0; i < depth; i++) {
-    counts_num_[i] = counts_num_[0] + (i * width);
-    counts_den_[i] = counts_den_[0] + (i * width);
-  }
 }
 
-PairedCountMin::~PairedCountMin() {
-  free(counts_num_[0]);
-  free(counts_num_);
-  free(counts_den_[0]);
-  free(counts_den_);
-}
+template <class Counter>
+BasicPairedCountMin<Counter>::~BasicPairedCountMin() = default;
 
-float PairedCountMin::get(uint32_t key) {
-  hash_fn_.hash(hash_buf_.data(), key);
+template <class Counter>
+float BasicPairedCountMin<Counter>::get(uint32_t key) const {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
   for (int i = 0; i < depth_; i++) {
-    hash_buf_[i] &= width_mask_;
+    hashes[i] &= width_mask_;
   }
 
-  uint32_t num = counts_num_[0][hash_buf_[0]];
-  uint32_t den = counts_den_[0][hash_buf_[0]];
+  uint32_t width = width_mask_ + 1;
+  uint32_t num, den;
+  counts_.get_pair(hashes[0], num, den);
   for (int i = 1; i < depth_; i++) {
-    num = MIN(num, counts_num_[i][hash_buf_[i]]);
-    den = MIN(den, counts_den_[i][hash_buf_[i]]);
+    uint32_t n, d;
+    counts_.get_pair(i * width + hashes[i], n, d);
+    num = MIN(num, n);
+    den = MIN(den, d);
   }
 
   float ratio = (num + smooth_) / (den + smooth_);
   return ratio / bias();
 }
 
-float PairedCountMin::update_feature(uint32_t key, bool label) {
-  hash_fn_.hash(hash_buf_.data(), key);
+template <class Counter>
+float BasicPairedCountMin<Counter>::update_feature(uint32_t key, bool label) {
+  ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+  hash_fn_.hash(hashes.data(), key);
   for (int i = 0; i < depth_; i++) {
-    hash_buf_[i] &= width_mask_;
+    hashes[i] &= width_mask_;
   }
 
+  // offset of the updated cell within a pair
+  uint64_t side = label ? 0 : 1;
+  uint32_t width = width_mask_ + 1;
   uint32_t num = UINT32_MAX;
   uint32_t den = UINT32_MAX;
   if (consv_update_) {
     for (int i = 0; i < depth_; i++) {
-      uint32_t j = hash_buf_[i];
-      num = MIN(num, counts_num_[i][j]);
-      den = MIN(den, counts_den_[i][j]);
+      uint32_t n, d;
+      counts_.get_pair(i * width + hashes[i], n, d);
+      num = MIN(num, n);
+      den = MIN(den, d);
     }
 
     if (label) num++;
     else den++;
 
+    uint32_t c = label ? num : den;
     for (int i = 0; i < depth_; i++) {
-      uint32_t j = hash_buf_[i];
-      if (label) counts_num_[i][j] = MAX(num, counts_num_[i][j]);
-      else counts_den_[i][j] = MAX(den, counts_den_[i][j]);
+      uint64_t j = 2 * ((uint64_t) i * width + hashes[i]) + side;
+      if (c > counts_.get_at(j)) counts_.set_at(j, c);
     }
   } else {
     for (int i = 0; i < depth_; i++) {
-      uint32_t j = hash_buf_[i];
-      if (label) counts_num_[i][j]++;
-      else counts_den_[i][j]++;
-      num = MIN(num, counts_num_[i][j]);
-      den = MIN(den, counts_den_[i][j]);
+      uint64_t p = (uint64_t) i * width + hashes[i];
+      counts_.set_at(2 * p + side, counts_.get_at(2 * p + side) + 1);
+      uint32_t n, d;
+      counts_.get_pair(p, n, d);
+      num = MIN(num, n);
+      den = MIN(den, d);
     }
   }
 
@@ -95,7 +100,82 @@ float PairedCountMin::update_feature(uint32_t key, bool label) {
   return ratio / bias();
 }
 
-bool PairedCountMin::update(uint32_t key, bool label) {
+template <class Counter>
+void BasicPairedCountMin<Counter>::update_features(
+    float* ratios_out,
+    const std::vector<std::pair<uint32_t, float> >& x,
+    bool label) {
+  const uint32_t w = simd::WIDTH;
+  uint64_t n = x.size();
+  uint64_t s = 0;
+  if (counts_.gatherable()) {
+    // the pair of cells of feature s + b in row i is at pair offset offsets[i * w + b]
+    ScratchBuffer<uint32_t, STACK_DEPTH * simd::WIDTH> offsets(depth_ * w);
+    ScratchBuffer<uint32_t, STACK_DEPTH * simd::WIDTH> nums(depth_ * w);
+    ScratchBuffer<uint32_t, STACK_DEPTH * simd::WIDTH> dens(depth_ * w);
+    ScratchBuffer<uint32_t, STACK_DEPTH> hashes(depth_);
+    uint32_t num[simd::WIDTH], den[simd::WIDTH];
+    uint32_t width = width_mask_ + 1;
+    uint64_t side = label ? 0 : 1;
+    for (; s + w <= n; s += w) {
+      for (uint32_t b = 0; b < w; b++) {
+        hash_fn_.hash(hashes.data(), x[s + b].first);
+        for (int i = 0; i < depth_; i++) {
+          offsets[i * w + b] = i * width + (hashes[i] & width_mask_);
+        }
+      }
+
+      bool conflict = false;
+      for (int i = 0; i < depth_ && !conflict; i++) {
+        conflict = simd::has_conflict(offsets.data() + i * w);
+      }
+
+      if (conflict) {
+        // features that share a cell must observe each other's updates
+        for (uint32_t b = 0; b < w; b++) {
+          ratios_out[s + b] = update_feature(x[s + b].first, label);
+        }
+        continue;
+      }
+
+      for (int i = 0; i < depth_; i++) {
+        counts_.gather_pairs(offsets.data() + i * w, nums.data() + i * w, dens.data() + i * w);
+      }
+      memcpy(num, nums.data(), sizeof(num));
+      memcpy(den, dens.data(), sizeof(den));
+      for (int i = 1; i < depth_; i++) {
+        simd::min_u32(num, nums.data() + i * w);
+        simd::min_u32(den, dens.data() + i * w);
+      }
+
+      // only the counts of the example's label are updated, and their minimum grows by one either way
+      uint32_t* vals = label ? nums.data() : dens.data();
+      uint32_t* mins = label ? num : den;
+      for (int i = 0; i < depth_; i++) {
+        for (uint32_t b = 0; b < w; b++) {
+          uint32_t v = vals[i * w + b];
+          uint64_t j = 2 * (uint64_t) offsets[i * w + b] + side;
+          if (!consv_update_) counts_.set_at(j, v + 1);
+          else if (mins[b] + 1 > v) counts_.set_at(j, mins[b] + 1);
+        }
+      }
+
+      float bias = this->bias();
+      for (uint32_t b = 0; b < w; b++) {
+        mins[b]++;
+        float ratio = (num[b] + smooth_) / (den[b] + smooth_);
+        ratios_out[s + b] = ratio / bias;
+      }
+    }
+  }
+
+  for (; s < n; s++) {
+    ratios_out[s] = update_feature(x[s].first, label);
+  }
+}
+
+template <class Counter>
+bool BasicPairedCountMin<Counter>::update(uint32_t key, bool label) {
   if (label) pos_count_++;
   else neg_count_++;
   update_feature(key, label);
@@ -103,31 +183,39 @@ bool PairedCountMin::update(uint32_t key, bool label) {
   return true;
 }
 
-bool PairedCountMin::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
+template <class Counter>
+bool BasicPairedCountMin<Counter>::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
   if (label) pos_count_++;
   else neg_count_++;
   uint32_t n = x.size();
   if (n == 0) return true; // TODO
-  for (auto& pair : x) {
-    update_feature(pair.first, label);
-  }
+  weight_buf_.resize(n);
+  update_features(weight_buf_.data(), x, label);
   return true; // TODO
 }
 
-bool PairedCountMin::update(std::vector<float>& new_weights, const std::vector<std::pair<uint32_t, float> >& x, bool label) {
+template <class Counter>
+bool BasicPairedCountMin<Counter>::update(std::vector<float>& new_weights, const std::vector<std::pair<uint32_t, float> >& x, bool label) {
   if (label) pos_count_++;
   else neg_count_++;
   uint32_t n = x.size();
   new_weights.resize(n);
   if (n == 0) return true; // TODO
-  for (int i = 0; i < n; i++) {
-    new_weights[i] = update_feature(x[i].first, label);
-  }
+  update_features(new_weights.data(), x, label);
   return true; // TODO
 }
 
-float PairedCountMin::bias() {
+template <class Counter>
+float BasicPairedCountMin<Counter>::bias() const {
   return (pos_count_ + smooth_) / (neg_count_ + smooth_);
 }
 
+template <class Counter>
+uint64_t BasicPairedCountMin<Counter>::size_bytes() const {
+  return counts_.size_bytes();
+}
+
+template class BasicPairedCountMin<counter::Uint32>;
+template class BasicPairedCountMin<counter::Uint8>;
+
 } // namespace wmsketch
@@ -1,7 +1,86 @@
 #include "sgns.h"
+#include <sstream>
 
 namespace wmsketch {
 
+namespace {
+
+struct SGNSConfig {
+  uint32_t k;
+  uint32_t window_size;
+  uint32_t neg_samples;
+  int32_t seed;
+  float lr_init;
+  float l2_reg;
+};
+
+struct SGNSState {
+  uint64_t t;
+  float bias;
+  float scale;
+};
+
+void save_rng(CheckpointWriter& out, uint32_t tag, const std::mt19937& gen) {
+  std::ostringstream ss;
+  ss << gen;
+  out.write_string(tag, ss.str());
+}
+
+void load_rng(CheckpointReader& in, uint32_t tag, std::mt19937& gen) {
+  std::istringstream ss(in.read_string(tag));
+  ss >> gen;
+  if (ss.fail()) throw std::runtime_error("Malformed checkpoint record");
+}
+
+} // namespace
+
+void TokenReservoir::save(CheckpointWriter& out) const {
+  uint32_t state[2] = {capacity_, n_};
+  std::vector<std::string> tokens;
+  std::vector<uint32_t> counts;
+  for (const auto& ti : tokens_) {
+    tokens.push_back(ti.count > 0 ? ti.token : std::string());
+    counts.push_back(ti.count);
+  }
+  out.write(checkpoint_tag("TRSV"), state, sizeof(state));
+  out.write_vector(checkpoint_tag("TRIX"), reservoir_);
+  out.write_strings(checkpoint_tag("TRTK"), tokens);
+  out.write_vector(checkpoint_tag("TRCT"), counts);
+  save_rng(out, checkpoint_tag("RRNG"), gen_);
+}
+
+void TokenReservoir::load(CheckpointReader& in) {
+  uint32_t state[2];
+  std::vector<uint32_t> reservoir, counts;
+  std::vector<std::string> tokens;
+  in.read(checkpoint_tag("TRSV"), state, sizeof(state));
+  if (state[0] != capacity_) throw std::runtime_error("Checkpoint does not match the model configuration");
+  in.read_vector(checkpoint_tag("TRIX"), reservoir);
+  in.read_strings(checkpoint_tag("TRTK"), tokens);
+  in.read_vector(checkpoint_tag("TRCT"), counts);
+  if (tokens.size() != capacity_ || counts.size() != capacity_ || reservoir.size() > capacity_) {
+    throw std::runtime_error("Malformed checkpoint record");
+  }
+  for (uint32_t idx : reservoir) {
+    if (idx >= capacity_) throw std::runtime_error("Malformed checkpoint record");
+  }
+  load_rng(in, checkpoint_tag("RRNG"), gen_);
+
+  n_ = state[1];
+  reservoir_ = std::move(reservoir);
+  token_idx_map_.clear();
+  free_ = std::stack<uint32_t>();
+  for (uint32_t i = capacity_; i-- > 0; ) {
+    tokens_[i].token = tokens[i];
+    tokens_[i].count = counts[i];
+    if (counts[i] > 0) {
+      token_idx_map_[tokens[i]] = i;
+    } else {
+      free_.push(i);
+    }
+  }
+}
+
 StreamingSGNS::StreamingSGNS(
     uint32_t k,
     uint32_t log2_width,
@@ -69,11 +148,11 @@ void StreamingSGNS::update(const std::string& a, const std::string& b, bool real
   bool in_heap = heap_.contains(s);
 
   float w;
-  uint32_t h = 0;
+  CountSketch::Handle h;
   if (in_heap) {
     w = heap_.get(s);
   } else {
-    h = strings_to_key(a, b);
+    sk_.locate(strings_to_key(a, b), h);
     w = sk_.get(h);
   }
 
@@ -86,13 +165,14 @@ void StreamingSGNS::update(const std::string& a, const std::string& b, bool real
   if (in_heap) {
     heap_.change_val(s, w - u);
   } else {
-    auto opt = heap_.insert(s, w - u);
+    auto opt = heap_.insert(s, w - u, h);
     if (opt) {
+      // the evicted pair is written back through its stored handle without rehashing
+      const CountSketch::Handle& popped_h = heap_.evicted_aux();
       if (s == opt->first) {
-        sk_.update(h, -u);
+        sk_.add(popped_h, -u);
       } else {
-        uint32_t popped_h = strings_to_key(opt->first.first, opt->first.second);
-        sk_.update(popped_h, opt->second - sk_.get(popped_h));
+        sk_.set_estimate(popped_h, opt->second);
       }
     }
   }
@@ -116,6 +196,73 @@ void StreamingSGNS::flush() {
   }
 }
 
+void StreamingSGNS::save(const std::string& path) {
+  CheckpointWriter out(path, "sgns");
+  SGNSConfig conf = {heap_.capacity(), window_size_, neg_samples_, seed_, lr_init_, l2_reg_};
+  SGNSState state = {t_, bias_, scale_};
+  out.write_value(checkpoint_tag("SGNC"), conf);
+  out.write_value(checkpoint_tag("SGNS"), state);
+  save_rng(out, checkpoint_tag("SRNG"), gen_);
+  reservoir_.save(out);
+  sk_.save(out);
+
+  // heap pairs are stored as alternating strings, in heap order
+  std::vector<StringPair> keys;
+  std::vector<std::string> pairs;
+  std::vector<float> vals;
+  heap_.keys(keys);
+  for (const auto& s : keys) {
+    pairs.push_back(s.first);
+    pairs.push_back(s.second);
+    vals.push_back(heap_.get(s));
+  }
+  out.write_strings(checkpoint_tag("HPRS"), pairs);
+  out.write_vector(checkpoint_tag("HVAL"), vals);
+  out.write_strings(checkpoint_tag("SWIN"), std::vector<std::string>(window_.begin(), window_.end()));
+  out.commit();
+}
+
+void StreamingSGNS::load(const std::string& path) {
+  if (t_ > 0 || !window_.empty()) {
+    throw std::runtime_error("Checkpoint must be loaded before the first update");
+  }
+
+  CheckpointReader in(path);
+  in.expect_model("sgns");
+  SGNSConfig conf;
+  SGNSState state;
+  in.read_value(checkpoint_tag("SGNC"), conf);
+  if (conf.k != heap_.capacity() || conf.window_size != window_size_ || conf.neg_samples != neg_samples_
+      || conf.seed != seed_ || conf.lr_init != lr_init_ || conf.l2_reg != l2_reg_) {
+    throw std::runtime_error("Checkpoint does not match the model configuration");
+  }
+  in.read_value(checkpoint_tag("SGNS"), state);
+  load_rng(in, checkpoint_tag("SRNG"), gen_);
+  reservoir_.load(in);
+  sk_.load(in);
+
+  std::vector<std::string> pairs, window;
+  std::vector<float> vals;
+  in.read_strings(checkpoint_tag("HPRS"), pairs);
+  in.read_vector(checkpoint_tag("HVAL"), vals);
+  in.read_strings(checkpoint_tag("SWIN"), window);
+  if (pairs.size() != 2 * vals.size() || vals.size() > heap_.capacity() || window.size() > window_size_ + 1) {
+    throw std::runtime_error("Malformed checkpoint record");
+  }
+  in.finish();
+
+  for (size_t i = 0; i < vals.size(); i++) {
+    StringPair s(pairs[2*i], pairs[2*i + 1]);
+    CountSketch::Handle h;
+    sk_.locate(strings_to_key(s.first, s.second), h);
+    heap_.insert(s, vals[i], h);
+  }
+  window_.assign(window.begin(), window.end());
+  t_ = state.t;
+  bias_ = state.bias;
+  scale_ = state.scale;
+}
+
 uint32_t StreamingSGNS::strings_to_key(const std::string& a, const std::string& b) {
   uint32_t h1 = hash::murmurhash3_32(a.data(), (int) a.length(), (uint32_t) seed_);
   uint32_t h2 = hash::murmurhash3_32(b.data(), (int) b.length(), (uint32_t) seed_);
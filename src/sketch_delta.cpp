@@ -0,0 +1,161 @@
+#include "sketch_delta.h"
+#include "util.h"
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace wmsketch {
+
+namespace {
+
+static const char DELTA_MAGIC[4] = {'W', 'M', 'S', 'D'};
+static const uint32_t DELTA_QUANTIZED = 1;
+
+struct DeltaHeader {
+  char magic[4];
+  uint32_t flags;
+  uint32_t depth;
+  uint32_t log2_width;
+  uint64_t steps;
+  float decay;
+  float bias;
+  uint64_t nnz;
+};
+
+static_assert(sizeof(DeltaHeader) == 40, "Unexpected delta header layout");
+
+void put_varint(std::string& out, uint32_t x) {
+  while (x >= 0x80) {
+    out.push_back((char) (x | 0x80));
+    x >>= 7;
+  }
+  out.push_back((char) x);
+}
+
+template <class T>
+void put(std::string& out, const T& val) {
+  out.append((const char*) &val, sizeof(T));
+}
+
+class Input {
+ private:
+  const char* p_;
+  const char* end_;
+
+ public:
+  Input(const char* data, size_t size) : p_{data}, end_{data + size} { }
+
+  uint32_t varint() {
+    uint32_t x = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      if (p_ == end_) throw std::runtime_error("Truncated sketch delta");
+      uint8_t b = (uint8_t) *p_++;
+      x |= (uint32_t) (b & 0x7f) << shift;
+      if (!(b & 0x80)) return x;
+    }
+    throw std::runtime_error("Malformed sketch delta");
+  }
+
+  template <class T>
+  void get(T& val) {
+    get(&val, sizeof(T));
+  }
+
+  void get(void* out, size_t n) {
+    if ((size_t) (end_ - p_) < n) throw std::runtime_error("Truncated sketch delta");
+    memcpy(out, p_, n);
+    p_ += n;
+  }
+
+  bool done() const {
+    return p_ == end_;
+  }
+};
+
+} // namespace
+
+const uint32_t SketchDelta::QUANT_GROUP;
+
+void SketchDelta::encode(std::string& out, bool quantize) const {
+  if (indices.size() != values.size()) throw std::invalid_argument("Mismatched delta indices and values");
+  DeltaHeader h;
+  memcpy(h.magic, DELTA_MAGIC, sizeof(h.magic));
+  h.flags = quantize ? DELTA_QUANTIZED : 0;
+  h.depth = depth;
+  h.log2_width = log2_width;
+  h.steps = steps;
+  h.decay = decay;
+  h.bias = bias;
+  h.nnz = indices.size();
+
+  out.clear();
+  out.reserve(sizeof(h) + indices.size() * (quantize ? 3 : 6));
+  put(out, h);
+  uint32_t prev = 0;
+  for (size_t i = 0; i < indices.size(); i++) {
+    if (i > 0 && indices[i] <= prev) throw std::invalid_argument("Delta indices must be in ascending order");
+    put_varint(out, indices[i] - prev);
+    prev = indices[i];
+  }
+
+  if (!quantize) {
+    out.append((const char*) values.data(), values.size() * sizeof(float));
+    return;
+  }
+  for (size_t start = 0; start < values.size(); start += QUANT_GROUP) {
+    size_t end = MIN(start + QUANT_GROUP, values.size());
+    float max = 0.f;
+    for (size_t i = start; i < end; i++) {
+      max = MAX(max, fabsf(values[i]));
+    }
+    float s = (max > 0.f) ? max / 127.f : 1.f;
+    put(out, s);
+    for (size_t i = start; i < end; i++) {
+      out.push_back((char) (int8_t) lrintf(values[i] / s));
+    }
+  }
+}
+
+void SketchDelta::decode(const char* data, size_t size) {
+  Input in(data, size);
+  DeltaHeader h;
+  in.get(h);
+  if (memcmp(h.magic, DELTA_MAGIC, sizeof(h.magic)) != 0) throw std::runtime_error("Not a sketch delta");
+  // every entry takes at least two bytes, which bounds the allocation below
+  if (h.nnz > size / 2) throw std::runtime_error("Malformed sketch delta");
+
+  depth = h.depth;
+  log2_width = h.log2_width;
+  steps = h.steps;
+  decay = h.decay;
+  bias = h.bias;
+  indices.resize(h.nnz);
+  values.resize(h.nnz);
+
+  uint64_t idx = 0;
+  for (uint64_t i = 0; i < h.nnz; i++) {
+    uint32_t gap = in.varint();
+    if (i > 0 && gap == 0) throw std::runtime_error("Malformed sketch delta");
+    idx += gap;
+    if (idx > UINT32_MAX) throw std::runtime_error("Malformed sketch delta");
+    indices[i] = (uint32_t) idx;
+  }
+
+  if (!(h.flags & DELTA_QUANTIZED)) {
+    in.get(values.data(), values.size() * sizeof(float));
+  } else {
+    for (uint64_t start = 0; start < h.nnz; start += QUANT_GROUP) {
+      uint64_t end = MIN(start + QUANT_GROUP, h.nnz);
+      float s;
+      in.get(s);
+      for (uint64_t i = start; i < end; i++) {
+        int8_t q;
+        in.get(q);
+        values[i] = q * s;
+      }
+    }
+  }
+  if (!in.done()) throw std::runtime_error("Malformed sketch delta");
+}
+
+} // namespace wmsketch
@@ -0,0 +1,55 @@
+#include "stats.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace wmsketch {
+namespace stats {
+
+thread_local Counters* local = nullptr;
+
+namespace {
+
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<Counters> > registry;
+
+static const char* NAMES[NUM_COUNTERS] = {
+    "hashes",
+    "cells",
+    "heap_inserts",
+    "heap_evictions",
+    "heap_rejections",
+    "writebacks",
+    "medians",
+    "duplicate_keys",
+};
+
+} // namespace
+
+Counters* register_thread() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.emplace_back(new Counters());
+  local = registry.back().get();
+  return local;
+}
+
+const char* name(Counter c) {
+  return NAMES[c];
+}
+
+std::map<std::string, uint64_t> totals() {
+  std::map<std::string, uint64_t> out;
+  if (!ENABLED) return out;
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    uint64_t sum = 0;
+    for (auto& s : registry) {
+      sum += s->counts[c].load(std::memory_order_relaxed);
+    }
+    out[NAMES[c]] = sum;
+  }
+  return out;
+}
+
+} // namespace stats
+} // namespace wmsketch
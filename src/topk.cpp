@@ -1,9 +1,39 @@
 #include "topk.h"
 #include "util.h"
+#include "stats.h"
 #include <iostream>
 
 namespace wmsketch {
 
+namespace {
+
+// heap items are saved in heap order, so that reinserting them in order rebuilds the same heap
+template <class Heap>
+void save_heap(CheckpointWriter& out, Heap& heap) {
+  std::vector<uint32_t> keys;
+  heap.keys(keys);
+  std::vector<float> vals(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    vals[i] = heap.get(keys[i]);
+  }
+  out.write_vector(checkpoint_tag("HKEY"), keys);
+  out.write_vector(checkpoint_tag("HVAL"), vals);
+}
+
+template <class Insert>
+void load_heap(CheckpointReader& in, uint32_t k, Insert insert) {
+  std::vector<uint32_t> keys;
+  std::vector<float> vals;
+  in.read_vector(checkpoint_tag("HKEY"), keys);
+  in.read_vector(checkpoint_tag("HVAL"), vals);
+  if (keys.size() != vals.size() || keys.size() > k) throw std::runtime_error("Malformed checkpoint record");
+  for (size_t i = 0; i < keys.size(); i++) {
+    insert(keys[i], vals[i]);
+  }
+}
+
+} // namespace
+
 LogisticTopK::LogisticTopK(uint32_t k, uint32_t dim, float lr_init, float l2_reg, bool no_bias)
  : TopKFeatures(k),
    lr_(dim, lr_init, l2_reg, no_bias) { }
@@ -39,13 +69,14 @@ TruncatedLogisticTopK::TruncatedLogisticTopK(uint32_t k, float lr_init, float l2
 
 TruncatedLogisticTopK::~TruncatedLogisticTopK() = default;
 
-void TruncatedLogisticTopK::topk(std::vector<std::pair<uint32_t, float> >& out) {
+void TruncatedLogisticTopK::topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
+  if (cached_topk(heap_.version(), scale_, out, n)) return;
   heap_.items(out);
   for (auto &i : out) {
     i.second *= scale_;
   }
-  std::sort(out.begin(), out.end(),
-      [](auto& a, auto& b) { return fabs(a.second) > fabs(b.second); });
+  select_topk(out, n);
+  cache_topk(heap_.version(), scale_, out, n);
 }
 
 float TruncatedLogisticTopK::get_weight(uint32_t key) {
@@ -110,13 +141,14 @@ ProbTruncatedLogisticTopK::ProbTruncatedLogisticTopK(
 
 ProbTruncatedLogisticTopK::~ProbTruncatedLogisticTopK() = default;
 
-void ProbTruncatedLogisticTopK::topk(std::vector<std::pair<uint32_t, float> > &out) {
+void ProbTruncatedLogisticTopK::topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
+  if (cached_topk(res_.version(), scale_, out, n)) return;
   res_.items(out);
   for (auto &i : out) {
     i.second *= scale_;
   }
-  std::sort(out.begin(), out.end(),
-      [](auto& a, auto& b) { return fabs(a.second) > fabs(b.second); });
+  select_topk(out, n);
+  cache_topk(res_.version(), scale_, out, n);
 }
 
 float ProbTruncatedLogisticTopK::dot(const std::vector<std::pair<uint32_t, float> > &x) {
@@ -188,13 +220,14 @@ float SpaceSavingLogisticTopK::get_weight(uint32_t key) {
   return 0.f;
 }
 
-void SpaceSavingLogisticTopK::topk(std::vector<std::pair<uint32_t, float> >& out) {
+void SpaceSavingLogisticTopK::topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
+  if (cached_topk(cheap_.version(), scale_, out, n)) return;
   cheap_.items(out);
   for (auto &i : out) {
     i.second *= scale_;
   }
-  std::sort(out.begin(), out.end(),
-      [](auto& a, auto& b) { return fabs(a.second) > fabs(b.second); });
+  select_topk(out, n);
+  cache_topk(cheap_.version(), scale_, out, n);
 }
 
 float SpaceSavingLogisticTopK::dot(const std::vector<std::pair<uint32_t, float> >& x) {
@@ -260,7 +293,8 @@ float SpaceSavingLogisticTopK::bias() {
 
 ///////////////////////////////////////////////////////////////////////////////
 
-CountMinLogisticTopK::CountMinLogisticTopK(
+template <class Counter>
+BasicCountMinLogisticTopK<Counter>::BasicCountMinLogisticTopK(
     uint32_t k,
     uint32_t log2_width,
     uint32_t depth,
@@ -277,23 +311,27 @@ CountMinLogisticTopK::CountMinLogisticTopK(
    scale_{1.f},
    t_{0} { }
 
-float CountMinLogisticTopK::get_weight(uint32_t key) {
+template <class Counter>
+float BasicCountMinLogisticTopK<Counter>::get_weight(uint32_t key) {
   if (cheap_.contains(key)) {
     return cheap_.get(key);
   }
   return 0.f;
 }
 
-void CountMinLogisticTopK::topk(std::vector<std::pair<uint32_t, float> >& out) {
+template <class Counter>
+void BasicCountMinLogisticTopK<Counter>::topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
+  if (cached_topk(cheap_.version(), scale_, out, n)) return;
   cheap_.items(out);
   for (auto &i : out) {
     i.second *= scale_;
   }
-  std::sort(out.begin(), out.end(),
-      [](auto& a, auto& b) { return fabs(a.second) > fabs(b.second); });
+  select_topk(out, n);
+  cache_topk(cheap_.version(), scale_, out, n);
 }
 
-float CountMinLogisticTopK::dot(const std::vector<std::pair<uint32_t, float> >& x) {
+template <class Counter>
+float BasicCountMinLogisticTopK<Counter>::dot(const std::vector<std::pair<uint32_t, float> >& x) {
   float z = 0.f;
   for (auto& pair : x) {
     uint32_t key = pair.first;
@@ -304,28 +342,35 @@ float CountMinLogisticTopK::dot(const std::vector<std::pair<uint32_t, float> >&
   return z;
 }
 
-bool CountMinLogisticTopK::predict(const std::vector<std::pair<uint32_t, float> >& x) {
+template <class Counter>
+bool BasicCountMinLogisticTopK<Counter>::predict(const std::vector<std::pair<uint32_t, float> >& x) {
   float z = dot(x) + bias_;
   return z >= 0;
 }
 
-bool CountMinLogisticTopK::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
+template <class Counter>
+bool BasicCountMinLogisticTopK<Counter>::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
+  // with merged duplicates, a key is counted once per example
+  const auto& xs = (dedup_ && coalescer_.coalesce(x)) ? coalescer_.features() : x;
   int y = label ? +1 : -1;
   float lr = lr_init_ / (1.f + lr_init_ * l2_reg_ * t_);
-  float z = dot(x) + bias_;
+  float z = dot(xs) + bias_;
   scale_ *= (1 - lr * l2_reg_);
   float g = logistic_grad(y * z);
-  for (auto& pair : x) {
+  key_buf_.clear();
+  for (auto& pair : xs) {
     uint32_t key = pair.first;
     if (cheap_.contains(key)) cheap_.increment_count(key);
-    sk_.update(key);
+    key_buf_.push_back(key);
   }
+  count_buf_.resize(key_buf_.size());
+  sk_.update_batch(key_buf_.data(), key_buf_.size(), count_buf_.data());
 
-  for (auto& pair : x) {
-    uint32_t key = pair.first;
-    float val = pair.second;
+  for (size_t i = 0; i < xs.size(); i++) {
+    uint32_t key = xs[i].first;
+    float val = xs[i].second;
     float new_w = get_weight(key) - lr * y * g * val / scale_;
-    uint32_t count = (cheap_.contains(key)) ? cheap_.get_count(key) : sk_.get(key);
+    uint32_t count = (cheap_.contains(key)) ? cheap_.get_count(key) : count_buf_[i];
     cheap_.insert_or_change(key, count, new_w);
   }
 
@@ -334,13 +379,20 @@ bool CountMinLogisticTopK::update(const std::vector<std::pair<uint32_t, float> >
   return z >= 0;
 }
 
-float CountMinLogisticTopK::bias() {
+template <class Counter>
+float BasicCountMinLogisticTopK<Counter>::bias() {
   return bias_;
 }
 
+template <class Counter>
+uint64_t BasicCountMinLogisticTopK<Counter>::sketch_bytes() {
+  return sk_.size_bytes();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
-PairedCountMinTopK::PairedCountMinTopK(
+template <class Counter>
+BasicPairedCountMinTopK<Counter>::BasicPairedCountMinTopK(
     uint32_t k,
     uint32_t log2_width,
     uint32_t depth,
@@ -351,43 +403,57 @@ PairedCountMinTopK::PairedCountMinTopK(
    sk_(log2_width, depth, seed + 1, smooth, consv_update),
    t_{0} { }
 
-PairedCountMinTopK::~PairedCountMinTopK() = default;
+template <class Counter>
+BasicPairedCountMinTopK<Counter>::~BasicPairedCountMinTopK() = default;
 
-void PairedCountMinTopK::topk(std::vector<std::pair<uint32_t, float> >& out) {
+template <class Counter>
+void BasicPairedCountMinTopK<Counter>::topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
   refresh_heap();
-  TopKFeatures::topk(out);
+  TopKFeatures::topk(out, n);
 }
 
-bool PairedCountMinTopK::predict(const std::vector<std::pair<uint32_t, float> >& x) {
+template <class Counter>
+bool BasicPairedCountMinTopK<Counter>::predict(const std::vector<std::pair<uint32_t, float> >& x) {
   // TODO
   return true;
 }
 
-bool PairedCountMinTopK::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
+template <class Counter>
+bool BasicPairedCountMinTopK<Counter>::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
   sk_.update(new_weights_, x, label);
   for (int i = 0; i < x.size(); i++) {
     uint32_t key = x[i].first;
     heap_.insert_or_change(key, log(new_weights_[i]));
   }
 
+  t_++;
   // TODO
   return true;
 }
 
-void PairedCountMinTopK::refresh_heap() {
-  heap_.keys(idxs_);
-  for (uint32_t idx : idxs_) {
-    heap_.change_val(idx, log(sk_.get(idx)));
+template <class Counter>
+void BasicPairedCountMinTopK<Counter>::refresh_heap() {
+  if (!start_refresh(t_)) return;
+  for (size_t i = 0; i < refresh_keys_.size(); i++) {
+    refresh_vals_[i] = log(sk_.get(refresh_keys_[i]));
   }
+  finish_refresh();
 }
 
-float PairedCountMinTopK::bias() {
+template <class Counter>
+float BasicPairedCountMinTopK<Counter>::bias() {
   return sk_.bias();
 }
 
+template <class Counter>
+uint64_t BasicPairedCountMinTopK<Counter>::sketch_bytes() {
+  return sk_.size_bytes();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
-LogisticSketchTopK::LogisticSketchTopK(
+template <class Cell>
+BasicLogisticSketchTopK<Cell>::BasicLogisticSketchTopK(
     uint32_t k,
     uint32_t log2_width,
     uint32_t depth,
@@ -397,47 +463,193 @@ LogisticSketchTopK::LogisticSketchTopK(
     bool median_update)
  : TopKFeatures(k),
    sk_(log2_width, depth, seed, lr_init, l2_reg, median_update),
-   t_{0} { }
+   t_{0},
+   checkpoint_t_{0} { }
 
-LogisticSketchTopK::~LogisticSketchTopK() = default;
+template <class Cell>
+BasicLogisticSketchTopK<Cell>::BasicLogisticSketchTopK(BasicLogisticSketchTopK& other)
+ : TopKFeatures(other.k_),
+   sk_(other.sk_),
+   t_{other.t_},
+   checkpoint_t_{other.checkpoint_t_} {
+  heap_ = other.heap_;
+  refresh_budget_ = other.refresh_budget_;
+  dedup_ = other.dedup_;
+}
+
+template <class Cell>
+BasicLogisticSketchTopK<Cell>::~BasicLogisticSketchTopK() = default;
 
-void LogisticSketchTopK::topk(std::vector<std::pair<uint32_t, float> >& out) {
+template <class Cell>
+void BasicLogisticSketchTopK<Cell>::topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
   refresh_heap();
-  TopKFeatures::topk(out);
   float s = sk_.scale();
+  if (cached_topk(heap_.version(), s, out, n)) return;
+  heap_.items(out);
+  select_topk(out, n);
   for (auto& i : out) {
     i.second *= s;
   }
+  cache_topk(heap_.version(), s, out, n);
 }
 
-bool LogisticSketchTopK::predict(const std::vector<std::pair<uint32_t, float> >& x) {
+template <class Cell>
+bool BasicLogisticSketchTopK<Cell>::predict(const std::vector<std::pair<uint32_t, float> >& x) {
   return sk_.predict(x);
 }
 
-bool LogisticSketchTopK::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
-  bool yhat = sk_.update(new_weights_, x, label);
-  for (int i = 0; i < x.size(); i++) {
-    uint32_t key = x[i].first;
+template <class Cell>
+void BasicLogisticSketchTopK<Cell>::predict_batch(const CSR& x, float* margins_out) {
+  sk_.predict_batch(x, margins_out);
+}
+
+template <class Cell>
+bool BasicLogisticSketchTopK<Cell>::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
+  renormalize();
+  const auto& xs = (dedup_ && coalescer_.coalesce(x)) ? coalescer_.features() : x;
+  bool yhat = sk_.update(new_weights_, xs, label);
+  for (int i = 0; i < xs.size(); i++) {
+    uint32_t key = xs[i].first;
     heap_.insert_or_change(key, new_weights_[i]);
   }
   t_++;
   return yhat;
 }
 
-float LogisticSketchTopK::bias() {
+template <class Cell>
+void BasicLogisticSketchTopK<Cell>::update_batch(std::vector<bool>& yhat, const CSR& x, const std::vector<bool>& labels) {
+  renormalize();
+  sk_.update_batch(yhat, batch_weights_, x, labels);
+  for (const auto& p : batch_weights_) {
+    heap_.insert_or_change(p.first, p.second);
+  }
+  t_ += x.rows();
+}
+
+template <class Cell>
+bool BasicLogisticSketchTopK<Cell>::batched_updates() {
+  return true;
+}
+
+template <class Cell>
+float BasicLogisticSketchTopK<Cell>::bias() {
   return sk_.bias();
 }
 
-void LogisticSketchTopK::refresh_heap() {
+template <class Cell>
+std::shared_ptr<const FrozenModel> BasicLogisticSketchTopK<Cell>::freeze(bool quantize) {
   heap_.keys(idxs_);
-  for (uint32_t idx : idxs_) {
-    heap_.change_val(idx, sk_.get(idx));
+  return sk_.freeze(idxs_, quantize);
+}
+
+template <class Cell>
+uint64_t BasicLogisticSketchTopK<Cell>::sketch_bytes() {
+  return sk_.size_bytes();
+}
+
+template <class Cell>
+bool BasicLogisticSketchTopK<Cell>::set_decay(float half_life, DecayClock clock) {
+  sk_.set_decay(half_life, clock);
+  return true;
+}
+
+template <class Cell>
+bool BasicLogisticSketchTopK<Cell>::set_window(uint64_t period) {
+  sk_.set_window(period);
+  return true;
+}
+
+template <class Cell>
+bool BasicLogisticSketchTopK<Cell>::save(const std::string& path) {
+  CheckpointWriter out(path, std::string("logistic_sketch/") + Cell::name());
+  uint64_t state[2] = {k_, t_};
+  out.write(checkpoint_tag("TOPK"), state, sizeof(state));
+  sk_.save(out);
+  save_heap(out, heap_);
+  out.commit();
+  sk_.mark_clean();
+  checkpoint_t_ = t_;
+  return true;
+}
+
+template <class Cell>
+bool BasicLogisticSketchTopK<Cell>::load(const std::string& path) {
+  if (t_ > 0) throw std::runtime_error("Checkpoint must be loaded before the first update");
+  CheckpointReader in(path);
+  in.expect_model(std::string("logistic_sketch/") + Cell::name());
+  uint64_t state[2];
+  in.read(checkpoint_tag("TOPK"), state, sizeof(state));
+  if (state[0] != k_) throw std::runtime_error("Checkpoint does not match the model configuration");
+  sk_.load(in);
+  load_heap(in, k_, [this](uint32_t key, float val) { heap_.insert(key, val); });
+  in.finish();
+  t_ = state[1];
+  checkpoint_t_ = t_;
+  return true;
+}
+
+template <class Cell>
+bool BasicLogisticSketchTopK<Cell>::save_delta(const std::string& path) {
+  CheckpointWriter out(path, std::string("logistic_sketch/") + Cell::name() + "/delta");
+  uint64_t state[3] = {k_, checkpoint_t_, t_};
+  out.write(checkpoint_tag("TOPD"), state, sizeof(state));
+  sk_.save_delta(out);
+  save_heap(out, heap_);
+  out.commit();
+  sk_.mark_clean();
+  checkpoint_t_ = t_;
+  return true;
+}
+
+template <class Cell>
+bool BasicLogisticSketchTopK<Cell>::load_delta(const std::string& path) {
+  CheckpointReader in(path);
+  in.expect_model(std::string("logistic_sketch/") + Cell::name() + "/delta");
+  uint64_t state[3];
+  in.read(checkpoint_tag("TOPD"), state, sizeof(state));
+  if (state[0] != k_) throw std::runtime_error("Checkpoint does not match the model configuration");
+  if (state[1] != t_ || t_ != checkpoint_t_) {
+    throw std::runtime_error("Delta checkpoint does not follow the current model state");
   }
+  sk_.load_delta(in);
+  heap_.clear();
+  load_heap(in, k_, [this](uint32_t key, float val) { heap_.insert(key, val); });
+  in.finish();
+  t_ = state[2];
+  checkpoint_t_ = t_;
+  return true;
+}
+
+template <class Cell>
+std::unique_ptr<TopKFeatures> BasicLogisticSketchTopK<Cell>::fork() {
+  return std::unique_ptr<TopKFeatures>(new BasicLogisticSketchTopK(*this));
+}
+
+template <class Cell>
+void BasicLogisticSketchTopK<Cell>::renormalize() {
+  // renormalize ahead of the sketch so that the unscaled heap weights can be rescaled with it
+  if (sk_.scale() < BasicLogisticSketch<Cell>::MIN_SCALE) {
+    heap_.scale_vals(sk_.renormalize());
+  }
+}
+
+template <class Cell>
+void BasicLogisticSketchTopK<Cell>::refresh_heap() {
+  if (!start_refresh(t_)) return;
+  sk_.get_batch(refresh_keys_.data(), refresh_keys_.size(), refresh_vals_.data());
+
+  // heap weights are unscaled, like those written by update()
+  float s = sk_.scale();
+  for (float& v : refresh_vals_) {
+    v /= s;
+  }
+  finish_refresh();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-ActiveSetLogisticTopK::ActiveSetLogisticTopK(
+template <class Cell>
+BasicActiveSetLogisticTopK<Cell>::BasicActiveSetLogisticTopK(
     uint32_t k,
     uint32_t log2_width,
     uint32_t depth,
@@ -446,40 +658,67 @@ ActiveSetLogisticTopK::ActiveSetLogisticTopK(
     float l2_reg)
  : TopKFeatures(k),
    sk_(log2_width, depth, seed),
+   active_(k),
    bias_{0.f},
    lr_init_{lr_init},
    l2_reg_{l2_reg},
    scale_{1.f},
-   t_{0} { }
-
-ActiveSetLogisticTopK::~ActiveSetLogisticTopK() = default;
-
-void ActiveSetLogisticTopK::topk(std::vector<std::pair<uint32_t, float> >& out) {
-  heap_.items(out);
-  for (auto& i : out) {
+   t_{0},
+   checkpoint_t_{0} { }
+
+template <class Cell>
+BasicActiveSetLogisticTopK<Cell>::BasicActiveSetLogisticTopK(BasicActiveSetLogisticTopK& other)
+ : TopKFeatures(other.k_),
+   sk_(other.sk_),
+   active_(other.active_),
+   bias_{other.bias_},
+   lr_init_{other.lr_init_},
+   l2_reg_{other.l2_reg_},
+   scale_{other.scale_},
+   t_{other.t_},
+   checkpoint_t_{other.checkpoint_t_} {
+  refresh_budget_ = other.refresh_budget_;
+  dedup_ = other.dedup_;
+}
+
+template <class Cell>
+BasicActiveSetLogisticTopK<Cell>::~BasicActiveSetLogisticTopK() = default;
+
+template <class Cell>
+void BasicActiveSetLogisticTopK<Cell>::topk(std::vector<std::pair<uint32_t, float> >& out, uint32_t n) {
+  if (cached_topk(active_.version(), scale_, out, n)) return;
+  active_.items(out);
+  for (auto &i : out) {
     i.second *= scale_;
   }
-  std::sort(out.begin(), out.end(),
-      [](auto& a, auto& b) { return fabs(a.second) > fabs(b.second); });
+  select_topk(out, n);
+  cache_topk(active_.version(), scale_, out, n);
 }
 
-float ActiveSetLogisticTopK::dot(const std::vector<std::pair<uint32_t, float> >& x) {
+template <class Cell>
+float BasicActiveSetLogisticTopK<Cell>::dot(const std::vector<std::pair<uint32_t, float> >& x) {
   float z = 0.f;
   heap_feats_.clear();
   sk_feats_.clear();
+  sk_handles_.clear();
   weight_buf_.clear();
 
   uint32_t idx;
   float val, w;
   if (x.empty()) return z;
-  for (const auto &i : x) {
+  const auto& xs = (dedup_ && coalescer_.coalesce(x)) ? coalescer_.features() : x;
+  for (const auto &i : xs) {
     std::tie(idx, val) = i;
-    if (heap_.contains(idx)) {
-      w = heap_.get(idx);
+    if (active_.contains(idx)) {
+      w = active_.get(idx);
       heap_feats_.push_back(std::make_tuple(idx, val, w));
     } else {
-      w = sk_.get(idx);
-      sk_feats_.push_back(std::make_tuple(idx, val, w));
+      // keep the key's handle for writing back to the sketch in update()
+      uint32_t slot = sk_handles_.size();
+      sk_handles_.emplace_back();
+      sk_.locate(idx, sk_handles_[slot]);
+      w = sk_.get(sk_handles_[slot]);
+      sk_feats_.push_back(std::make_tuple(idx, val, w, slot));
     }
     z += w * val;
     weight_buf_.push_back(w);
@@ -488,12 +727,48 @@ float ActiveSetLogisticTopK::dot(const std::vector<std::pair<uint32_t, float> >&
   return z;
 }
 
-bool ActiveSetLogisticTopK::predict(const std::vector<std::pair<uint32_t, float> >& x) {
+template <class Cell>
+bool BasicActiveSetLogisticTopK<Cell>::predict(const std::vector<std::pair<uint32_t, float> >& x) {
   float z = dot(x) + bias_;
   return z >= 0.;
 }
 
-bool ActiveSetLogisticTopK::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
+template <class Cell>
+void BasicActiveSetLogisticTopK<Cell>::predict_batch(const CSR& x, float* margins_out) {
+  uint64_t n = x.rows();
+  uint64_t nnz = x.nnz();
+
+  // features in the active set are read from the heap; the rest are gathered from the sketch in one batch
+  weight_buf_.resize(nnz);
+  sk_keys_.clear();
+  sk_pos_.clear();
+  for (uint64_t j = 0; j < nnz; j++) {
+    uint32_t idx = x.indices[j];
+    if (active_.contains(idx)) {
+      weight_buf_[j] = active_.get(idx);
+    } else {
+      sk_keys_.push_back(idx);
+      sk_pos_.push_back(j);
+    }
+  }
+
+  sk_weights_.resize(sk_keys_.size());
+  sk_.get_batch(sk_keys_.data(), sk_keys_.size(), sk_weights_.data());
+  for (size_t s = 0; s < sk_pos_.size(); s++) {
+    weight_buf_[sk_pos_[s]] = sk_weights_[s];
+  }
+
+  for (uint64_t r = 0; r < n; r++) {
+    float z = 0.f;
+    for (uint64_t j = x.indptr[r]; j < x.indptr[r+1]; j++) {
+      z += weight_buf_[j] * x.values[j];
+    }
+    margins_out[r] = z * scale_ + bias_;
+  }
+}
+
+template <class Cell>
+bool BasicActiveSetLogisticTopK<Cell>::update(const std::vector<std::pair<uint32_t, float> >& x, bool label) {
   if (x.empty()) return bias_ >= 0;
   int y = label ? +1 : -1;
   float lr = lr_init_ / (1.f + lr_init_ * l2_reg_ * t_);
@@ -507,32 +782,51 @@ bool ActiveSetLogisticTopK::update(const std::vector<std::pair<uint32_t, float>
   float val, w;
   for (auto& tup : heap_feats_) {
     std::tie(idx, val, w) = tup;
-    heap_.change_val(idx, w - u * val);
+    active_.change_val(idx, w - u * val);
   }
 
   for (auto& tup : sk_feats_) {
-    std::tie(idx, val, w) = tup;
-    float new_w = w - u * val;
-    std::get<2>(tup) = new_w;
+    std::get<2>(tup) -= u * std::get<1>(tup);
   }
 
-  std::sort(sk_feats_.begin(), sk_feats_.end(),
-      [](auto& a, auto& b) { return fabs(std::get<2>(a)) > fabs(std::get<2>(b)); });
+  auto by_mag = [](auto& a, auto& b) { return fabs(std::get<2>(a)) > fabs(std::get<2>(b)); };
+  auto first = sk_feats_.begin();
+  auto last = sk_feats_.end();
 
-  for (auto& tup : sk_feats_) {
-    uint32_t popped_idx;
-    float popped_w;
-    std::tie(idx, val, w) = tup;
+  // candidates that fit in free slots are admitted without eviction, in any order
+  if (!active_.is_full()) {
+    auto top = first + MIN((uint64_t) (k_ - active_.size()), sk_feats_.size());
+    if (top != last) std::nth_element(first, top, last, by_mag);
+    for (; first != top; ++first) {
+      active_.insert(std::get<0>(*first), std::get<2>(*first), sk_handles_[std::get<3>(*first)]);
+    }
+  }
+
+  // admission never lowers the heap minimum, so candidates below it can only be rejected and need no ordering
+  if (first != last) {
+    float min_w = fabs(active_.min_val());
+    last = std::partition(first, last, [min_w](auto& a) { return fabs(std::get<2>(a)) >= min_w; });
+    std::sort(first, last, by_mag);
+  }
 
-    auto opt = heap_.insert(idx, w);
+  // evicted weights are written back in one pass after admission, followed by the updates of rejected candidates
+  evict_handles_.clear();
+  evict_weights_.clear();
+  for (; first != last; ++first) {
+    uint32_t slot;
+    std::tie(idx, val, w, slot) = *first;
+
+    auto opt = active_.insert(idx, w, sk_handles_[slot]);
     if (!opt) continue;
-    std::tie(popped_idx, popped_w) = *opt;
+    if (opt->first == idx) break;  // the remaining candidates are smaller
+    evict_handles_.push_back(active_.evicted_aux());
+    evict_weights_.push_back(opt->second);
+  }
+  sk_.set_estimate_batch(evict_handles_.data(), evict_weights_.data(), evict_handles_.size());
+  WMSKETCH_COUNT(WRITEBACKS, evict_handles_.size());
 
-    if (idx == popped_idx) {
-      sk_.update(idx, -u * val);
-    } else {
-      sk_.update(popped_idx, popped_w - sk_.get(popped_idx));
-    }
+  for (; first != sk_feats_.end(); ++first) {
+    sk_.add(sk_handles_[std::get<3>(*first)], -u * std::get<1>(*first));
   }
 
   bias_ -= lr * y * g;
@@ -540,8 +834,128 @@ bool ActiveSetLogisticTopK::update(const std::vector<std::pair<uint32_t, float>
   return yhat;
 }
 
-float ActiveSetLogisticTopK::bias() {
+template <class Cell>
+float BasicActiveSetLogisticTopK<Cell>::bias() {
   return bias_;
 }
 
+template <class Cell>
+std::shared_ptr<const FrozenModel> BasicActiveSetLogisticTopK<Cell>::freeze(bool quantize) {
+  std::vector<std::pair<uint32_t, float> > items;
+  active_.items(items);
+  return sk_.freeze(items, scale_, bias_, quantize);
+}
+
+template <class Cell>
+uint64_t BasicActiveSetLogisticTopK<Cell>::sketch_bytes() {
+  return sk_.size_bytes();
+}
+
+template <class Cell>
+bool BasicActiveSetLogisticTopK<Cell>::save(const std::string& path) {
+  CheckpointWriter out(path, std::string("activeset_logistic/") + Cell::name());
+  uint64_t state[2] = {k_, t_};
+  float params[4] = {lr_init_, l2_reg_, bias_, scale_};
+  out.write(checkpoint_tag("TOPK"), state, sizeof(state));
+  out.write(checkpoint_tag("ASLS"), params, sizeof(params));
+  sk_.save(out);
+  save_heap(out, active_);
+  out.commit();
+  sk_.mark_clean();
+  checkpoint_t_ = t_;
+  return true;
+}
+
+template <class Cell>
+bool BasicActiveSetLogisticTopK<Cell>::load(const std::string& path) {
+  if (t_ > 0) throw std::runtime_error("Checkpoint must be loaded before the first update");
+  CheckpointReader in(path);
+  in.expect_model(std::string("activeset_logistic/") + Cell::name());
+  uint64_t state[2];
+  float params[4];
+  in.read(checkpoint_tag("TOPK"), state, sizeof(state));
+  in.read(checkpoint_tag("ASLS"), params, sizeof(params));
+  if (state[0] != k_ || params[0] != lr_init_ || params[1] != l2_reg_) {
+    throw std::runtime_error("Checkpoint does not match the model configuration");
+  }
+  sk_.load(in);
+
+  // handles are positions in the sketch, so they are recomputed rather than stored
+  load_heap(in, k_, [this](uint32_t key, float val) {
+    Handle h;
+    sk_.locate(key, h);
+    active_.insert(key, val, h);
+  });
+  in.finish();
+  t_ = state[1];
+  checkpoint_t_ = t_;
+  bias_ = params[2];
+  scale_ = params[3];
+  return true;
+}
+
+template <class Cell>
+bool BasicActiveSetLogisticTopK<Cell>::save_delta(const std::string& path) {
+  CheckpointWriter out(path, std::string("activeset_logistic/") + Cell::name() + "/delta");
+  uint64_t state[3] = {k_, checkpoint_t_, t_};
+  float params[4] = {lr_init_, l2_reg_, bias_, scale_};
+  out.write(checkpoint_tag("TOPD"), state, sizeof(state));
+  out.write(checkpoint_tag("ASLS"), params, sizeof(params));
+  sk_.save_delta(out);
+  save_heap(out, active_);
+  out.commit();
+  sk_.mark_clean();
+  checkpoint_t_ = t_;
+  return true;
+}
+
+template <class Cell>
+bool BasicActiveSetLogisticTopK<Cell>::load_delta(const std::string& path) {
+  CheckpointReader in(path);
+  in.expect_model(std::string("activeset_logistic/") + Cell::name() + "/delta");
+  uint64_t state[3];
+  float params[4];
+  in.read(checkpoint_tag("TOPD"), state, sizeof(state));
+  in.read(checkpoint_tag("ASLS"), params, sizeof(params));
+  if (state[0] != k_ || params[0] != lr_init_ || params[1] != l2_reg_) {
+    throw std::runtime_error("Checkpoint does not match the model configuration");
+  }
+  if (state[1] != t_ || t_ != checkpoint_t_) {
+    throw std::runtime_error("Delta checkpoint does not follow the current model state");
+  }
+  sk_.load_delta(in);
+  active_.clear();
+  load_heap(in, k_, [this](uint32_t key, float val) {
+    Handle h;
+    sk_.locate(key, h);
+    active_.insert(key, val, h);
+  });
+  in.finish();
+  t_ = state[2];
+  checkpoint_t_ = t_;
+  bias_ = params[2];
+  scale_ = params[3];
+  return true;
+}
+
+template <class Cell>
+std::unique_ptr<TopKFeatures> BasicActiveSetLogisticTopK<Cell>::fork() {
+  return std::unique_ptr<TopKFeatures>(new BasicActiveSetLogisticTopK(*this));
+}
+
+template class BasicLogisticSketchTopK<cell::Float32>;
+template class BasicLogisticSketchTopK<cell::BFloat16>;
+template class BasicLogisticSketchTopK<cell::Int16>;
+template class BasicLogisticSketchTopK<cell::Int8>;
+
+template class BasicActiveSetLogisticTopK<cell::Float32>;
+template class BasicActiveSetLogisticTopK<cell::BFloat16>;
+template class BasicActiveSetLogisticTopK<cell::Int16>;
+template class BasicActiveSetLogisticTopK<cell::Int8>;
+
+template class BasicCountMinLogisticTopK<counter::Uint32>;
+template class BasicCountMinLogisticTopK<counter::Uint8>;
+template class BasicPairedCountMinTopK<counter::Uint32>;
+template class BasicPairedCountMinTopK<counter::Uint8>;
+
 } // namespace wmsketch
@@ -1,4 +1,5 @@
 #include "util.h"
+#include "stats.h"
 #include <algorithm>
 #include <math.h>
 #include <numeric>
@@ -20,15 +21,22 @@ uint64_t toc(uint64_t s) {
 }
 
 float mean(const std::vector<float>& buf) {
-  size_t n = buf.size();
-  return std::accumulate(buf.begin(), buf.end(), 0.) / n;
+  return mean(buf.data(), buf.size());
+}
+
+float mean(const float* buf, size_t n) {
+  return std::accumulate(buf, buf + n, 0.) / n;
 }
 
 float median(std::vector<float>& buf) {
-  size_t n = buf.size();
-  std::nth_element(buf.begin(), buf.begin() + n/2, buf.end());
+  return median(buf.data(), buf.size());
+}
+
+float median(float* buf, size_t n) {
+  WMSKETCH_COUNT(MEDIANS, 1);
+  std::nth_element(buf, buf + n/2, buf + n);
   if (n % 2 == 1) return buf[n/2];
-  std::nth_element(buf.begin(), buf.begin() + n/2 - 1, buf.begin() + n/2);
+  std::nth_element(buf, buf + n/2 - 1, buf + n/2);
   return (buf[n/2 - 1] + buf[n/2]) / 2;
 }
 
@@ -0,0 +1,56 @@
+/*
+ * Minimal assertions for the test executables. A failed check prints its location and exits with a nonzero status.
+ */
+
+#ifndef TESTS_CHECK_H_
+#define TESTS_CHECK_H_
+
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+      exit(1); \
+    } \
+  } while (0)
+
+// check that evaluating expr throws an exception of type E
+#define CHECK_THROWS(E, expr) \
+  do { \
+    bool thrown = false; \
+    try { \
+      expr; \
+    } catch (const E&) { \
+      thrown = true; \
+    } \
+    if (!thrown) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": expected " #E " from: " #expr << std::endl; \
+      exit(1); \
+    } \
+  } while (0)
+
+namespace wmsketch {
+namespace test {
+
+/**
+ * Create a temporary directory for test files, under $TMPDIR or /tmp.
+ */
+inline std::string temp_dir() {
+  const char* base = getenv("TMPDIR");
+  std::string tmpl = std::string(base ? base : "/tmp") + "/wmsketch_test.XXXXXX";
+  if (mkdtemp(&tmpl[0]) == nullptr) {
+    std::cerr << "Failed to create a temporary directory" << std::endl;
+    exit(1);
+  }
+  return tmpl;
+}
+
+} // namespace test
+} // namespace wmsketch
+
+#endif /* TESTS_CHECK_H_ */
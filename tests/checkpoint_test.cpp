@@ -0,0 +1,281 @@
+/*
+ * Round trips of checkpoint files and of full and delta model checkpoints, and rejection of truncated and corrupted
+ * checkpoints.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "checkpoint.h"
+#include "topk.h"
+
+using namespace wmsketch;
+
+namespace {
+
+typedef std::vector<std::pair<uint32_t, float> > Example;
+
+std::string read_file(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& path, const std::string& data) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(data.data(), data.size());
+}
+
+void write_records(const std::string& path) {
+  std::vector<float> table(3000);
+  for (size_t i = 0; i < table.size(); i++) {
+    table[i] = i * 0.5f;
+  }
+
+  CheckpointWriter out(path, "test_model");
+  out.write_value(checkpoint_tag("VALU"), (uint64_t) 42);
+  out.write_vector(checkpoint_tag("VECT"), std::vector<uint32_t>{1, 2, 3});
+  out.write_string(checkpoint_tag("STRG"), "hello");
+  out.write_strings(checkpoint_tag("STRS"), std::vector<std::string>{"a", "", "bcd"});
+  out.write(checkpoint_tag("TABL"), table.data(), table.size() * sizeof(float), true);
+  out.write_gather(checkpoint_tag("GATH"), {{"ab", 2}, {"cde", 3}});
+  out.commit();
+}
+
+// read back every record written by write_records(), checking the contents
+void read_records(const std::string& path) {
+  CheckpointReader in(path);
+  in.expect_model("test_model");
+
+  uint64_t val;
+  in.read_value(checkpoint_tag("VALU"), val);
+  CHECK(val == 42);
+
+  std::vector<uint32_t> vec;
+  in.read_vector(checkpoint_tag("VECT"), vec);
+  CHECK((vec == std::vector<uint32_t>{1, 2, 3}));
+
+  CHECK(in.read_string(checkpoint_tag("STRG")) == "hello");
+
+  std::vector<std::string> strs;
+  in.read_strings(checkpoint_tag("STRS"), strs);
+  CHECK((strs == std::vector<std::string>{"a", "", "bcd"}));
+
+  const float* table = (const float*) in.map(checkpoint_tag("TABL"), 3000 * sizeof(float));
+  CHECK((uintptr_t) table % CHECKPOINT_PAGE == 0);
+  for (size_t i = 0; i < 3000; i++) {
+    CHECK(table[i] == i * 0.5f);
+  }
+
+  CHECK(in.read_string(checkpoint_tag("GATH")) == "abcde");
+  in.finish();
+}
+
+void test_round_trip(const std::string& dir) {
+  std::string path = dir + "/records.ckpt";
+  write_records(path);
+  read_records(path);
+  CHECK_THROWS(std::runtime_error, CheckpointReader(path).expect_model("other_model"));
+
+  // records must be read in the order they were written
+  CheckpointReader in(path);
+  std::vector<uint32_t> vec;
+  CHECK_THROWS(std::runtime_error, in.read_vector(checkpoint_tag("VECT"), vec));
+}
+
+void test_uncommitted(const std::string& dir) {
+  std::string path = dir + "/uncommitted.ckpt";
+  {
+    CheckpointWriter out(path, "test_model");
+    out.write_value(checkpoint_tag("VALU"), (uint64_t) 42);
+  }
+  CHECK(access(path.c_str(), F_OK) != 0);
+  CHECK(access((path + ".tmp").c_str(), F_OK) != 0);
+}
+
+void test_truncated(const std::string& dir) {
+  std::string path = dir + "/records.ckpt";
+  std::string trunc_path = dir + "/truncated.ckpt";
+  write_records(path);
+  std::string data = read_file(path);
+
+  for (size_t len = 0; len < data.size(); len++) {
+    write_file(trunc_path, data.substr(0, len));
+    CHECK_THROWS(std::runtime_error, read_records(trunc_path));
+  }
+}
+
+void test_corrupted(const std::string& dir) {
+  std::string path = dir + "/records.ckpt";
+  std::string bad_path = dir + "/corrupted.ckpt";
+  write_records(path);
+  std::string data = read_file(path);
+
+  // header: magic, version, byte order
+  for (size_t off : {0, 8, 12}) {
+    std::string bad = data;
+    bad[off] ^= 0x5a;
+    write_file(bad_path, bad);
+    CHECK_THROWS(std::runtime_error, CheckpointReader{bad_path});
+  }
+
+  // the first record follows the 64-byte header: tag, flags, size
+  uint64_t rec = 64;
+  std::string bad = data;
+  bad[rec] ^= 0x5a;
+  write_file(bad_path, bad);
+  CHECK_THROWS(std::runtime_error, read_records(bad_path));
+
+  bad = data;
+  uint64_t huge = UINT64_MAX - 8;
+  memcpy(&bad[rec + 8], &huge, sizeof(huge));
+  write_file(bad_path, bad);
+  CHECK_THROWS(std::runtime_error, read_records(bad_path));
+
+  // a string list whose count or lengths run past the end of its record
+  for (uint64_t count : {(uint64_t) 4, UINT64_MAX}) {
+    std::string p = dir + "/strings.ckpt";
+    std::vector<uint64_t> lens = {count, 1, 1};
+    {
+      CheckpointWriter out(p, "test_model");
+      out.write_vector(checkpoint_tag("STRS"), lens);
+      out.commit();
+    }
+    CheckpointReader in(p);
+    std::vector<std::string> strs;
+    CHECK_THROWS(std::runtime_error, in.read_strings(checkpoint_tag("STRS"), strs));
+  }
+  {
+    std::string p = dir + "/strings.ckpt";
+    std::vector<uint64_t> lens = {2, 1, 100};
+    {
+      CheckpointWriter out(p, "test_model");
+      out.write_vector(checkpoint_tag("STRS"), lens);
+      out.commit();
+    }
+    CheckpointReader in(p);
+    std::vector<std::string> strs;
+    CHECK_THROWS(std::runtime_error, in.read_strings(checkpoint_tag("STRS"), strs));
+  }
+
+  // a record that is not page-aligned cannot be mapped
+  CheckpointReader in(path);
+  CHECK_THROWS(std::runtime_error, in.map(checkpoint_tag("VALU"), sizeof(uint64_t)));
+}
+
+std::vector<std::pair<Example, bool> > make_examples(uint32_t n, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<uint32_t> key(0, 999);
+  std::vector<std::pair<Example, bool> > out;
+  for (uint32_t i = 0; i < n; i++) {
+    // the estimators expect distinct keys within an example
+    Example x;
+    while (x.size() < 10) {
+      uint32_t k = key(rng);
+      bool dup = false;
+      for (const auto& f : x) dup = dup || f.first == k;
+      if (!dup) x.emplace_back(k, 1.f);
+    }
+    bool label = (x[0].first % 3 == 0) || (x[1].first < 100);
+    out.emplace_back(x, label);
+  }
+  return out;
+}
+
+void train(TopKFeatures& model, const std::vector<std::pair<Example, bool> >& examples) {
+  for (const auto& ex : examples) {
+    model.update(ex.first, ex.second);
+  }
+}
+
+template <class Model>
+void check_same(Model& a, Model& b, const std::vector<std::pair<Example, bool> >& examples) {
+  std::vector<std::pair<uint32_t, float> > ta, tb;
+  a.topk(ta);
+  b.topk(tb);
+  CHECK(ta == tb);
+  CHECK(a.bias() == b.bias());
+  for (const auto& ex : examples) {
+    CHECK(a.dot(ex.first) == b.dot(ex.first));
+  }
+}
+
+void test_model(const std::string& dir) {
+  std::string path = dir + "/model.ckpt";
+  auto examples = make_examples(2000, 1);
+  ActiveSetLogisticTopK model(32, 8, 3, 7);
+  train(model, examples);
+  CHECK(model.save(path));
+
+  ActiveSetLogisticTopK restored(32, 8, 3, 7);
+  CHECK(restored.load(path));
+  check_same(model, restored, examples);
+
+  // training continues identically from the restored state
+  auto more = make_examples(500, 2);
+  train(model, more);
+  train(restored, more);
+  check_same(model, restored, examples);
+
+  ActiveSetLogisticTopK other_seed(32, 8, 3, 8);
+  CHECK_THROWS(std::runtime_error, other_seed.load(path));
+  ActiveSetLogisticTopK other_k(16, 8, 3, 7);
+  CHECK_THROWS(std::runtime_error, other_k.load(path));
+  LogisticSketchTopK other_type(32, 8, 3, 7);
+  CHECK_THROWS(std::runtime_error, other_type.load(path));
+}
+
+void test_delta(const std::string& dir) {
+  std::string base = dir + "/base.ckpt";
+  std::string delta1 = dir + "/delta1.ckpt";
+  std::string delta2 = dir + "/delta2.ckpt";
+  auto examples = make_examples(3000, 3);
+  std::vector<std::pair<Example, bool> > part1(examples.begin(), examples.begin() + 1000);
+  std::vector<std::pair<Example, bool> > part2(examples.begin() + 1000, examples.begin() + 2000);
+  std::vector<std::pair<Example, bool> > part3(examples.begin() + 2000, examples.end());
+
+  ActiveSetLogisticTopK model(32, 10, 3, 7);
+  train(model, part1);
+  CHECK(model.save(base));
+  train(model, part2);
+  CHECK(model.save_delta(delta1));
+  train(model, part3);
+  CHECK(model.save_delta(delta2));
+
+  ActiveSetLogisticTopK restored(32, 10, 3, 7);
+  CHECK(restored.load(base));
+  CHECK_THROWS(std::runtime_error, restored.load_delta(delta2));  // deltas apply in order
+  CHECK(restored.load_delta(delta1));
+  CHECK(restored.load_delta(delta2));
+  check_same(model, restored, examples);
+
+  std::string data = read_file(delta1);
+  std::string trunc_path = dir + "/truncated_delta.ckpt";
+  for (size_t len = 0; len < data.size(); len += 7) {
+    write_file(trunc_path, data.substr(0, len));
+    ActiveSetLogisticTopK m(32, 10, 3, 7);
+    CHECK(m.load(base));
+    CHECK_THROWS(std::runtime_error, m.load_delta(trunc_path));
+  }
+}
+
+} // namespace
+
+int main() {
+  std::string dir = test::temp_dir();
+  test_round_trip(dir);
+  test_uncommitted(dir);
+  test_truncated(dir);
+  test_corrupted(dir);
+  test_model(dir);
+  test_delta(dir);
+  std::string cmd = "rm -rf '" + dir + "'";
+  CHECK(system(cmd.c_str()) == 0);
+  std::cout << "checkpoint_test: ok" << std::endl;
+  return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Round trips of encoded sketch deltas and of deltas between sketch replicas, and rejection of truncated and
+ * corrupted deltas.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "countsketch.h"
+#include "sketch_delta.h"
+
+using namespace wmsketch;
+
+namespace {
+
+SketchDelta make_delta(uint32_t nnz, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<uint32_t> gap(1, 300);
+  std::normal_distribution<float> val;
+  SketchDelta d;
+  d.depth = 4;
+  d.log2_width = 12;
+  d.steps = 1234;
+  d.decay = 0.75f;
+  d.bias = -0.5f;
+  uint32_t idx = gap(rng) - 1;  // the first index may be 0
+  for (uint32_t i = 0; i < nnz; i++) {
+    d.indices.push_back(idx);
+    d.values.push_back(val(rng));
+    idx += gap(rng);
+  }
+  return d;
+}
+
+void check_header(const SketchDelta& a, const SketchDelta& b) {
+  CHECK(a.depth == b.depth);
+  CHECK(a.log2_width == b.log2_width);
+  CHECK(a.steps == b.steps);
+  CHECK(a.decay == b.decay);
+  CHECK(a.bias == b.bias);
+  CHECK(a.indices == b.indices);
+}
+
+void test_round_trip() {
+  for (uint32_t nnz : {0, 1, 63, 64, 65, 1000}) {
+    SketchDelta d = make_delta(nnz, nnz);
+    std::string buf;
+    SketchDelta out;
+
+    d.encode(buf);
+    out.decode(buf.data(), buf.size());
+    check_header(d, out);
+    CHECK(d.values == out.values);
+
+    d.encode(buf, true);
+    out.decode(buf.data(), buf.size());
+    check_header(d, out);
+    for (size_t start = 0; start < d.values.size(); start += SketchDelta::QUANT_GROUP) {
+      float max = 0.f;
+      size_t end = std::min(start + SketchDelta::QUANT_GROUP, d.values.size());
+      for (size_t i = start; i < end; i++) {
+        max = std::max(max, std::fabs(d.values[i]));
+      }
+      for (size_t i = start; i < end; i++) {
+        CHECK(std::fabs(d.values[i] - out.values[i]) <= max / 254.f * 1.001f);
+      }
+    }
+  }
+
+  // large gaps take several bytes
+  SketchDelta d;
+  d.depth = 1;
+  d.log2_width = 31;
+  d.indices = {0, 1, 200, 70000, 2000000000u, UINT32_MAX};
+  d.values = {1.f, 2.f, 3.f, 4.f, 5.f, 6.f};
+  std::string buf;
+  d.encode(buf);
+  SketchDelta out;
+  out.decode(buf.data(), buf.size());
+  check_header(d, out);
+  CHECK(d.values == out.values);
+}
+
+void test_invalid_input() {
+  SketchDelta d = make_delta(10, 1);
+  std::string buf;
+  std::swap(d.indices[3], d.indices[4]);
+  CHECK_THROWS(std::invalid_argument, d.encode(buf));
+  d.indices[4] = d.indices[3];
+  CHECK_THROWS(std::invalid_argument, d.encode(buf));
+  d = make_delta(10, 1);
+  d.values.pop_back();
+  CHECK_THROWS(std::invalid_argument, d.encode(buf));
+}
+
+void test_truncated() {
+  for (bool quantize : {false, true}) {
+    SketchDelta d = make_delta(100, 2);
+    std::string buf;
+    d.encode(buf, quantize);
+    for (size_t len = 0; len < buf.size(); len++) {
+      SketchDelta out;
+      CHECK_THROWS(std::runtime_error, out.decode(buf.data(), len));
+    }
+
+    // trailing bytes
+    buf.push_back(0);
+    SketchDelta out;
+    CHECK_THROWS(std::runtime_error, out.decode(buf.data(), buf.size()));
+  }
+}
+
+void test_corrupted() {
+  SketchDelta d = make_delta(100, 3);
+  std::string buf;
+  d.encode(buf);
+  const size_t header = 40;
+  SketchDelta out;
+
+  std::string bad = buf;
+  bad[0] ^= 0x5a;
+  CHECK_THROWS(std::runtime_error, out.decode(bad.data(), bad.size()));
+
+  // an entry count larger than the data can hold
+  bad = buf;
+  uint64_t nnz = UINT64_MAX / 4;
+  memcpy(&bad[header - sizeof(nnz)], &nnz, sizeof(nnz));
+  CHECK_THROWS(std::runtime_error, out.decode(bad.data(), bad.size()));
+
+  // a zero gap after the first index repeats an index
+  SketchDelta small;
+  small.depth = 1;
+  small.log2_width = 4;
+  small.indices = {5, 6, 7};
+  small.values = {1.f, 2.f, 3.f};
+  small.encode(bad);
+  bad[header + 1] = 0;
+  CHECK_THROWS(std::runtime_error, out.decode(bad.data(), bad.size()));
+
+  // a varint longer than five bytes
+  bad = buf.substr(0, header) + std::string(6, (char) 0xff) + buf.substr(header);
+  CHECK_THROWS(std::runtime_error, out.decode(bad.data(), bad.size()));
+
+  // indices that overflow 32 bits
+  SketchDelta big;
+  big.depth = 1;
+  big.log2_width = 31;
+  big.indices = {UINT32_MAX - 1, UINT32_MAX};
+  big.values = {1.f, 2.f};
+  big.encode(buf);
+  bad = buf;
+  bad[header + 5] = 2;  // the gap to the second index, 1, becomes 2
+  CHECK_THROWS(std::runtime_error, out.decode(bad.data(), bad.size()));
+}
+
+void test_sketch_sync() {
+  CountSketch base(10, 3, 5);
+  std::mt19937 rng(4);
+  std::uniform_int_distribution<uint32_t> key(0, 5000);
+  for (int i = 0; i < 1000; i++) {
+    base.update(key(rng), 1.f);
+  }
+
+  // two replicas train from the same sync point, and exchange their deltas
+  CountSketch a(base), b(base);
+  a.mark_synced();
+  b.mark_synced();
+  std::vector<std::pair<uint32_t, float> > updates_a, updates_b;
+  for (int i = 0; i < 300; i++) {
+    updates_a.emplace_back(key(rng), 0.25f * (i % 5));
+    updates_b.emplace_back(key(rng), -0.5f);
+  }
+  for (const auto& u : updates_a) a.update(u.first, u.second);
+  for (const auto& u : updates_b) b.update(u.first, u.second);
+
+  SketchDelta da, db;
+  a.extract_delta(da);
+  b.extract_delta(db);
+  CHECK(da.nnz() > 0 && da.nnz() <= 300 * 3);
+
+  std::string buf;
+  SketchDelta wire;
+  db.encode(buf);
+  wire.decode(buf.data(), buf.size());
+  a.apply_delta(wire);
+  da.encode(buf);
+  wire.decode(buf.data(), buf.size());
+  b.apply_delta(wire);
+
+  CountSketch expected(base);
+  for (const auto& u : updates_a) expected.update(u.first, u.second);
+  for (const auto& u : updates_b) expected.update(u.first, u.second);
+  for (uint32_t k = 0; k <= 5000; k++) {
+    CHECK(std::fabs(a.get(k) - expected.get(k)) < 1e-4f);
+    CHECK(std::fabs(b.get(k) - expected.get(k)) < 1e-4f);
+  }
+
+  // deltas for other dimensions or with cells out of range are rejected
+  CountSketch other(11, 3, 5);
+  CHECK_THROWS(std::runtime_error, other.apply_delta(da));
+  SketchDelta bad = da;
+  bad.indices.back() = 3u << 10;
+  CHECK_THROWS(std::runtime_error, a.apply_delta(bad));
+  CountSketch unsynced(10, 3, 5);
+  CHECK_THROWS(std::runtime_error, unsynced.extract_delta(bad));
+}
+
+} // namespace
+
+int main() {
+  test_round_trip();
+  test_invalid_input();
+  test_truncated();
+  test_corrupted();
+  test_sketch_sync();
+  std::cout << "sketch_delta_test: ok" << std::endl;
+  return 0;
+}